@@ -0,0 +1,207 @@
+#pragma once
+
+#include "BallUtils.hpp"
+#include "CLUtils.hpp"
+#include "CLMultiDevice.hpp"
+
+// What the headless loop and the fallback windowed path need from a physics
+// engine. The OpenCL backends wrap the state set up by InitOpenCL and
+// InitMultiDevice, the native one lives in NativeBackend.hpp.
+class SimBackend
+{
+public:
+    virtual ~SimBackend() {}
+
+    virtual const char* Name() const = 0;
+
+    // Length of one step
+    virtual bool SetTimeStep(float deltaT) = 0;
+
+    // Runs substeps steps and returns once they are done
+    virtual bool Step(unsigned int substeps) = 0;
+
+    // Copies the current position of every ball into positions
+    virtual bool ReadPositions(cl_float2* positions) = 0;
+
+    // Same for the velocities
+    virtual bool ReadVelocities(cl_float2* velocities) = 0;
+
+    // Positions precise enough to draw, backends with a packed readback
+    // transfer less for them
+    virtual bool ReadDrawPositions(cl_float2* positions)
+    {
+        return ReadPositions(positions);
+    }
+
+    // Ids, in increasing order, and positions of those of the count balls
+    // whose centre is in [viewMin, viewMax]. Reads every position and picks
+    // them on the host, backends that cull on the device only transfer those.
+    virtual bool ReadVisiblePositions(unsigned int count, cl_float2 viewMin, cl_float2 viewMax, std::vector<cl_uint>& ids, std::vector<cl_float2>& positions)
+    {
+        AllPositions.resize(count);
+        if (!ReadDrawPositions(AllPositions.data()))
+        {
+            return false;
+        }
+
+        ids.clear();
+        positions.clear();
+        for (size_t i = 0; i < AllPositions.size(); ++i)
+        {
+            cl_float2 position = AllPositions[i];
+            if (position.x >= viewMin.x && position.y >= viewMin.y && position.x <= viewMax.x && position.y <= viewMax.y)
+            {
+                ids.push_back((cl_uint)i);
+                positions.push_back(position);
+            }
+        }
+        return true;
+    }
+
+private:
+    std::vector<cl_float2> AllPositions;
+};
+
+class CLBackend : public SimBackend
+{
+public:
+    CLState State{};
+    CLBallState Balls{};
+    CLPositionPacker Packer{};
+    CLCuller Culler{};
+    bool Initialized = false;
+
+    ~CLBackend()
+    {
+        if (Initialized)
+        {
+            ReleasePositionPacker(Packer);
+            ReleaseCuller(Culler);
+            Deallocate(State, Balls);
+        }
+    }
+
+    const char* Name() const override
+    {
+        return "opencl";
+    }
+
+    bool SetTimeStep(float deltaT) override
+    {
+        return SetTimeStepArgs(State, Balls, deltaT);
+    }
+
+    bool Step(unsigned int substeps) override
+    {
+        return RunKernels(State, Balls, substeps);
+    }
+
+    bool ReadPositions(cl_float2* positions) override
+    {
+        return ::ReadPositions(State, Balls, positions);
+    }
+
+    bool ReadVelocities(cl_float2* velocities) override
+    {
+        return ::ReadVelocities(State, Balls, velocities);
+    }
+
+    bool ReadDrawPositions(cl_float2* positions) override
+    {
+        if (Packer.Format == ReadbackFormat::Float)
+        {
+            return ReadPositions(positions);
+        }
+
+        Packed.resize(PackedPositionsSize(Packer, Balls.Count));
+        unsigned int frame = Packer.Frame;
+        cl_uint overflow = 0;
+        cl_event readEvent;
+        return EnqueuePackedRead(State, Balls, Packer, Packed.data(), &overflow, &readEvent)
+            && WaitAndRelease(readEvent)
+            && UnpackPositions(State, Balls, Packer, frame, Packed.data(), overflow, positions);
+    }
+
+    bool ReadVisiblePositions(unsigned int count, cl_float2 viewMin, cl_float2 viewMax, std::vector<cl_uint>& ids, std::vector<cl_float2>& positions) override
+    {
+        if (!Culler.CountBuf || Culler.GLShared)
+        {
+            return SimBackend::ReadVisiblePositions(count, viewMin, viewMax, ids, positions);
+        }
+        return CullPositions(State, Balls, Culler, viewMin, viewMax, ids, positions);
+    }
+
+private:
+    std::vector<unsigned char> Packed;
+};
+
+// Exchanges the slab edges through the host after every step, so the host
+// copy of the balls is always current
+class CLMultiDeviceBackend : public SimBackend
+{
+public:
+    CLMultiDevice Multi;
+    BallState& Balls;
+    bool Initialized = false;
+
+    explicit CLMultiDeviceBackend(BallState& balls)
+        : Balls(balls)
+    {
+    }
+
+    ~CLMultiDeviceBackend()
+    {
+        if (Initialized)
+        {
+            ReleaseMultiDevice(Multi);
+        }
+    }
+
+    const char* Name() const override
+    {
+        return "opencl-multi-device";
+    }
+
+    bool SetTimeStep(float deltaT) override
+    {
+        Multi.DeltaT = deltaT;
+        for (CLSlab& slab : Multi.Slabs)
+        {
+            if (!SetTimeStepArgs(slab.CL, slab.Balls, deltaT))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool Step(unsigned int substeps) override
+    {
+        for (unsigned int step = 0; step < substeps; ++step)
+        {
+            if (!StepMultiDevice(Multi, Balls))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool ReadPositions(cl_float2* positions) override
+    {
+        if (positions != Balls.Position)
+        {
+            std::copy(Balls.Position, Balls.Position + Balls.Count, positions);
+        }
+        return true;
+    }
+
+    bool ReadVelocities(cl_float2* velocities) override
+    {
+        if (velocities != Balls.Velocity)
+        {
+            std::copy(Balls.Velocity, Balls.Velocity + Balls.Count, velocities);
+        }
+        return true;
+    }
+};
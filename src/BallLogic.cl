@@ -1,56 +1,249 @@
 
 
-__kernel void update_ball(__global float* masses, __global uint* radii, __global float2* positions, __global float2* velocities, __global float* gravity, __global float* deltaT, __global uint* WinSize)
+// Build-time specialization
+//
+// Values that stay the same for a whole run are built into the program with
+// -D, see KernelBuildOptions, so the compiler folds them instead of every
+// work-item loading them. GRAVITY, RESTITUTION and IMPULSE_SCALE are the
+// constants the native backend uses too, the defaults only let the file build
+// on its own. Scenes whose balls all have the same radius define it as
+// UNIFORM_RADIUS, which drops the radius loads. The world size changes with
+// the ball count, so it is a kernel argument and every count shares a binary.
+
+#ifndef GRAVITY
+#define GRAVITY 1500.0f
+#endif
+
+// Share of the closing speed a contact gives back, and the scale of the
+// impulse the overlap resolution applies along the push-out vector
+#ifndef RESTITUTION
+#define RESTITUTION 0.85f
+#endif
+
+#ifndef IMPULSE_SCALE
+#define IMPULSE_SCALE 0.001f
+#endif
+
+uint ball_radius(__global uint* radii, uint i)
+{
+#ifdef UNIFORM_RADIUS
+    return UNIFORM_RADIUS;
+#else
+    return radii[i];
+#endif
+}
+
+void apply_gravity(float2* velocity, float deltaT)
 {
-    int index = get_global_id(0);
+    (*velocity).y += GRAVITY * deltaT;
+}
 
+void integrate_ball(float2* position, float2* velocity, uint radius, float deltaT, uint worldSize)
+{
     // Update velocity
-    velocities[index].y += *gravity * *deltaT;
+    apply_gravity(velocity, deltaT);
 
     // Update Position
-    positions[index].x += velocities[index].x * *deltaT;
-    positions[index].y += velocities[index].y * *deltaT;
+    (*position).x += (*velocity).x * deltaT;
+    (*position).y += (*velocity).y * deltaT;
 
     // Ensure its still on screen
-    positions[index].x = positions[index].x < (float)*WinSize - radii[index] ? positions[index].x : (float)*WinSize - radii[index];
-    positions[index].x = positions[index].x > (float)radii[index] ? positions[index].x : (float)radii[index];
+    (*position).x = (*position).x < (float)worldSize - radius ? (*position).x : (float)worldSize - radius;
+    (*position).x = (*position).x > (float)radius ? (*position).x : (float)radius;
 
-    positions[index].y = positions[index].y < (float)*WinSize - radii[index] ? positions[index].y : (float)*WinSize - radii[index];
-    positions[index].y = positions[index].y > (float)radii[index] ? positions[index].y : (float)radii[index];
+    (*position).y = (*position).y < (float)worldSize - radius ? (*position).y : (float)worldSize - radius;
+    (*position).y = (*position).y > (float)radius ? (*position).y : (float)radius;
 }
 
-bool collides_with_edge_x(float2 position, uint radius, uint WinSize)
+// Sleeping bodies
+//
+// With sleeping on, a ball whose speed stays within what gravity alone adds in
+// one step (a ball resting on the floor or on other balls) for SLEEP_STEPS
+// steps while touching something is frozen. Frozen balls stay in the grid as
+// immovable obstacles but update_ball and handle_collisions only run over the
+// compacted list of awake balls. A ball touched by a moving one wakes up for
+// the next step. Without sleeping the list arguments are NULL and every ball
+// is processed.
+
+#define SLEEP_SPEED 5.0f
+#define SLEEP_STEPS 30
+
+// The ball work-item index works on: the index-th entry of the active list
+// when there is one, ball index otherwise. False past the last one, the global
+// size is padded up to a multiple of the work-group size.
+bool active_ball(uint index, uint count, __global uint* activeList, __global uint* activeCount, uint* ball)
 {
-    return (unsigned int)position.x - radius <= 0 || (unsigned int)position.x + radius >= WinSize;
+    if (activeList)
+    {
+        if (index >= *activeCount)
+        {
+            return false;
+        }
+
+        *ball = activeList[index];
+        return true;
+    }
+
+    *ball = index;
+    return index < count;
 }
 
-bool collides_with_edge_y(float2 position, uint radius, uint WinSize)
+// Swept collisions
+//
+// With swept collisions on, update_ball only applies gravity and leaves moving
+// the balls to handle_collisions. find_first_impacts sweeps every ball along
+// its velocity against its neighbours over the whole step and notes which one
+// it hits first. When two balls hit each other first, handle_collisions moves
+// both to the time of impact, bounces them and carries on with the rest of the
+// step. A ball whose first hit is busy with another one stops at the contact
+// instead, so no ball bounces off a ball that doesn't bounce back. The rest of
+// the step after a bounce is swept again and stops at the next contact, which
+// is left to the overlap pass of the next step. Last, balls are reflected off
+// the walls they crossed. Only one bounce is resolved per ball and step, and
+// each sweep assumes the neighbours keep the velocity they started the step
+// with, so a ball can still clip a neighbour whose own bounce puts it in the
+// way. Overlaps the step started with are pushed apart before the balls move.
+// update_ball also keeps the largest speed in maxSpeed, so the sweeps know how
+// many grid cells a neighbour can come from. Without swept collisions maxSpeed
+// and firstImpacts are NULL.
+
+#define NO_IMPACT 0xFFFFFFFF
+
+__kernel void update_ball(__global float* masses, __global uint* radii, __global float2* positions, __global float2* velocities, float deltaT, uint worldSize, uint count,
+                          __global uint* activeList, __global uint* activeCount, __global uint* maxSpeed)
 {
-    return (unsigned int)position.y - radius <= 0 || (unsigned int)position.y + radius >= WinSize;
+    uint index;
+    if (!active_ball(get_global_id(0), count, activeList, activeCount, &index))
+    {
+        return;
+    }
+
+    float2 velocity = velocities[index];
+    if (maxSpeed)
+    {
+        apply_gravity(&velocity, deltaT);
+        velocities[index] = velocity;
+
+        // Non-negative floats order the same as their bits
+        atomic_max(maxSpeed, as_uint(length(velocity)));
+        return;
+    }
+
+    float2 position = positions[index];
+    integrate_ball(&position, &velocity, ball_radius(radii, index), deltaT, worldSize);
+
+    positions[index] = position;
+    velocities[index] = velocity;
+}
+
+// When two balls moving in a straight line over the step first touch, as a
+// fraction of the step. 0 when they touch already and close in, 1 when they
+// don't touch within the step or move apart.
+float time_of_impact(float2 delta, float2 motion, float reach)
+{
+    float c = dot(delta, delta) - reach * reach;
+    float b = dot(delta, motion);
+    if (b >= 0.0f)
+    {
+        return 1.0f;
+    }
+
+    if (c <= 0.0f)
+    {
+        return 0.0f;
+    }
+
+    float a = dot(motion, motion);
+    float discriminant = b * b - a * c;
+    if (discriminant < 0.0f)
+    {
+        return 1.0f;
+    }
+
+    return min((-b - sqrt(discriminant)) / a, 1.0f);
 }
 
-void handle_wall_collision(float2 position, uint radius, uint WinSize, __global float2* velocity)
+// Velocity change of ball 1 from bouncing off ball 2 along normal
+float2 impact_velocity_change(float2 velocity1, float im1, float2 velocity2, float im2, float2 normal)
 {
-    if (collides_with_edge_x(position, radius, WinSize))
+    float vn = dot(velocity1 - velocity2, normal);
+    if (vn >= 0.0f)
+    {
+        return 0.0f;
+    }
+
+    return normal * (-(1.0f + RESTITUTION) * vn / (im1 + im2) * im1);
+}
+
+// Mirrors a ball that crossed a wall back inside, the same as bouncing it at
+// the time it reached the wall
+void reflect_off_walls(float2* position, float2* velocity, float radius, uint worldSize)
+{
+    float farSide = (float)worldSize - radius;
+
+    if ((*position).x < radius)
+    {
+        (*position).x = 2.0f * radius - (*position).x;
+        (*velocity).x = fabs((*velocity).x);
+    }
+    else if ((*position).x > farSide)
+    {
+        (*position).x = 2.0f * farSide - (*position).x;
+        (*velocity).x = -fabs((*velocity).x);
+    }
+
+    if ((*position).y < radius)
+    {
+        (*position).y = 2.0f * radius - (*position).y;
+        (*velocity).y = fabs((*velocity).y);
+    }
+    else if ((*position).y > farSide)
+    {
+        (*position).y = 2.0f * farSide - (*position).y;
+        (*velocity).y = -fabs((*velocity).y);
+    }
+
+    // Only a ball crossing the whole world in one step gets this far
+    (*position) = clamp(*position, radius, farSide);
+}
+
+bool collides_with_edge_x(float2 position, uint radius, uint worldSize)
+{
+    return (unsigned int)position.x - radius <= 0 || (unsigned int)position.x + radius >= worldSize;
+}
+
+bool collides_with_edge_y(float2 position, uint radius, uint worldSize)
+{
+    return (unsigned int)position.y - radius <= 0 || (unsigned int)position.y + radius >= worldSize;
+}
+
+void handle_wall_collision(float2 position, uint radius, float2* velocity, uint worldSize)
+{
+    if (collides_with_edge_x(position, radius, worldSize))
     {
         float vX = (*velocity).x;
         (*velocity).x = -vX;
     }
 
-    if (collides_with_edge_y(position, radius, WinSize))
+    if (collides_with_edge_y(position, radius, worldSize))
     {
         float vY = (*velocity).y;
         (*velocity).y = -vY;
     }
 }
 
-void handle_ball_ball_collision(__global float* masses, __global uint* radii, __global float2* positions, __global float2* velocities, uint ballIndex1, uint ballIndex2)
+// Resolves the contact between two balls from the point of view of ball 1
+// only. The push-out and impulse for ball 1 are added to correction and
+// deltaV; ball 2 gets the mirrored values when its own work-item visits the
+// pair, so no work-item ever writes another ball's state. lowerIndex tells
+// whether ball 1 has the lower index of the two.
+void resolve_contact(float2 position1, float2 velocity1, float im1, float radius1,
+                     float2 position2, float2 velocity2, float im2, float radius2,
+                     bool lowerIndex, float2* correction, float2* deltaV)
 {
-    float2 delta;
-    delta.x = positions[ballIndex1].x - positions[ballIndex2].x;
-    delta.y = positions[ballIndex1].y - positions[ballIndex2].y;
+    float2 delta = position1 - position2;
 
-    float r = (float)radii[ballIndex1] + (float)radii[ballIndex2];
+    float r = radius1 + radius2;
     float dist2 = dot(delta, delta);
 
     if (dist2 >= r * r)
@@ -63,51 +256,742 @@ void handle_ball_ball_collision(__global float* masses, __global uint* radii, __
     float2 mtd;
     if (d != 0.0f)
     {
-        mtd = delta * ((((float)radii[ballIndex1] + (float)radii[ballIndex2]) - d)/d);
+        mtd = delta * ((r - d)/d);
     }
     else
     {
-        d = (float)radii[ballIndex1] +  (float)radii[ballIndex2] - 1.0f;
-        delta.x = radii[ballIndex1] + radii[ballIndex2];
-        delta.y = 0.0f;
-        mtd.x = delta.x * ((((float)radii[ballIndex1] + (float)radii[ballIndex2]) - d)/d);
-        mtd.y = delta.y * ((((float)radii[ballIndex1] + (float)radii[ballIndex2]) - d)/d);
+        // Perfectly overlapping centres, separate along x with the lower index
+        // going right so both sides agree on the direction
+        d = r - 1.0f;
+        mtd.x = (lowerIndex ? r : -r) * ((r - d)/d);
+        mtd.y = 0.0f;
     }
 
-    float im1 = 1 / masses[ballIndex1]; // inverse mass quantities
-    float im2 = 1 / masses[ballIndex1];
-
-    positions[ballIndex1] = positions[ballIndex1] + (mtd * (im1 / (im1 + im2)));
-    positions[ballIndex2] = positions[ballIndex2] - (mtd * (im1 / (im1 + im2)));
+    *correction += mtd * (im1 / (im1 + im2));
 
-    float2 v;
-    v.x = velocities[ballIndex1].x - velocities[ballIndex2].x;
-    v.y = velocities[ballIndex1].y - velocities[ballIndex2].y;
+    float2 v = velocity1 - velocity2;
 
     float vn = dot(v, normalize(mtd));
 
     if (vn > 0.0f) return;
 
-    float i = (-(1.0f + 0.85f) * vn) / (im1 + im2);
+    float i = (-(1.0f + RESTITUTION) * vn) / (im1 + im2);
     float2 impulse;
-    impulse.x = mtd.x * i * 0.001f;
-    impulse.y = mtd.y * i * 0.001f;
+    impulse.x = mtd.x * i * IMPULSE_SCALE;
+    impulse.y = mtd.y * i * IMPULSE_SCALE;
 
-    velocities[ballIndex1].x = velocities[ballIndex1].x + (impulse.x * im1);
-    velocities[ballIndex1].y = velocities[ballIndex1].y + (impulse.y * im1);
+    *deltaV += impulse * im1;
+}
 
-    velocities[ballIndex1].x = velocities[ballIndex2].x - (impulse.x * im2);
-    velocities[ballIndex1].y = velocities[ballIndex2].y - (impulse.y * im2);
+void handle_ball_ball_collision(__global float* masses, __global uint* radii, __global float2* positions, __global float2* velocities,
+                                uint ballIndex1, uint ballIndex2, float2* correction, float2* deltaV)
+{
+    resolve_contact(positions[ballIndex1], velocities[ballIndex1], 1 / masses[ballIndex1], (float)ball_radius(radii, ballIndex1),
+                    positions[ballIndex2], velocities[ballIndex2], 1 / masses[ballIndex2], (float)ball_radius(radii, ballIndex2),
+                    ballIndex1 < ballIndex2, correction, deltaV);
 }
 
-__kernel void handle_collisions(__global float* masses, __global uint* radii, __global float2* positions, __global float2* velocities, __global uint* count, __global uint* WinSize)
+// Uniform grid broadphase
+//
+// Balls are binned into square cells at least one ball diameter wide, so a
+// ball can only touch balls in its own cell or the 8 around it. Each step the
+// (cell, ball) pairs are sorted by cell, which turns every cell into a
+// contiguous range of the sorted array described by cellStart/cellEnd.
+
+#define EMPTY_CELL 0xFFFFFFFF
+
+int2 cell_coords(float2 position, float cellSize, uint gridDim)
+{
+    int2 cell;
+    cell.x = clamp((int)(position.x / cellSize), 0, (int)gridDim - 1);
+    cell.y = clamp((int)(position.y / cellSize), 0, (int)gridDim - 1);
+    return cell;
+}
+
+__kernel void compute_cell_keys(__global float2* positions, __global uint2* cellKeys, uint count, uint keyCount, float cellSize, uint gridDim)
 {
-    int i = get_global_id(0);
+    uint i = get_global_id(0);
+
+    if (i >= keyCount)
+    {
+        return;
+    }
 
-    handle_wall_collision(positions[i], radii[i], *WinSize, &velocities[i]);
+    // Padding entries sort after every real cell
+    uint2 key;
+    key.x = EMPTY_CELL;
+    key.y = i;
 
-    for(int j = i + 1; j < *count; j++)
+    if (i < count)
     {
-        handle_ball_ball_collision(masses, radii, positions, velocities, i, j);
+        int2 cell = cell_coords(positions[i], cellSize, gridDim);
+        key.x = (uint)cell.y * gridDim + (uint)cell.x;
     }
-}
\ No newline at end of file
+
+    cellKeys[i] = key;
+}
+
+// One compare-and-swap stage of a bitonic sort over a power of two sized array.
+// Keys compare by cell then by ball index, so the order is fully deterministic.
+__kernel void bitonic_sort_step(__global uint2* cellKeys, uint stage, uint pass, uint keyCount)
+{
+    uint i = get_global_id(0);
+    uint partner = i ^ pass;
+
+    if (i >= keyCount || partner <= i)
+    {
+        return;
+    }
+
+    uint2 a = cellKeys[i];
+    uint2 b = cellKeys[partner];
+
+    bool ascending = (i & stage) == 0;
+    bool greater = a.x > b.x || (a.x == b.x && a.y > b.y);
+
+    if (greater == ascending)
+    {
+        cellKeys[i] = b;
+        cellKeys[partner] = a;
+    }
+}
+
+__kernel void reset_cells(__global uint* cellStart, uint cellCount)
+{
+    uint i = get_global_id(0);
+
+    if (i < cellCount)
+    {
+        cellStart[i] = EMPTY_CELL;
+    }
+}
+
+__kernel void find_cell_bounds(__global uint2* cellKeys, __global uint* cellStart, __global uint* cellEnd, uint count)
+{
+    uint i = get_global_id(0);
+
+    if (i >= count)
+    {
+        return;
+    }
+
+    uint cell = cellKeys[i].x;
+
+    if (i == 0 || cellKeys[i - 1].x != cell)
+    {
+        cellStart[cell] = i;
+    }
+
+    if (i == count - 1 || cellKeys[i + 1].x != cell)
+    {
+        cellEnd[cell] = i + 1;
+    }
+}
+
+// Morton reordering
+//
+// Every few steps the balls are sorted along a Z-order curve over the grid
+// cells, so balls close in space sit close in memory and the work-items of a
+// work-group read neighbouring addresses. The keys go through the same sort as
+// the broadphase. Every per-ball array is then gathered into the new order and
+// ids, gathered along, tells which ball every slot holds.
+
+// Spreads the low 16 bits of v over the even bits
+uint spread_bits(uint v)
+{
+    v &= 0xFFFF;
+    v = (v | (v << 8)) & 0x00FF00FF;
+    v = (v | (v << 4)) & 0x0F0F0F0F;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+__kernel void compute_morton_keys(__global float2* positions, __global uint2* cellKeys, uint count, uint keyCount, float cellSize, uint gridDim)
+{
+    uint i = get_global_id(0);
+
+    if (i >= keyCount)
+    {
+        return;
+    }
+
+    uint2 key;
+    key.x = EMPTY_CELL;
+    key.y = i;
+
+    if (i < count)
+    {
+        int2 cell = cell_coords(positions[i], cellSize, gridDim);
+        key.x = spread_bits((uint)cell.x) | (spread_bits((uint)cell.y) << 1);
+    }
+
+    cellKeys[i] = key;
+}
+
+// Slot i of the new order takes the ball in slot sortedKeys[i].y of the old
+// one. Also moves the float arrays, they are words all the same.
+__kernel void permute_words(__global uint* values, __global uint* permuted, __global uint2* sortedKeys, uint count)
+{
+    uint i = get_global_id(0);
+
+    if (i < count)
+    {
+        permuted[i] = values[sortedKeys[i].y];
+    }
+}
+
+__kernel void permute_vectors(__global float2* values, __global float2* permuted, __global uint2* sortedKeys, uint count)
+{
+    uint i = get_global_id(0);
+
+    if (i < count)
+    {
+        permuted[i] = values[sortedKeys[i].y];
+    }
+}
+
+// Puts a per-ball array back in the order the balls were created in
+__kernel void scatter_by_id(__global float2* values, __global uint* ids, __global float2* ordered, uint count)
+{
+    uint i = get_global_id(0);
+
+    if (i < count)
+    {
+        ordered[ids[i]] = values[i];
+    }
+}
+
+// Grid cells around a ball's own a neighbour can reach it from within the step
+int neighbour_reach(__global uint* maxSpeed, float deltaT, float cellSize)
+{
+    if (!maxSpeed)
+    {
+        return 1;
+    }
+
+    // Two balls closing in at the top speed
+    return 1 + (int)ceil(2.0f * as_float(*maxSpeed) * deltaT / cellSize);
+}
+
+// First pass of the swept collisions, see update_ball: the neighbour every
+// ball hits first in the step, or NO_IMPACT
+__kernel void find_first_impacts(__global uint* radii, __global float2* positions, __global float2* velocities,
+                                 __global uint2* cellKeys, __global uint* cellStart, __global uint* cellEnd, float cellSize, uint gridDim, uint count,
+                                 __global uint* activeList, __global uint* activeCount, __global uint* asleep,
+                                 float deltaT, __global uint* maxSpeed, __global uint* firstImpacts)
+{
+    uint i;
+    if (!active_ball(get_global_id(0), count, activeList, activeCount, &i))
+    {
+        return;
+    }
+
+    float2 position = positions[i];
+    float2 velocity = velocities[i];
+    uint radius = ball_radius(radii, i);
+    float dt = deltaT;
+    int reach = neighbour_reach(maxSpeed, dt, cellSize);
+
+    float firstImpact = 1.0f;
+    uint partner = NO_IMPACT;
+
+    int2 cell = cell_coords(position, cellSize, gridDim);
+
+    for (int y = max(cell.y - reach, 0); y <= min(cell.y + reach, (int)gridDim - 1); ++y)
+    {
+        for (int x = max(cell.x - reach, 0); x <= min(cell.x + reach, (int)gridDim - 1); ++x)
+        {
+            uint neighbourCell = (uint)y * gridDim + (uint)x;
+            uint start = cellStart[neighbourCell];
+            if (start == EMPTY_CELL)
+            {
+                continue;
+            }
+
+            uint end = cellEnd[neighbourCell];
+            for (uint k = start; k < end; ++k)
+            {
+                uint j = cellKeys[k].y;
+                if (j == i)
+                {
+                    continue;
+                }
+
+                float2 otherVelocity = asleep && asleep[j] ? (float2)(0.0f, 0.0f) : velocities[j];
+                float impact = time_of_impact(position - positions[j], (velocity - otherVelocity) * dt, (float)(radius + ball_radius(radii, j)));
+
+                // Ties go to the lower index, whatever order the cells are visited in
+                if (impact < firstImpact || (impact == firstImpact && impact < 1.0f && j < partner))
+                {
+                    firstImpact = impact;
+                    partner = j;
+                }
+            }
+        }
+    }
+
+    firstImpacts[i] = partner;
+}
+
+// How far into the rest of the step, starting from firstImpact, a ball that
+// bounced off partner gets on its new velocity before it touches another ball
+float remaining_impact(__global uint* radii, __global float2* positions, __global float2* velocities,
+                       __global uint2* cellKeys, __global uint* cellStart, __global uint* cellEnd, float cellSize, uint gridDim,
+                       __global uint* asleep, __global uint* maxSpeed, uint i, uint partner,
+                       float2 position, float2 velocity, float radius, float deltaT, float firstImpact)
+{
+    float remaining = deltaT * (1.0f - firstImpact);
+    float reach = (length(velocity) + as_float(*maxSpeed)) * remaining;
+    int cells = 1 + (int)ceil(reach / cellSize);
+
+    float nextImpact = 1.0f;
+    int2 cell = cell_coords(position, cellSize, gridDim);
+
+    for (int y = max(cell.y - cells, 0); y <= min(cell.y + cells, (int)gridDim - 1); ++y)
+    {
+        for (int x = max(cell.x - cells, 0); x <= min(cell.x + cells, (int)gridDim - 1); ++x)
+        {
+            uint neighbourCell = (uint)y * gridDim + (uint)x;
+            uint start = cellStart[neighbourCell];
+            if (start == EMPTY_CELL)
+            {
+                continue;
+            }
+
+            uint end = cellEnd[neighbourCell];
+            for (uint k = start; k < end; ++k)
+            {
+                uint j = cellKeys[k].y;
+                if (j == i || j == partner)
+                {
+                    continue;
+                }
+
+                float2 otherVelocity = asleep && asleep[j] ? (float2)(0.0f, 0.0f) : velocities[j];
+                float2 otherPosition = positions[j] + otherVelocity * (deltaT * firstImpact);
+                float impact = time_of_impact(position - otherPosition, (velocity - otherVelocity) * remaining, radius + (float)ball_radius(radii, j));
+                nextImpact = min(nextImpact, impact);
+            }
+        }
+    }
+
+    return nextImpact;
+}
+
+// Gather pass: every work-item reads the state of the previous step and writes
+// only its own ball to the output buffers. Neighbours are visited in sorted key
+// order, so the sums are evaluated in the same order on every run. With
+// sleeping on it also counts the steps its ball spent at rest and raises the
+// wake flag of the sleeping balls a moving ball touches. With swept collisions
+// on it also moves the ball, see update_ball.
+__kernel void handle_collisions(__global float* masses, __global uint* radii, __global float2* positions, __global float2* velocities,
+                                __global float2* positionsOut, __global float2* velocitiesOut,
+                                __global uint2* cellKeys, __global uint* cellStart, __global uint* cellEnd, float cellSize, uint gridDim, uint count,
+                                __global uint* activeList, __global uint* activeCount, __global uint* asleep, __global uint* quietSteps, __global uint* wakeFlags,
+                                float deltaT, uint worldSize, __global uint* maxSpeed, __global uint* firstImpacts)
+{
+    uint i;
+    if (!active_ball(get_global_id(0), count, activeList, activeCount, &i))
+    {
+        return;
+    }
+
+    float2 position = positions[i];
+    float2 velocity = velocities[i];
+    uint ballRadius = ball_radius(radii, i);
+    float radius = (float)ballRadius;
+    float dt = deltaT;
+
+    int reach = neighbour_reach(maxSpeed, dt, cellSize);
+
+    bool onWall;
+    uint partner = NO_IMPACT;
+    bool mutual = false;
+    if (maxSpeed)
+    {
+        // Within a unit of the floor or ceiling, the ball isn't on it yet
+        onWall = position.y - radius <= 1.0f || position.y + radius >= (float)worldSize - 1.0f;
+
+        // A sleeping partner holds still, so it always takes the hit
+        partner = firstImpacts[i];
+        mutual = partner != NO_IMPACT && ((asleep && asleep[partner]) || firstImpacts[partner] == i);
+    }
+    else
+    {
+        onWall = collides_with_edge_y(position, ballRadius, worldSize);
+        handle_wall_collision(position, ballRadius, &velocity, worldSize);
+    }
+
+    float2 correction = 0.0f;
+    float2 deltaV = 0.0f;
+
+    // The first impact of the step and the velocity change it causes
+    float firstImpact = 1.0f;
+    float2 impactDeltaV = 0.0f;
+
+    float sleepSpeed = 0.0f;
+    bool moving = true;
+    if (asleep)
+    {
+        sleepSpeed = SLEEP_SPEED + fabs(GRAVITY) * dt;
+        moving = length(velocity) > sleepSpeed;
+    }
+
+    int2 cell = cell_coords(position, cellSize, gridDim);
+
+    for (int y = max(cell.y - reach, 0); y <= min(cell.y + reach, (int)gridDim - 1); ++y)
+    {
+        for (int x = max(cell.x - reach, 0); x <= min(cell.x + reach, (int)gridDim - 1); ++x)
+        {
+            uint neighbourCell = (uint)y * gridDim + (uint)x;
+            uint start = cellStart[neighbourCell];
+            if (start == EMPTY_CELL)
+            {
+                continue;
+            }
+
+            uint end = cellEnd[neighbourCell];
+            for (uint k = start; k < end; ++k)
+            {
+                uint j = cellKeys[k].y;
+                if (j == i)
+                {
+                    continue;
+                }
+
+                // A sleeping ball doesn't move, so it takes the whole contact like a wall
+                bool sleeping = asleep && asleep[j];
+                float2 otherVelocity = sleeping ? (float2)(0.0f, 0.0f) : velocities[j];
+                float otherIm = sleeping ? 0.0f : 1 / masses[j];
+
+                float impact = 1.0f;
+                if (maxSpeed)
+                {
+                    float2 delta = position - positions[j];
+                    impact = time_of_impact(delta, (velocity - otherVelocity) * dt, radius + (float)ball_radius(radii, j));
+                    if (j == partner)
+                    {
+                        firstImpact = impact;
+                        if (mutual)
+                        {
+                            float2 normal = normalize(delta + (velocity - otherVelocity) * (dt * impact));
+                            impactDeltaV = impact_velocity_change(velocity, 1 / masses[i], otherVelocity, otherIm, normal);
+                        }
+                    }
+                }
+
+                if (sleeping)
+                {
+                    float2 delta = position - positions[j];
+                    float touch = radius + (float)ball_radius(radii, j);
+                    if (moving && (dot(delta, delta) < touch * touch || impact < 1.0f))
+                    {
+                        wakeFlags[j] = 1;
+                    }
+
+                    resolve_contact(position, velocity, 1 / masses[i], radius,
+                                    positions[j], otherVelocity, otherIm, (float)ball_radius(radii, j),
+                                    i < j, &correction, &deltaV);
+                }
+                else
+                {
+                    handle_ball_ball_collision(masses, radii, positions, velocities, i, j, &correction, &deltaV);
+                }
+            }
+        }
+    }
+
+    bool overlapped = correction.x != 0.0f || correction.y != 0.0f;
+    if (maxSpeed)
+    {
+        // The corrections belong to the positions the step started from, so
+        // apply them there and let the walls see where the ball really goes
+        position += correction;
+        correction = 0.0f;
+
+        // Up to the first impact, then on with the velocity it leaves if the
+        // partner bounced too, until the ball touches the next one
+        position += velocity * (dt * firstImpact);
+        if (mutual)
+        {
+            velocity += impactDeltaV;
+            float nextImpact = remaining_impact(radii, positions, velocities, cellKeys, cellStart, cellEnd, cellSize, gridDim,
+                                                asleep, maxSpeed, i, partner, position, velocity, radius, dt, firstImpact);
+            position += velocity * (dt * (1.0f - firstImpact) * nextImpact);
+        }
+        reflect_off_walls(&position, &velocity, radius, worldSize);
+    }
+
+    float2 velocityOut = velocity + deltaV;
+    if (asleep)
+    {
+        bool inContact = onWall || firstImpact < 1.0f || overlapped;
+        uint quiet = inContact && length(velocityOut) <= sleepSpeed ? min(quietSteps[i] + 1, (uint)SLEEP_STEPS) : 0;
+        quietSteps[i] = quiet;
+
+        // Comes to rest, update_sleep freezes it before the next step
+        if (quiet == SLEEP_STEPS)
+        {
+            velocityOut = 0.0f;
+        }
+    }
+
+    positionsOut[i] = position + correction;
+    velocitiesOut[i] = velocityOut;
+}
+
+// Runs over every ball before a step with sleeping on: wakes the balls touched
+// in the last step, freezes the ones that came to rest and flags the awake
+// ones for the active list scan.
+__kernel void update_sleep(__global float2* positions, __global float2* velocities, __global float2* positionsOut, __global float2* velocitiesOut,
+                           __global uint* asleep, __global uint* quietSteps, __global uint* wakeFlags, __global uint* activeScan, uint count)
+{
+    uint i = get_global_id(0);
+
+    if (i >= count)
+    {
+        return;
+    }
+
+    uint sleeping = asleep[i];
+    if (wakeFlags[i])
+    {
+        wakeFlags[i] = 0;
+        quietSteps[i] = 0;
+        sleeping = 0;
+    }
+    else if (!sleeping && quietSteps[i] == SLEEP_STEPS)
+    {
+        // Both state buffers hold the frozen ball, so it stays put whichever one is current
+        sleeping = 1;
+        positionsOut[i] = positions[i];
+        velocitiesOut[i] = velocities[i];
+    }
+
+    asleep[i] = sleeping;
+    activeScan[i] = !sleeping;
+}
+
+// Active list compaction
+//
+// A work-efficient exclusive scan (Blelloch) of the awake flags gives every
+// awake ball its slot in the active list. Each work-group scans a block of
+// twice its size in local memory and leaves the block's total in blockSums.
+// The totals are scanned the same way, level by level, and added back to
+// their blocks. The total of the last level is the number of awake balls.
+__kernel void scan_blocks(__global uint* data, __global uint* blockSums, uint n, __local uint* temp)
+{
+    uint localIndex = get_local_id(0);
+    uint groupSize = get_local_size(0);
+    uint blockSize = 2 * groupSize;
+    uint a = get_group_id(0) * blockSize + localIndex;
+    uint b = a + groupSize;
+
+    temp[localIndex] = a < n ? data[a] : 0;
+    temp[localIndex + groupSize] = b < n ? data[b] : 0;
+
+    // Up-sweep, builds partial sums in place
+    uint offset = 1;
+    for (uint d = groupSize; d > 0; d >>= 1)
+    {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (localIndex < d)
+        {
+            temp[offset * (2 * localIndex + 2) - 1] += temp[offset * (2 * localIndex + 1) - 1];
+        }
+        offset <<= 1;
+    }
+
+    if (localIndex == 0)
+    {
+        blockSums[get_group_id(0)] = temp[blockSize - 1];
+        temp[blockSize - 1] = 0;
+    }
+
+    // Down-sweep, turns them into the exclusive prefix sums
+    for (uint d = 1; d < blockSize; d <<= 1)
+    {
+        offset >>= 1;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (localIndex < d)
+        {
+            uint left = offset * (2 * localIndex + 1) - 1;
+            uint right = offset * (2 * localIndex + 2) - 1;
+            uint sum = temp[left];
+            temp[left] = temp[right];
+            temp[right] += sum;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (a < n)
+    {
+        data[a] = temp[localIndex];
+    }
+    if (b < n)
+    {
+        data[b] = temp[localIndex + groupSize];
+    }
+}
+
+__kernel void add_block_offsets(__global uint* data, __global uint* blockOffsets, uint n, uint blockSize)
+{
+    uint i = get_global_id(0);
+
+    if (i < n)
+    {
+        data[i] += blockOffsets[i / blockSize];
+    }
+}
+
+// Awake balls keep their index order in the list, so neighbours in memory stay neighbours
+__kernel void scatter_active(__global uint* asleep, __global uint* activeScan, __global uint* activeList, uint count)
+{
+    uint i = get_global_id(0);
+
+    if (i < count && !asleep[i])
+    {
+        activeList[activeScan[i]] = i;
+    }
+}
+
+// Fused integrate-and-collide step for dense scenes, all pairs like an N-body
+// kernel. The work-group loads the balls one tile at a time into local memory,
+// integrating them on the way in, so every ball is read from global memory once
+// per work-group instead of once per work-item and update_ball is not needed.
+// The global size is padded to a multiple of the local size.
+__kernel void step_tiled(__global float* masses, __global uint* radii, __global float2* positions, __global float2* velocities,
+                         __global float2* positionsOut, __global float2* velocitiesOut,
+                         float deltaT, uint worldSize, uint count,
+                         __local float2* tilePositions, __local float2* tileVelocities, __local float* tileInvMasses, __local float* tileRadii)
+{
+    uint i = get_global_id(0);
+    uint localIndex = get_local_id(0);
+    uint tileSize = get_local_size(0);
+    bool active = i < count;
+
+    float2 position = 0.0f;
+    float2 velocity = 0.0f;
+    float invMass = 0.0f;
+    float radius = 0.0f;
+    if (active)
+    {
+        position = positions[i];
+        velocity = velocities[i];
+        invMass = 1 / masses[i];
+        radius = (float)ball_radius(radii, i);
+        integrate_ball(&position, &velocity, ball_radius(radii, i), deltaT, worldSize);
+    }
+
+    float2 correction = 0.0f;
+    float2 deltaV = 0.0f;
+
+    for (uint tileStart = 0; tileStart < count; tileStart += tileSize)
+    {
+        uint j = tileStart + localIndex;
+        if (j < count)
+        {
+            float2 tilePosition = positions[j];
+            float2 tileVelocity = velocities[j];
+            integrate_ball(&tilePosition, &tileVelocity, ball_radius(radii, j), deltaT, worldSize);
+
+            tilePositions[localIndex] = tilePosition;
+            tileVelocities[localIndex] = tileVelocity;
+            tileInvMasses[localIndex] = 1 / masses[j];
+            tileRadii[localIndex] = (float)ball_radius(radii, j);
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        uint tileCount = min(tileSize, count - tileStart);
+        for (uint k = 0; active && k < tileCount; ++k)
+        {
+            if (tileStart + k != i)
+            {
+                resolve_contact(position, velocity, invMass, radius,
+                                tilePositions[k], tileVelocities[k], tileInvMasses[k], tileRadii[k],
+                                i < tileStart + k, &correction, &deltaV);
+            }
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (!active)
+    {
+        return;
+    }
+
+    handle_wall_collision(position, ball_radius(radii, i), &velocity, worldSize);
+
+    positionsOut[i] = position + correction;
+    velocitiesOut[i] = velocity + deltaV;
+}
+
+// Position readback for drawing
+//
+// Every coordinate becomes a 16-bit fraction of the world, kept in quantized
+// for the next frame. In the delta format the change against previous, the
+// values of the frame before, also goes out as a signed byte. When one doesn't
+// fit overflow is raised and the host reads the 16-bit values instead.
+__kernel void pack_positions(__global float2* positions, __global ushort2* previous, __global ushort2* quantized, __global char2* deltas,
+                             __global uint* overflow, float scale, uint count)
+{
+    uint i = get_global_id(0);
+
+    if (i >= count)
+    {
+        return;
+    }
+
+    ushort2 q = convert_ushort2_sat_rte(positions[i] * scale);
+    quantized[i] = q;
+
+    if (deltas)
+    {
+        int2 delta = convert_int2(q) - convert_int2(previous[i]);
+        if (abs(delta.x) > 127 || abs(delta.y) > 127)
+        {
+            *overflow = 1;
+        }
+        deltas[i] = convert_char2_sat(delta);
+    }
+}
+
+// View culling
+//
+// Only the balls inside the camera's view are read back for drawing. The view
+// rectangle comes already grown by the largest radius, so a centre test is
+// enough. cull_visible flags the balls in view, the flags are scanned like the
+// awake flags above and compact_visible writes every visible ball's id and
+// position at its scanned slot. Positions are in the order the balls were
+// created in, so the slot index is the ball id and the list stays sorted by it.
+
+bool in_view(float2 position, float2 viewMin, float2 viewMax)
+{
+    return all(position >= viewMin) && all(position <= viewMax);
+}
+
+__kernel void cull_visible(__global float2* positions, __global uint* visible, float2 viewMin, float2 viewMax, uint count)
+{
+    uint i = get_global_id(0);
+
+    if (i < count)
+    {
+        visible[i] = in_view(positions[i], viewMin, viewMax) ? 1 : 0;
+    }
+}
+
+__kernel void compact_visible(__global float2* positions, __global uint* visibleScan, float2 viewMin, float2 viewMax,
+                              __global uint* drawIds, __global float2* drawPositions, uint count)
+{
+    uint i = get_global_id(0);
+
+    if (i < count && in_view(positions[i], viewMin, viewMax))
+    {
+        uint slot = visibleScan[i];
+        drawIds[slot] = i;
+        drawPositions[slot] = positions[i];
+    }
+}
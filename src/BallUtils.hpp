@@ -2,17 +2,46 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
 #include <random>
 #include <string>
+#include <vector>
 
 #include "glm/glm.hpp"
 
 #include "GLUtils.hpp"
+#include "MappedFile.hpp"
+#include "Options.hpp"
+#include "ThreadPool.hpp"
 
 #include "CL/cl.h"
 
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
 float gravity = 0.3f * 5000; // 9.8m/s^2 * 5000px/m
 
+// Share of the closing speed a contact gives back, and the scale of the
+// impulse the overlap resolution applies. The kernels get them through
+// KernelBuildOptions, so both backends bounce alike.
+const float Restitution = 0.85f;
+const float ImpulseScale = 0.001f;
+
+// Radii are one to three steps
+const cl_uint BallRadiusStep = 50;
+const cl_uint MaxBallRadius = 150;
+
+// Placement cells are one unit wider than the largest ball, so balls in
+// neighbouring cells never even touch
+const cl_uint PlacementCellSize = 2 * MaxBallRadius + 1;
+
+// Side of the square the balls live in, in pixels. Matches the window unless
+// a headless run needs more room for its balls or --world asks for a larger one.
+cl_uint WorldSize = WinSize;
+
 // position, velocity and radius in pixels
 struct BallState
 {
@@ -22,8 +51,119 @@ struct BallState
     cl_float2* Velocity;
     glm::vec3* Color;
     int Count;
+
+    // Second copy of the state for the kernels to write into, so that every
+    // device buffer can wrap host memory
+    cl_float2* PositionOut;
+    cl_float2* VelocityOut;
+
+    // Single block all of the arrays above are carved from, either allocated
+    // or, after a restore, a copy on write mapping of the checkpoint file
+    void* Arena;
+    MappedFile ArenaFile;
+};
+
+// Every array starts on its own page and is padded to whole pages, which is
+// what CPU and integrated GPU drivers need to use the memory without a copy
+const size_t ArenaAlignment = 4096;
+
+size_t arena_size(size_t bytes)
+{
+    return (bytes + ArenaAlignment - 1) / ArenaAlignment * ArenaAlignment;
+}
+
+void* allocate_aligned(size_t size)
+{
+#if defined(_WIN32)
+    return _aligned_malloc(size, ArenaAlignment);
+#else
+    void* block = nullptr;
+    return posix_memalign(&block, ArenaAlignment, size) == 0 ? block : nullptr;
+#endif
+}
+
+void free_aligned(void* block)
+{
+#if defined(_WIN32)
+    _aligned_free(block);
+#else
+    free(block);
+#endif
+}
+
+// Byte offset of every array in the arena, checkpoints store the arena the same way
+struct ArenaLayout
+{
+    size_t Mass;
+    size_t Radius;
+    size_t Position;
+    size_t Velocity;
+    size_t PositionOut;
+    size_t VelocityOut;
+    size_t Color;
+    size_t Size;
 };
 
+ArenaLayout arena_layout(int count)
+{
+    size_t vectorSize = arena_size(count * sizeof(cl_float2));
+
+    ArenaLayout layout;
+    layout.Mass = 0;
+    layout.Radius = layout.Mass + arena_size(count * sizeof(cl_float));
+    layout.Position = layout.Radius + arena_size(count * sizeof(cl_uint));
+    layout.Velocity = layout.Position + vectorSize;
+    layout.PositionOut = layout.Velocity + vectorSize;
+    layout.VelocityOut = layout.PositionOut + vectorSize;
+    layout.Color = layout.VelocityOut + vectorSize;
+    layout.Size = layout.Color + arena_size(count * sizeof(glm::vec3));
+    return layout;
+}
+
+// Points the arrays of balls into block, laid out by arena_layout
+void assign_arena(BallState& balls, void* block, int count)
+{
+    ArenaLayout layout = arena_layout(count);
+    char* base = (char*)block;
+
+    balls.Arena = block;
+    balls.Mass = (cl_float*)(base + layout.Mass);
+    balls.Radius = (cl_uint*)(base + layout.Radius);
+    balls.Position = (cl_float2*)(base + layout.Position);
+    balls.Velocity = (cl_float2*)(base + layout.Velocity);
+    balls.PositionOut = (cl_float2*)(base + layout.PositionOut);
+    balls.VelocityOut = (cl_float2*)(base + layout.VelocityOut);
+    balls.Color = (glm::vec3*)(base + layout.Color);
+    balls.Count = count;
+}
+
+BallState allocate_balls(int count)
+{
+    BallState balls{};
+    void* block = allocate_aligned(arena_layout(count).Size);
+    if (!block)
+    {
+        std::cerr << "Failed to allocate " << count << " balls" << std::endl;
+        std::exit(-1);
+    }
+
+    assign_arena(balls, block, count);
+    return balls;
+}
+
+void free_balls(BallState& balls)
+{
+    if (balls.ArenaFile.Data)
+    {
+        UnmapFile(balls.ArenaFile);
+    }
+    else
+    {
+        free_aligned(balls.Arena);
+    }
+    balls = BallState{};
+}
+
 bool collides(BallState& balls, int index1, int index2)
 {
     float dx = balls.Position[index1].x - balls.Position[index2].x;
@@ -32,28 +172,51 @@ bool collides(BallState& balls, int index1, int index2)
     return (unsigned int)fabs(dx*dx + dy*dy) <= rSum*rSum;
 }
 
-int rand_range(int min, int max)
+// Counter-based generator: every ball gets its own stream derived from the
+// seed and its index, so a scene is the same whatever the thread count
+struct BallRandom
+{
+    uint64_t State;
+};
+
+// SplitMix64 step
+uint64_t random_next(BallRandom& rng)
+{
+    uint64_t z = (rng.State += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+BallRandom ball_random(uint64_t seed, uint64_t index)
 {
-    std::random_device rand;
-    std::mt19937 gen(rand());
-    std::uniform_int_distribution<> distrib(min, max);
-    return distrib(gen);
+    BallRandom rng{ seed };
+    rng.State = random_next(rng) ^ index;
+    random_next(rng);
+    return rng;
 }
 
-void create_random_ball(BallState& state, unsigned int index)
+// Uniform in [min, max]
+int rand_range(BallRandom& rng, int min, int max)
 {
-    cl_uint radius = rand_range(1, 3) * 50;
+    uint64_t span = (uint64_t)(max - min) + 1;
+    return min + (int)(((random_next(rng) >> 32) * span) >> 32);
+}
+
+void create_random_ball(BallState& state, unsigned int index, BallRandom& rng)
+{
+    cl_uint radius = rand_range(rng, 1, 3) * BallRadiusStep;
     float mass = 0.5;
-    cl_float posX = rand_range(radius, WinSize - radius);
-    cl_float posY = rand_range(radius, WinSize - radius);
+    cl_float posX = rand_range(rng, radius, WorldSize - radius);
+    cl_float posY = rand_range(rng, radius, WorldSize - radius);
 
-    cl_float velY = rand_range(5, 15);
-    cl_float velX = rand_range(100, 200);
-    velX = (int) rand_range(0, 1) ? velX : -velX;
-    velY = (int) rand_range(0, 1) ? velY : -velY;
+    cl_float velY = rand_range(rng, 5, 15);
+    cl_float velX = rand_range(rng, 100, 200);
+    velX = (int) rand_range(rng, 0, 1) ? velX : -velX;
+    velY = (int) rand_range(rng, 0, 1) ? velY : -velY;
 
     glm::vec3 color;
-    switch(rand_range(0, 2))
+    switch(rand_range(rng, 0, 2))
     {
         case 0:
             color.x = 1.0f;
@@ -79,63 +242,113 @@ void create_random_ball(BallState& state, unsigned int index)
     state.Color[index] = color;
 }
 
-BallState initialize_balls(int argc, char** argv, int& count)
+// Keeps the scene no denser than the fullest windowed one, in whole placement
+// cells with at least one for every ball
+cl_uint world_size_for(int count)
 {
-    if (argc != 2)
-    {
-        std::cout << "Invalid number of arguments!" << std::endl;
-        std::exit(-1);
-    }
+    double areaPerBall = (double)WinSize * WinSize / MaxWindowedBalls;
+    double side = std::ceil(std::sqrt(count * areaPerBall));
+    double cells = std::max(std::ceil(side / PlacementCellSize), std::ceil(std::sqrt((double)count)));
+    return std::max(WinSize, (cl_uint)cells * PlacementCellSize);
+}
+
+// Jittered grid placement
+//
+// The world is cut into square cells just over one maximum ball diameter wide
+// and every ball gets a cell of its own, picked through a seeded pseudo-random
+// permutation of the cells, then a random spot inside it. A ball never leaves
+// its cell, so no two can overlap and no ball ever needs a second draw. Each
+// ball only depends on the seed and its index, which lets the balls be placed
+// in parallel and in any order. A window can hold more balls than such cells,
+// its cells then shrink to one per ball and take the balls that still fit.
 
-    int val = 0;
-    try
+// Balanced Feistel network over 2 * halfBits bits, a bijection for any seed
+uint64_t feistel(uint64_t value, unsigned int halfBits, uint64_t seed)
+{
+    uint64_t mask = (1ULL << halfBits) - 1;
+    uint64_t left = value >> halfBits;
+    uint64_t right = value & mask;
+    for (uint64_t round = 0; round < 4; ++round)
     {
-        val = std::stoi(argv[1]);
+        BallRandom rng = ball_random(seed + round, right);
+        uint64_t next = left ^ (random_next(rng) & mask);
+        left = right;
+        right = next;
     }
-    catch (std::invalid_argument& e)
+    return (left << halfBits) | right;
+}
+
+// Permutation of [0, count): the Feistel domain is the smallest even power of
+// two above count, values past the end walk the cycle until they land inside
+uint64_t permute_index(uint64_t index, uint64_t count, uint64_t seed)
+{
+    unsigned int halfBits = 1;
+    while ((1ULL << (2 * halfBits)) < count)
     {
-        std::cout << "The argument must be a number!" << std::endl;
-        std::exit(-1);
+        ++halfBits;
     }
 
-    if (val < 3 || val > 10)
+    do
     {
-        std::cout << "The argument must be in between 3 and 10!" << std::endl;
-        std::exit(-1);
-    }
+        index = feistel(index, halfBits, seed);
+    } while (index >= count);
 
-    std::cout << "Creating " << val << " balls." << std::endl;
+    return index;
+}
 
-    count = val;
+void place_in_grid_cell(BallState& balls, int index, int gridDim, cl_uint cellSize, uint64_t seed, BallRandom& rng)
+{
+    uint64_t cell = permute_index(index, (uint64_t)gridDim * gridDim, seed);
+    float cellX = (float)(cell % gridDim) * cellSize;
+    float cellY = (float)(cell / gridDim) * cellSize;
 
-    BallState balls{};
-    balls.Mass = new cl_float[val];
-    balls.Radius = new cl_uint[val];
-    balls.Position = new cl_float2[val];
-    balls.Velocity = new cl_float2[val];
-    balls.Color = new glm::vec3[val];
-    balls.Count = val;
+    // Cells narrower than PlacementCellSize take the largest ball size that
+    // still leaves the unit of slack
+    cl_uint fits = (cellSize - 1) / 2 / BallRadiusStep * BallRadiusStep;
+    balls.Radius[index] = std::min(balls.Radius[index], fits);
 
+    int radius = balls.Radius[index];
+    int span = (int)cellSize - 2 * radius - 1;
+    balls.Position[index].x = cellX + radius + rand_range(rng, 0, span);
+    balls.Position[index].y = cellY + radius + rand_range(rng, 0, span);
+}
 
-    for (int i = 0; i < val; ++i)
+BallState initialize_balls(const SimOptions& options)
+{
+    int val = options.BallCount;
+
+    WorldSize = options.Headless ? world_size_for(val) : (cl_uint)(WinSize * options.WorldScale);
+
+    std::cout << "Creating " << val << " balls in a " << WorldSize << "x" << WorldSize << " world (seed " << options.Seed << ")." << std::endl;
+
+    BallState balls = allocate_balls(val);
+
+    // Headless worlds are sized in whole cells, a window may need smaller ones
+    int gridDim = (int)(WorldSize / PlacementCellSize);
+    cl_uint cellSize = PlacementCellSize;
+    if ((int64_t)gridDim * gridDim < val)
     {
-        create_random_ball(balls, i);
+        gridDim = (int)std::ceil(std::sqrt((double)val));
+        cellSize = WorldSize / gridDim;
+    }
 
-        bool collisionFound = false;
-        for (int j = 0; j < i - 1; ++j)
-        {
-            if (collides(balls, i, j))
-            {
-                collisionFound = true;
-            }
-        }
+    uint64_t permutationSeed = ball_random(options.Seed, ~0ULL).State;
 
-        if (collisionFound)
+    WorkStealingPool pool;
+    StartPool(pool, options.Threads);
+    ParallelFor(pool, 0, val, 16384, [&](size_t first, size_t last)
+    {
+        for (size_t i = first; i < last; ++i)
         {
-            --i;
-            continue;
+            BallRandom rng = ball_random(options.Seed, i);
+            create_random_ball(balls, (unsigned int)i, rng);
+            place_in_grid_cell(balls, (int)i, gridDim, cellSize, permutationSeed, rng);
         }
+    });
+    StopPool(pool);
 
+    for (int i = 0; i < val && val <= MaxWindowedBalls; ++i)
+    {
         std::cout << "Created ball: Radius = " << balls.Radius[i]
                   << "  Pos = (" << balls.Position[i].x << ", " << balls.Position[i].y
                   << ") Velocity = (" << balls.Velocity[i].x << ", " << balls.Velocity[i].y
@@ -0,0 +1,520 @@
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "BallUtils.hpp"
+#include "CLUtils.hpp"
+#include "CLTuner.hpp"
+#include "Backend.hpp"
+#include "NativeBackend.hpp"
+#include "Options.hpp"
+#include "Profiler.hpp"
+
+// Benchmark suite
+//
+// Sweeps ball counts, densities and radius mixes, and times every scene on
+// the OpenCL device and on the native backend. OpenCL kernels and transfers
+// are timed on the device through the profiler, full steps, readbacks and
+// uploads on the host. Results go to a CSV file, one line per scene, backend
+// and metric. Given a baseline CSV from an earlier run, any metric that got
+// slower by more than the tolerance fails the run.
+
+//*********************************************************
+// Constants
+//*********************************************************
+const unsigned int BenchWarmupSteps = 5;
+const float BenchTimeStep = 1.0f / 30;
+
+// Metrics below this are mostly launch overhead and timer noise
+const double MinComparedMs = 0.05;
+
+struct BenchOptions
+{
+    std::vector<int> Counts;
+    std::vector<double> Densities; // Fraction of the max-diameter grid cells holding a ball
+    std::vector<std::string> Radii; // mixed, small or large
+    unsigned int Steps;
+    bool OpenCL;
+    bool Native;
+    unsigned int Threads;
+    unsigned long long Seed;
+    std::string OutFile;
+    std::string BaselineFile;
+    double Tolerance;
+};
+
+struct BenchResult
+{
+    std::string Scene;
+    std::string Backend;
+    std::string Metric;
+    double CallsPerStep;
+    double MsPerStep; // What the baseline comparison looks at
+    double P50Ms;
+    double P99Ms;
+};
+
+void print_bench_usage(const char* program)
+{
+    std::cout << "Usage: " << program << " [options]" << std::endl
+              << "  --counts <n,...>     Ball counts (default 1024,16384,131072)" << std::endl
+              << "  --densities <d,...>  Fractions of the grid cells holding a ball (default 0.1,0.5)" << std::endl
+              << "  --radii <r,...>      mixed, small or large radii (default mixed,small,large)" << std::endl
+              << "  --steps <n>          Timed steps per scene (default 50)" << std::endl
+              << "  --backend <b>        opencl, native or all (default all)" << std::endl
+              << "  --threads <n>        Native backend threads (default one per hardware thread)" << std::endl
+              << "  --seed <n>           Seed of the scenes (default 1)" << std::endl
+              << "  --out <file>         Results CSV (default bench_results.csv)" << std::endl
+              << "  --baseline <file>    Fail when a metric is slower than in this results CSV" << std::endl
+              << "  --tolerance <f>      Allowed slowdown over the baseline (default 0.15)" << std::endl;
+}
+
+std::vector<std::string> split_list(const std::string& list)
+{
+    std::vector<std::string> items;
+    std::istringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        if (!item.empty())
+        {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+BenchOptions parse_bench_options(int argc, char** argv)
+{
+    BenchOptions options{};
+    options.Counts = { 1024, 16384, 131072 };
+    options.Densities = { 0.1, 0.5 };
+    options.Radii = { "mixed", "small", "large" };
+    options.Steps = 50;
+    options.OpenCL = true;
+    options.Native = true;
+    options.Seed = 1;
+    options.OutFile = "bench_results.csv";
+    options.Tolerance = 0.15;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--counts" && hasValue)
+        {
+            options.Counts.clear();
+            for (const std::string& count : split_list(argv[++i]))
+            {
+                options.Counts.push_back(parse_number<int>("--counts", count.c_str()));
+            }
+        }
+        else if (arg == "--densities" && hasValue)
+        {
+            options.Densities.clear();
+            for (const std::string& density : split_list(argv[++i]))
+            {
+                options.Densities.push_back(parse_number<double>("--densities", density.c_str()));
+            }
+        }
+        else if (arg == "--radii" && hasValue)
+        {
+            options.Radii = split_list(argv[++i]);
+        }
+        else if (arg == "--steps" && hasValue)
+        {
+            options.Steps = parse_number<unsigned int>("--steps", argv[++i]);
+        }
+        else if (arg == "--backend" && hasValue)
+        {
+            std::string backend = argv[++i];
+            options.OpenCL = backend == "opencl" || backend == "all";
+            options.Native = backend == "native" || backend == "all";
+        }
+        else if (arg == "--threads" && hasValue)
+        {
+            options.Threads = parse_number<unsigned int>("--threads", argv[++i]);
+        }
+        else if (arg == "--seed" && hasValue)
+        {
+            options.Seed = parse_seed(argv[++i]);
+        }
+        else if (arg == "--out" && hasValue)
+        {
+            options.OutFile = argv[++i];
+        }
+        else if (arg == "--baseline" && hasValue)
+        {
+            options.BaselineFile = argv[++i];
+        }
+        else if (arg == "--tolerance" && hasValue)
+        {
+            options.Tolerance = parse_number<double>("--tolerance", argv[++i]);
+        }
+        else
+        {
+            std::cout << "Unknown or incomplete option: " << arg << std::endl;
+            print_bench_usage(argv[0]);
+            std::exit(-1);
+        }
+    }
+
+    for (double density : options.Densities)
+    {
+        if (density <= 0 || density > 1)
+        {
+            std::cout << "Densities must be in (0, 1]!" << std::endl;
+            std::exit(-1);
+        }
+    }
+
+    for (const std::string& radii : options.Radii)
+    {
+        if (radii != "mixed" && radii != "small" && radii != "large")
+        {
+            std::cout << "Radii must be mixed, small or large!" << std::endl;
+            std::exit(-1);
+        }
+    }
+
+    for (int count : options.Counts)
+    {
+        if (count < 1 || count > MaxHeadlessBalls)
+        {
+            std::cout << "Counts must be in between 1 and " << MaxHeadlessBalls << "!" << std::endl;
+            std::exit(-1);
+        }
+    }
+
+    if (options.Steps < 1 || (!options.OpenCL && !options.Native))
+    {
+        std::cout << "Nothing to run, check --steps and --backend!" << std::endl;
+        std::exit(-1);
+    }
+
+    return options;
+}
+
+// Same jittered grid placement as initialize_balls, with the world sized so
+// that density of its cells are taken and the radii forced to one size when asked
+BallState create_bench_scene(int count, double density, const std::string& radii, unsigned long long seed)
+{
+    int gridDim = (int)std::ceil(std::sqrt(count / density));
+    WorldSize = (cl_uint)gridDim * PlacementCellSize;
+
+    BallState balls = allocate_balls(count);
+    uint64_t permutationSeed = ball_random(seed, ~0ULL).State;
+    for (int i = 0; i < count; ++i)
+    {
+        BallRandom rng = ball_random(seed, i);
+        create_random_ball(balls, i, rng);
+        if (radii == "small")
+        {
+            balls.Radius[i] = 50;
+        }
+        else if (radii == "large")
+        {
+            balls.Radius[i] = MaxBallRadius;
+        }
+        place_in_grid_cell(balls, i, gridDim, PlacementCellSize, permutationSeed, rng);
+    }
+
+    return balls;
+}
+
+void add_results(Profiler& profiler, const std::string& scene, const std::string& backend, unsigned int steps, std::vector<BenchResult>& results)
+{
+    for (std::map<std::string, RollingStats>::iterator entry = profiler.Stats.begin(); entry != profiler.Stats.end(); ++entry)
+    {
+        RollingStats& stats = entry->second;
+        if (stats.Count == 0)
+        {
+            continue;
+        }
+
+        results.push_back({ scene, backend, entry->first, (double)stats.Count / steps, stats.TotalUs * 1e-3 / steps,
+                            Percentile(stats.Samples, 0.5) * 1e-3, Percentile(stats.Samples, 0.99) * 1e-3 });
+    }
+}
+
+// Reads the positions back the way the windowed loop does with --readback
+bool read_packed(CLBackend& cl, CLPositionPacker& packer, std::vector<unsigned char>& packed, cl_float2* positions)
+{
+    unsigned int frame = packer.Frame;
+    cl_uint overflow = 0;
+    cl_event readEvent;
+    return EnqueuePackedRead(cl.State, cl.Balls, packer, packed.data(), &overflow, &readEvent)
+        && WaitAndRelease(readEvent)
+        && UnpackPositions(cl.State, cl.Balls, packer, frame, packed.data(), overflow, positions);
+}
+
+// Steps, reads the positions back and uploads them again, every command timed
+bool bench_opencl(BenchOptions& options, BallState& balls, const std::string& scene, std::vector<BenchResult>& results)
+{
+    CLBackend cl;
+    if (InitOpenCL(balls, cl.Balls, cl.State, false, true))
+    {
+        std::cerr << "Could not set up OpenCL" << std::endl;
+        return false;
+    }
+    cl.Initialized = true;
+
+    if (!InitKernels(cl.Balls, cl.State, CollisionMode::Auto, false) || !cl.SetTimeStep(BenchTimeStep))
+    {
+        return false;
+    }
+
+    for (unsigned int step = 0; step < BenchWarmupSteps; ++step)
+    {
+        if (!cl.Step(1))
+        {
+            return false;
+        }
+    }
+
+    Profiler profiler;
+    InitProfiler(profiler);
+    cl.State.Profile = &profiler;
+    cl.State.ProfileTrack = AddProfileTrack(profiler, GetDeviceString(cl.State.Device, CL_DEVICE_NAME));
+
+    CLPositionPacker fixedPacker{}, deltaPacker{};
+    if (!InitPositionPacker(fixedPacker, cl.State, cl.Balls, ReadbackFormat::Fixed16)
+        || !InitPositionPacker(deltaPacker, cl.State, cl.Balls, ReadbackFormat::Delta8))
+    {
+        ReleasePositionPacker(fixedPacker);
+        return false;
+    }
+
+    // A window-sized view in the middle of the world, released with cl
+    if (!InitCuller(cl.Culler, cl.State, cl.Balls))
+    {
+        ReleasePositionPacker(fixedPacker);
+        ReleasePositionPacker(deltaPacker);
+        return false;
+    }
+    cl_float2 viewMin = { (WorldSize - (float)WinSize) / 2, (WorldSize - (float)WinSize) / 2 };
+    cl_float2 viewMax = { viewMin.x + WinSize, viewMin.y + WinSize };
+    std::vector<cl_uint> visibleIds;
+    std::vector<cl_float2> visiblePositions;
+
+    std::vector<cl_float2> positions(balls.Count);
+    std::vector<unsigned char> packed(PackedPositionsSize(fixedPacker, balls.Count));
+    bool success = true;
+    for (unsigned int step = 0; success && step < options.Steps; ++step)
+    {
+        {
+            ProfileScope stepScope(&profiler, "step");
+            success = cl.Step(1);
+        }
+
+        {
+            ProfileScope readScope(&profiler, "readback fixed16");
+            success = success && read_packed(cl, fixedPacker, packed, positions.data());
+        }
+
+        {
+            ProfileScope readScope(&profiler, "readback delta8");
+            success = success && read_packed(cl, deltaPacker, packed, positions.data());
+        }
+
+        {
+            ProfileScope readScope(&profiler, "readback culled");
+            success = success && cl.ReadVisiblePositions(balls.Count, viewMin, viewMax, visibleIds, visiblePositions);
+        }
+
+        // Last, so the upload below puts back the exact positions
+        {
+            ProfileScope readScope(&profiler, "readback");
+            success = success && cl.ReadPositions(positions.data());
+        }
+
+        {
+            ProfileScope uploadScope(&profiler, "upload");
+            cl_event writeEvent;
+            success = success && clEnqueueWriteBuffer(cl.State.CommandQueue, cl.Balls.PositionBuf, CL_FALSE, 0, balls.Count * sizeof(cl_float2),
+                                                      positions.data(), 0, nullptr, &writeEvent) == CL_SUCCESS;
+            if (success)
+            {
+                ProfileCommand(cl.State, "write positions", writeEvent);
+                success = WaitAndRelease(writeEvent);
+            }
+        }
+
+        CollectDeviceEvents(profiler);
+    }
+
+    CollectDeviceEvents(profiler, true);
+    cl.State.Profile = nullptr;
+    ReleasePositionPacker(fixedPacker);
+    ReleasePositionPacker(deltaPacker);
+
+    add_results(profiler, scene, cl.State.UseTiledStep ? "opencl-tiled" : "opencl-grid", options.Steps, results);
+    return success;
+}
+
+bool bench_native(BenchOptions& options, BallState& balls, const std::string& scene, std::vector<BenchResult>& results)
+{
+    NativeBackend native(balls, options.Threads);
+    if (!native.SetTimeStep(BenchTimeStep))
+    {
+        return false;
+    }
+
+    for (unsigned int step = 0; step < BenchWarmupSteps; ++step)
+    {
+        native.Step(1);
+    }
+
+    Profiler profiler;
+    InitProfiler(profiler);
+
+    std::vector<cl_float2> positions(balls.Count);
+    bool success = true;
+    for (unsigned int step = 0; success && step < options.Steps; ++step)
+    {
+        {
+            ProfileScope stepScope(&profiler, "step");
+            success = native.Step(1);
+        }
+
+        ProfileScope readScope(&profiler, "readback");
+        success = success && native.ReadPositions(positions.data());
+    }
+
+    add_results(profiler, scene, "native", options.Steps, results);
+    return success;
+}
+
+bool write_results(const std::string& fileName, std::vector<BenchResult>& results)
+{
+    std::ofstream out(fileName);
+    if (!out)
+    {
+        std::cerr << "Could not write " << fileName << std::endl;
+        return false;
+    }
+
+    out << "scene,backend,metric,calls_per_step,ms_per_step,p50_ms,p99_ms" << std::endl;
+    for (BenchResult& result : results)
+    {
+        out << result.Scene << "," << result.Backend << "," << result.Metric << "," << result.CallsPerStep << ","
+            << result.MsPerStep << "," << result.P50Ms << "," << result.P99Ms << std::endl;
+    }
+
+    std::cout << "Wrote " << results.size() << " results to " << fileName << std::endl;
+    return true;
+}
+
+// ms_per_step of every scene, backend and metric of a results file
+bool load_baseline(const std::string& fileName, std::map<std::string, double>& baseline)
+{
+    std::ifstream in(fileName);
+    if (!in)
+    {
+        std::cerr << "Could not read the baseline " << fileName << std::endl;
+        return false;
+    }
+
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line))
+    {
+        std::vector<std::string> fields;
+        std::istringstream stream(line);
+        std::string field;
+        while (std::getline(stream, field, ','))
+        {
+            fields.push_back(field);
+        }
+
+        if (fields.size() >= 5)
+        {
+            baseline[fields[0] + "," + fields[1] + "," + fields[2]] = std::atof(fields[4].c_str());
+        }
+    }
+
+    return true;
+}
+
+// Returns the number of metrics that got slower than the baseline allows
+int compare_with_baseline(std::vector<BenchResult>& results, std::map<std::string, double>& baseline, double tolerance)
+{
+    int regressions = 0;
+    size_t compared = 0;
+    for (BenchResult& result : results)
+    {
+        std::map<std::string, double>::iterator base = baseline.find(result.Scene + "," + result.Backend + "," + result.Metric);
+        if (base == baseline.end() || std::max(base->second, result.MsPerStep) < MinComparedMs)
+        {
+            continue;
+        }
+
+        ++compared;
+        double change = base->second > 0 ? result.MsPerStep / base->second - 1 : 0.0;
+        if (change > tolerance)
+        {
+            std::cout << "REGRESSION " << result.Scene << " " << result.Backend << " " << result.Metric << ": "
+                      << base->second << " -> " << result.MsPerStep << " ms per step (+" << change * 100 << "%)" << std::endl;
+            ++regressions;
+        }
+    }
+
+    std::cout << "Compared " << compared << " metrics with the baseline, " << regressions << " regressed by more than "
+              << tolerance * 100 << "%" << std::endl;
+    return regressions;
+}
+
+int main(int argc, char** argv)
+{
+    BenchOptions options = parse_bench_options(argc, argv);
+
+    std::map<std::string, double> baseline;
+    if (!options.BaselineFile.empty() && !load_baseline(options.BaselineFile, baseline))
+    {
+        return -1;
+    }
+
+    std::vector<BenchResult> results;
+    for (int count : options.Counts)
+    {
+        for (double density : options.Densities)
+        {
+            for (const std::string& radii : options.Radii)
+            {
+                std::ostringstream scene;
+                scene << "n" << count << "-d" << density << "-" << radii;
+                std::cout << "Scene " << scene.str() << std::endl;
+
+                BallState balls = create_bench_scene(count, density, radii, options.Seed);
+
+                // Both backends start from the same scene, the OpenCL one may step it in place
+                bool success = !options.Native || bench_native(options, balls, scene.str(), results);
+                success = success && (!options.OpenCL || bench_opencl(options, balls, scene.str(), results));
+
+                free_balls(balls);
+                if (!success)
+                {
+                    std::cerr << "Scene " << scene.str() << " failed!" << std::endl;
+                    return -1;
+                }
+            }
+        }
+    }
+
+    if (!write_results(options.OutFile, results))
+    {
+        return -1;
+    }
+
+    if (!baseline.empty() && compare_with_baseline(results, baseline, options.Tolerance) > 0)
+    {
+        return 1;
+    }
+
+    return 0;
+}
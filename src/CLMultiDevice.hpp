@@ -0,0 +1,399 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "CLUtils.hpp"
+
+// Multi-device domain decomposition
+//
+// The world is cut into vertical slabs, one per device, and every device has
+// its own context, queue and buffers. Each step the host packs the balls of a
+// slab followed by its halo: copies of the neighbours' balls within one cell
+// plus the step's largest displacement of the slab's edges, which are all the
+// balls its own can touch by the time the collisions run. The device
+// steps all of them but only its own balls are read back, so a ball that
+// crossed an edge simply lands in the neighbour's slab on the next step.
+// Every RebalanceInterval steps the edges move so each device gets a share of
+// the balls proportional to its measured throughput.
+
+const unsigned int RebalanceInterval = 20;
+const double RebalanceDamping = 0.5;
+
+struct CLSlab
+{
+    CLState CL;
+    CLBallState Balls;
+
+    std::vector<cl_uint> Owned; // Indices of the balls in the slab
+    std::vector<cl_uint> Halo;  // Indices of the neighbours' balls near its edges
+
+    // Packed [Owned | Halo] state, has to outlive the non-blocking writes
+    std::vector<cl_float> Mass;
+    std::vector<cl_uint> Radius;
+    std::vector<cl_float2> Position;
+    std::vector<cl_float2> Velocity;
+
+    cl_event UploadEvent;
+    cl_event StepEvent;
+    cl_event ReadEvent;
+
+    // Since the last rebalance
+    double StepTime;
+    unsigned long long BallSteps;
+};
+
+struct CLMultiDevice
+{
+    std::vector<CLSlab> Slabs;
+    std::vector<float> Edges; // Slabs.size() + 1 x coordinates, from 0 to WorldSize
+    float HaloWidth; // Widest contact, the halo also covers a step's movement
+    float DeltaT;
+    unsigned long long Steps;
+};
+
+// Every device of every platform. CPU devices are split into subDevices
+// sub-devices when possible, which lets a single machine try the decomposition.
+std::vector<cl_device_id> FindComputeDevices(unsigned int subDevices)
+{
+    std::vector<cl_device_id> computeDevices;
+
+    cl_uint numPlatforms = 0;
+    if (clGetPlatformIDs(0, nullptr, &numPlatforms) != CL_SUCCESS || numPlatforms == 0)
+    {
+        std::cerr << "Cannot find any OpenCL platforms." << std::endl;
+        return computeDevices;
+    }
+
+    std::vector<cl_platform_id> platforms(numPlatforms);
+    clGetPlatformIDs(numPlatforms, platforms.data(), nullptr);
+
+    for (cl_platform_id platform : platforms)
+    {
+        cl_uint numDevices = 0;
+        if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, nullptr, &numDevices) != CL_SUCCESS || numDevices == 0)
+        {
+            continue;
+        }
+
+        std::vector<cl_device_id> devices(numDevices);
+        clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, numDevices, devices.data(), nullptr);
+
+        for (cl_device_id device : devices)
+        {
+            cl_device_type type = 0;
+            cl_uint computeUnits = 0;
+            clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(cl_device_type), &type, nullptr);
+            clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &computeUnits, nullptr);
+
+            if (subDevices > 1 && (type & CL_DEVICE_TYPE_CPU) && computeUnits >= subDevices)
+            {
+                cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)(computeUnits / subDevices), 0 };
+                std::vector<cl_device_id> parts(subDevices);
+                cl_uint numParts = 0;
+                if (clCreateSubDevices(device, properties, subDevices, parts.data(), &numParts) == CL_SUCCESS)
+                {
+                    computeDevices.insert(computeDevices.end(), parts.begin(), parts.begin() + std::min(numParts, subDevices));
+                    continue;
+                }
+
+                std::cout << "Could not split " << GetDeviceString(device, CL_DEVICE_NAME) << " into sub-devices, using it whole." << std::endl;
+            }
+
+            computeDevices.push_back(device);
+        }
+    }
+
+    return computeDevices;
+}
+
+// Same setup as InitOpenCL on a given device. The buffers are sized for all
+// the balls, since any number of them can end up in one slab.
+bool InitSlab(CLSlab& slab, cl_device_id device, BallState& ballState)
+{
+    cl_int errCode = CL_SUCCESS;
+    slab.CL.CTX = clCreateContext(nullptr, 1, &device, nullptr, nullptr, &errCode);
+    if (errCode != CL_SUCCESS || !slab.CL.CTX)
+    {
+        return false;
+    }
+
+    // Profiling gives the device time each slab takes, which drives the balancing
+    slab.CL.CommandQueue = CreateCmdQueue(slab.CL.CTX, &slab.CL.Device, CL_QUEUE_PROFILING_ENABLE);
+    if (!slab.CL.CommandQueue)
+    {
+        Deallocate(slab.CL, slab.Balls);
+        return false;
+    }
+
+    slab.CL.KernelProgram = CreateProgram(slab.CL.CTX, slab.CL.Device, "BallLogic.cl", KernelBuildOptions(ballState));
+    if (!slab.CL.KernelProgram || !CreateKernels(slab.CL) || !AllocateMemObjects(slab.CL.CTX, ballState, slab.Balls))
+    {
+        Deallocate(slab.CL, slab.Balls);
+        return false;
+    }
+
+    return true;
+}
+
+bool InitMultiDevice(CLMultiDevice& multi, BallState& ballState, unsigned int subDevices)
+{
+    multi = CLMultiDevice{};
+
+    for (cl_device_id device : FindComputeDevices(subDevices))
+    {
+        CLSlab slab{};
+        if (!InitSlab(slab, device, ballState))
+        {
+            std::cout << "Skipping " << GetDeviceString(device, CL_DEVICE_NAME) << ", it could not be set up." << std::endl;
+            continue;
+        }
+        multi.Slabs.push_back(slab);
+    }
+
+    if (multi.Slabs.empty())
+    {
+        std::cerr << "No usable OpenCL devices." << std::endl;
+        return false;
+    }
+
+    // Start with equal widths, the balancing corrects them once there are timings
+    for (size_t i = 0; i <= multi.Slabs.size(); ++i)
+    {
+        multi.Edges.push_back((float)WorldSize * i / multi.Slabs.size());
+    }
+
+    // Two balls can only touch within one cell, see the grid broadphase
+    multi.HaloWidth = multi.Slabs[0].Balls.CellSize;
+
+    return true;
+}
+
+void ReleaseMultiDevice(CLMultiDevice& multi)
+{
+    for (CLSlab& slab : multi.Slabs)
+    {
+        cl_device_id device = slab.CL.Device;
+        Deallocate(slab.CL, slab.Balls);
+
+        // Only releases sub-devices, root devices aren't reference counted
+        clReleaseDevice(device);
+    }
+    multi = CLMultiDevice{};
+}
+
+size_t SlabIndex(CLMultiDevice& multi, float x)
+{
+    std::vector<float>::iterator inner = std::upper_bound(multi.Edges.begin() + 1, multi.Edges.end() - 1, x);
+    return inner - (multi.Edges.begin() + 1);
+}
+
+// Assigns every ball to the slab it is in and to the halo of the slabs it is near
+void PartitionBalls(CLMultiDevice& multi, BallState& ballState)
+{
+    for (CLSlab& slab : multi.Slabs)
+    {
+        slab.Owned.clear();
+        slab.Halo.clear();
+    }
+
+    // The halo is picked before update_ball moves the balls, and both balls of
+    // a contact across an edge can move towards it by up to a step
+    float maxSpeedX = 0.0f;
+    for (int i = 0; i < ballState.Count; ++i)
+    {
+        maxSpeedX = std::max(maxSpeedX, std::fabs(ballState.Velocity[i].x));
+    }
+    float haloWidth = multi.HaloWidth + 2.0f * maxSpeedX * multi.DeltaT;
+
+    for (int i = 0; i < ballState.Count; ++i)
+    {
+        float x = ballState.Position[i].x;
+        size_t s = SlabIndex(multi, x);
+        multi.Slabs[s].Owned.push_back(i);
+
+        for (size_t n = s; n > 0 && x - multi.Edges[n] < haloWidth; --n)
+        {
+            multi.Slabs[n - 1].Halo.push_back(i);
+        }
+
+        for (size_t n = s + 1; n < multi.Slabs.size() && multi.Edges[n] - x < haloWidth; ++n)
+        {
+            multi.Slabs[n].Halo.push_back(i);
+        }
+    }
+}
+
+bool EnqueueSlabStep(CLSlab& slab, BallState& ballState)
+{
+    size_t owned = slab.Owned.size();
+    size_t count = owned + slab.Halo.size();
+
+    slab.Mass.resize(count);
+    slab.Radius.resize(count);
+    slab.Position.resize(count);
+    slab.Velocity.resize(count);
+    for (size_t k = 0; k < count; ++k)
+    {
+        cl_uint i = k < owned ? slab.Owned[k] : slab.Halo[k - owned];
+        slab.Mass[k] = ballState.Mass[i];
+        slab.Radius[k] = ballState.Radius[i];
+        slab.Position[k] = ballState.Position[i];
+        slab.Velocity[k] = ballState.Velocity[i];
+    }
+
+    cl_command_queue queue = slab.CL.CommandQueue;
+    CLBallState& balls = slab.Balls;
+    cl_int errCode = clEnqueueWriteBuffer(queue, balls.MassBuf, CL_FALSE, 0, count * sizeof(cl_float), slab.Mass.data(), 0, nullptr, nullptr);
+    errCode |= clEnqueueWriteBuffer(queue, balls.RadiusBuf, CL_FALSE, 0, count * sizeof(cl_uint), slab.Radius.data(), 0, nullptr, nullptr);
+    errCode |= clEnqueueWriteBuffer(queue, balls.PositionBuf, CL_FALSE, 0, count * sizeof(cl_float2), slab.Position.data(), 0, nullptr, nullptr);
+    errCode |= clEnqueueWriteBuffer(queue, balls.VelocityBuf, CL_FALSE, 0, count * sizeof(cl_float2), slab.Velocity.data(), 0, nullptr, &slab.UploadEvent);
+    if (errCode != CL_SUCCESS)
+    {
+        return false;
+    }
+
+    ProfileCommand(slab.CL, "upload slab", slab.UploadEvent);
+
+    if (!SetBallCount(slab.CL, balls, (cl_uint)count) || !EnqueueStep(slab.CL, balls, &slab.StepEvent))
+    {
+        return false;
+    }
+
+    // The halo was only needed for the contacts, read back the slab's own balls
+    errCode = clEnqueueReadBuffer(queue, balls.PositionBuf, CL_FALSE, 0, owned * sizeof(cl_float2), slab.Position.data(), 0, nullptr, nullptr);
+    errCode |= clEnqueueReadBuffer(queue, balls.VelocityBuf, CL_FALSE, 0, owned * sizeof(cl_float2), slab.Velocity.data(), 0, nullptr, &slab.ReadEvent);
+    if (errCode == CL_SUCCESS)
+    {
+        ProfileCommand(slab.CL, "read slab", slab.ReadEvent);
+    }
+
+    return errCode == CL_SUCCESS && clFlush(queue) == CL_SUCCESS;
+}
+
+bool FinishSlabStep(CLSlab& slab, BallState& ballState)
+{
+    if (!WaitAndRelease(slab.ReadEvent))
+    {
+        return false;
+    }
+
+    for (size_t k = 0; k < slab.Owned.size(); ++k)
+    {
+        ballState.Position[slab.Owned[k]] = slab.Position[k];
+        ballState.Velocity[slab.Owned[k]] = slab.Velocity[k];
+    }
+
+    // From the end of the upload to the end of the step is the compute time
+    cl_ulong uploadEnd = 0;
+    cl_ulong stepEnd = 0;
+    clGetEventProfilingInfo(slab.UploadEvent, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &uploadEnd, nullptr);
+    clGetEventProfilingInfo(slab.StepEvent, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &stepEnd, nullptr);
+    clReleaseEvent(slab.UploadEvent);
+    clReleaseEvent(slab.StepEvent);
+
+    slab.StepTime += stepEnd > uploadEnd ? (stepEnd - uploadEnd) * 1e-9 : 0.0;
+    slab.BallSteps += slab.Owned.size() + slab.Halo.size();
+
+    return true;
+}
+
+// Moves the edges to the x coordinates that give every slab its share of the
+// balls, shares following the balls per second each device managed
+void RebalanceSlabs(CLMultiDevice& multi, BallState& ballState)
+{
+    size_t slabCount = multi.Slabs.size();
+
+    std::vector<double> throughput(slabCount, 0.0);
+    double totalThroughput = 0.0;
+    size_t measured = 0;
+    for (size_t s = 0; s < slabCount; ++s)
+    {
+        CLSlab& slab = multi.Slabs[s];
+        if (slab.StepTime > 0)
+        {
+            throughput[s] = slab.BallSteps / slab.StepTime;
+            totalThroughput += throughput[s];
+            ++measured;
+        }
+    }
+
+    if (measured == 0)
+    {
+        return;
+    }
+
+    // A device that got no balls has no timing, give it the average so it gets some
+    for (size_t s = 0; s < slabCount; ++s)
+    {
+        if (multi.Slabs[s].StepTime <= 0)
+        {
+            throughput[s] = totalThroughput / measured;
+        }
+    }
+
+    double shareSum = 0.0;
+    for (size_t s = 0; s < slabCount; ++s)
+    {
+        shareSum += throughput[s];
+    }
+
+    std::vector<float> xs(ballState.Count);
+    for (int i = 0; i < ballState.Count; ++i)
+    {
+        xs[i] = ballState.Position[i].x;
+    }
+    std::sort(xs.begin(), xs.end());
+
+    // Damped so timing noise doesn't make the edges oscillate
+    double cumulativeShare = 0.0;
+    size_t currentCount = 0;
+    for (size_t s = 0; s + 1 < slabCount; ++s)
+    {
+        cumulativeShare += throughput[s] / shareSum;
+        currentCount += multi.Slabs[s].Owned.size();
+
+        double target = (1.0 - RebalanceDamping) * currentCount + RebalanceDamping * cumulativeShare * xs.size();
+        size_t index = std::min((size_t)target, xs.size() - 1);
+        multi.Edges[s + 1] = std::max(multi.Edges[s], xs[index]);
+    }
+
+    for (CLSlab& slab : multi.Slabs)
+    {
+        slab.StepTime = 0.0;
+        slab.BallSteps = 0;
+    }
+}
+
+// One step of the whole world. The slabs run concurrently, the host only
+// waits once all of them are queued.
+bool StepMultiDevice(CLMultiDevice& multi, BallState& ballState)
+{
+    PartitionBalls(multi, ballState);
+
+    for (CLSlab& slab : multi.Slabs)
+    {
+        if (!slab.Owned.empty() && !EnqueueSlabStep(slab, ballState))
+        {
+            return false;
+        }
+    }
+
+    for (CLSlab& slab : multi.Slabs)
+    {
+        if (!slab.Owned.empty() && !FinishSlabStep(slab, ballState))
+        {
+            return false;
+        }
+    }
+
+    if (++multi.Steps % RebalanceInterval == 0)
+    {
+        RebalanceSlabs(multi, ballState);
+    }
+
+    return true;
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "CL/cl.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+// Program binary cache
+//
+// Building BallLogic.cl from source can take a noticeable part of startup, so
+// the built binary is kept next to it in "<source>.<config hash>.bin". The
+// first line of the file is the full key the binary was built for: device,
+// driver, build options and a hash of the source. Any mismatch means the
+// binary is stale and the program is built from source again.
+
+std::string GetDeviceString(cl_device_id device, cl_device_info info)
+{
+    size_t size = 0;
+    if (clGetDeviceInfo(device, info, 0, nullptr, &size) != CL_SUCCESS || size == 0)
+    {
+        return "";
+    }
+
+    std::vector<char> value(size);
+    clGetDeviceInfo(device, info, size, value.data(), nullptr);
+    return std::string(value.data());
+}
+
+// 64-bit FNV-1a, only used to tell cache entries apart
+uint64_t HashString(const std::string& str)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : str)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::string HashToHex(uint64_t hash)
+{
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+    return hex;
+}
+
+// One cache file per device, driver and build options, rebuilt when the source changes
+std::string ProgramCachePath(const char* fileName, cl_device_id device, const std::string& options)
+{
+    std::string config = GetDeviceString(device, CL_DEVICE_NAME) + "|" + GetDeviceString(device, CL_DRIVER_VERSION) + "|" + options;
+    return std::string(fileName) + "." + HashToHex(HashString(config)) + ".bin";
+}
+
+std::string ProgramCacheKey(cl_device_id device, const std::string& options, const std::string& source)
+{
+    return GetDeviceString(device, CL_DEVICE_NAME) + "|" + GetDeviceString(device, CL_DRIVER_VERSION)
+        + "|" + options + "|" + HashToHex(HashString(source));
+}
+
+// Returns a built program, or nullptr when there is no usable binary for key
+cl_program LoadCachedProgram(cl_context context, cl_device_id device, const std::string& path, const std::string& key, const std::string& options)
+{
+    std::ifstream cacheFile(path, std::ios::in | std::ios::binary);
+    std::string cachedKey;
+    if (!cacheFile.is_open() || !std::getline(cacheFile, cachedKey) || cachedKey != key)
+    {
+        return nullptr;
+    }
+
+    std::vector<unsigned char> binary((std::istreambuf_iterator<char>(cacheFile)), std::istreambuf_iterator<char>());
+    if (binary.empty())
+    {
+        return nullptr;
+    }
+
+    size_t binarySize = binary.size();
+    const unsigned char* binaryData = binary.data();
+    cl_int binaryStatus = CL_SUCCESS;
+    cl_int errCode = CL_SUCCESS;
+    cl_program program = clCreateProgramWithBinary(context, 1, &device, &binarySize, &binaryData, &binaryStatus, &errCode);
+    if (!program || errCode != CL_SUCCESS || binaryStatus != CL_SUCCESS)
+    {
+        if (program)
+        {
+            clReleaseProgram(program);
+        }
+        return nullptr;
+    }
+
+    // Binaries still need a build call, which only links them
+    if (clBuildProgram(program, 1, &device, options.c_str(), nullptr, nullptr) != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        return nullptr;
+    }
+
+    return program;
+}
+
+// Replaces path with the new file in one step, so a crash or a second
+// instance never sees a half written binary
+bool ReplaceFile(const std::string& tempPath, const std::string& path)
+{
+#if defined(_WIN32)
+    return MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return std::rename(tempPath.c_str(), path.c_str()) == 0;
+#endif
+}
+
+void SaveCachedProgram(cl_program program, cl_device_id device, const std::string& path, const std::string& key)
+{
+    cl_uint deviceCount = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &deviceCount, nullptr) != CL_SUCCESS || deviceCount == 0)
+    {
+        return;
+    }
+
+    std::vector<cl_device_id> devices(deviceCount);
+    std::vector<size_t> binarySizes(deviceCount);
+    cl_int errCode = clGetProgramInfo(program, CL_PROGRAM_DEVICES, deviceCount * sizeof(cl_device_id), devices.data(), nullptr);
+    errCode |= clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, deviceCount * sizeof(size_t), binarySizes.data(), nullptr);
+    if (errCode != CL_SUCCESS)
+    {
+        return;
+    }
+
+    // The binaries come back for every device of the program, keep ours
+    std::vector<std::vector<unsigned char>> binaries(deviceCount);
+    std::vector<unsigned char*> binaryPointers(deviceCount);
+    for (cl_uint i = 0; i < deviceCount; ++i)
+    {
+        binaries[i].resize(binarySizes[i]);
+        binaryPointers[i] = binaries[i].data();
+    }
+
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, deviceCount * sizeof(unsigned char*), binaryPointers.data(), nullptr) != CL_SUCCESS)
+    {
+        return;
+    }
+
+    for (cl_uint i = 0; i < deviceCount; ++i)
+    {
+        if (devices[i] != device || binaries[i].empty())
+        {
+            continue;
+        }
+
+        std::string tempPath = path + ".tmp";
+        {
+            std::ofstream cacheFile(tempPath, std::ios::out | std::ios::binary | std::ios::trunc);
+            cacheFile << key << '\n';
+            cacheFile.write((const char*)binaries[i].data(), binaries[i].size());
+            if (!cacheFile)
+            {
+                std::cerr << "[WARNING][CL]: Could not write the program cache " << tempPath << std::endl;
+                std::remove(tempPath.c_str());
+                return;
+            }
+        }
+
+        if (!ReplaceFile(tempPath, path))
+        {
+            std::cerr << "[WARNING][CL]: Could not replace the program cache " << path << std::endl;
+            std::remove(tempPath.c_str());
+        }
+        return;
+    }
+}
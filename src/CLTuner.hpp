@@ -0,0 +1,309 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "CLUtils.hpp"
+
+// Work-group size auto-tuner
+//
+// Each kernel of the active collision path is timed with every candidate
+// local size, from the device's preferred multiple up to its limit, and the
+// fastest one is kept in CLState::LocalSizes. Results are cached per device
+// and driver in WorkGroupCacheFile, so tuning only runs on the first launch.
+
+const char* WorkGroupCacheFile = "worksizes.cache";
+const unsigned int TuningRuns = 10;
+const size_t MaxTunedLocalSize = 1024;
+
+// A new driver can change the best sizes as much as a new device
+std::string DeviceKey(CLState& state)
+{
+    return GetDeviceString(state.Device, CL_DEVICE_NAME) + "|" + GetDeviceString(state.Device, CL_DRIVER_VERSION);
+}
+
+// Powers of two times the preferred multiple, up to what the kernel and maxSize allow
+std::vector<size_t> CandidateLocalSizes(CLState& state, cl_kernel kernel, size_t maxSize)
+{
+    size_t multiple = 1;
+    size_t kernelMaxSize = 1;
+    clGetKernelWorkGroupInfo(kernel, state.Device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &multiple, nullptr);
+    clGetKernelWorkGroupInfo(kernel, state.Device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernelMaxSize, nullptr);
+
+    maxSize = std::min(maxSize, kernelMaxSize);
+    multiple = std::max((size_t)1, std::min(multiple, maxSize));
+
+    std::vector<size_t> sizes;
+    for (size_t size = multiple; size <= maxSize; size *= 2)
+    {
+        sizes.push_back(size);
+    }
+    return sizes;
+}
+
+// Lines of "<device>|<driver>|<kernel> <local size>", for this device only
+std::map<std::string, size_t> LoadWorkGroupCache(const std::string& deviceKey)
+{
+    std::map<std::string, size_t> sizes;
+
+    std::ifstream cacheFile(WorkGroupCacheFile);
+    std::string line;
+    while (std::getline(cacheFile, line))
+    {
+        std::string prefix = deviceKey + "|";
+        if (line.compare(0, prefix.size(), prefix) != 0)
+        {
+            continue;
+        }
+
+        std::istringstream entry(line.substr(prefix.size()));
+        std::string kernelName;
+        size_t localSize = 0;
+        if (entry >> kernelName >> localSize && localSize > 0)
+        {
+            sizes[kernelName] = localSize;
+        }
+    }
+
+    return sizes;
+}
+
+// Rewrites the cache, keeping the entries of other devices
+void SaveWorkGroupCache(const std::string& deviceKey, const std::map<std::string, size_t>& sizes)
+{
+    std::vector<std::string> lines;
+    {
+        std::ifstream cacheFile(WorkGroupCacheFile);
+        std::string line;
+        while (std::getline(cacheFile, line))
+        {
+            if (line.compare(0, deviceKey.size() + 1, deviceKey + "|") != 0)
+            {
+                lines.push_back(line);
+            }
+        }
+    }
+
+    std::ofstream cacheFile(WorkGroupCacheFile, std::ios::trunc);
+    if (!cacheFile)
+    {
+        std::cerr << "[WARNING][CL]: Could not write " << WorkGroupCacheFile << std::endl;
+        return;
+    }
+
+    for (const std::string& line : lines)
+    {
+        cacheFile << line << std::endl;
+    }
+    for (const auto& size : sizes)
+    {
+        cacheFile << deviceKey << "|" << size.first << " " << size.second << std::endl;
+    }
+}
+
+// Average seconds per launch of kernel with its current local size
+double TimeKernel(CLState& state, cl_kernel kernel, size_t globalSize)
+{
+    // The first launch pays for any lazy setup in the driver
+    if (!EnqueueKernel(state, kernel, globalSize) || clFinish(state.CommandQueue) != CL_SUCCESS)
+    {
+        return -1;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (unsigned int run = 0; run < TuningRuns; ++run)
+    {
+        if (!EnqueueKernel(state, kernel, globalSize))
+        {
+            return -1;
+        }
+    }
+    if (clFinish(state.CommandQueue) != CL_SUCCESS)
+    {
+        return -1;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+    return elapsed.count() / TuningRuns;
+}
+
+struct TunedKernel
+{
+    cl_kernel Kernel;
+    size_t GlobalSize;
+    size_t MaxLocalSize;
+};
+
+bool SetLocalSize(CLState& state, cl_kernel kernel, size_t localSize)
+{
+    if (kernel == state.TiledStepKernel)
+    {
+        return SetTileSize(state, localSize);
+    }
+
+    state.LocalSizes[kernel] = localSize;
+    return true;
+}
+
+size_t TuneKernel(CLState& state, TunedKernel& tuned)
+{
+    size_t bestSize = 0;
+    double bestTime = 0;
+
+    for (size_t localSize : CandidateLocalSizes(state, tuned.Kernel, tuned.MaxLocalSize))
+    {
+        if (!SetLocalSize(state, tuned.Kernel, localSize))
+        {
+            continue;
+        }
+
+        double time = TimeKernel(state, tuned.Kernel, tuned.GlobalSize);
+        if (time >= 0 && (bestSize == 0 || time < bestTime))
+        {
+            bestSize = localSize;
+            bestTime = time;
+        }
+    }
+
+    return bestSize;
+}
+
+// Picks the local size of every kernel the active collision path launches.
+// Must run after all the kernel arguments are set and before the first frame.
+bool TuneWorkGroupSizes(CLState& state, CLBallState& clBallState, bool retune)
+{
+    std::vector<TunedKernel> kernels;
+    if (state.UseTiledStep)
+    {
+        kernels.push_back({ state.TiledStepKernel, clBallState.Count, MaxTileSize(state) });
+    }
+    else
+    {
+        kernels.push_back({ state.BallUpdateKernel, clBallState.Count, MaxTunedLocalSize });
+        kernels.push_back({ state.CellKeysKernel, clBallState.SortSize, MaxTunedLocalSize });
+        kernels.push_back({ state.SortStepKernel, clBallState.SortSize, MaxTunedLocalSize });
+        kernels.push_back({ state.ResetCellsKernel, clBallState.CellCount, MaxTunedLocalSize });
+        kernels.push_back({ state.CellBoundsKernel, clBallState.Count, MaxTunedLocalSize });
+        kernels.push_back({ state.BallCollisionKernel, clBallState.Count, MaxTunedLocalSize });
+    }
+
+    std::string deviceKey = DeviceKey(state);
+    std::map<std::string, size_t> cachedSizes = retune ? std::map<std::string, size_t>() : LoadWorkGroupCache(deviceKey);
+
+    // Apply what is cached and only benchmark the rest
+    std::vector<TunedKernel> untuned;
+    for (TunedKernel& tuned : kernels)
+    {
+        std::map<std::string, size_t>::iterator cached = cachedSizes.find(GetKernelName(tuned.Kernel));
+        if (cached == cachedSizes.end() || !SetLocalSize(state, tuned.Kernel, cached->second))
+        {
+            untuned.push_back(tuned);
+        }
+    }
+
+    if (untuned.empty())
+    {
+        std::cout << "Work-group sizes loaded from " << WorkGroupCacheFile << std::endl;
+        return true;
+    }
+
+    std::cout << "Tuning work-group sizes..." << std::endl;
+
+    // update_ball changes the state in place, so benchmark on a copy of it
+    size_t stateSize = clBallState.Count * sizeof(cl_float2);
+    cl_mem positionBackup = clCreateBuffer(state.CTX, CL_MEM_READ_WRITE, stateSize, nullptr, nullptr);
+    cl_mem velocityBackup = clCreateBuffer(state.CTX, CL_MEM_READ_WRITE, stateSize, nullptr, nullptr);
+    if (!positionBackup || !velocityBackup)
+    {
+        clReleaseMemObject(positionBackup);
+        clReleaseMemObject(velocityBackup);
+        return false;
+    }
+
+    cl_mem sharedBuffers[] = { clBallState.PositionBuf, clBallState.PositionOutBuf };
+    if (clBallState.GLShared)
+    {
+        glFinish();
+        clEnqueueAcquireGLObjects(state.CommandQueue, 2, sharedBuffers, 0, nullptr, nullptr);
+    }
+
+    cl_int errCode = clEnqueueCopyBuffer(state.CommandQueue, clBallState.PositionBuf, positionBackup, 0, 0, stateSize, 0, nullptr, nullptr);
+    errCode |= clEnqueueCopyBuffer(state.CommandQueue, clBallState.VelocityBuf, velocityBackup, 0, 0, stateSize, 0, nullptr, nullptr);
+
+    // handle_collisions needs valid cell ranges to walk, and the sort step its pass arguments
+    bool success = errCode == CL_SUCCESS && (state.UseTiledStep || RunBroadphase(state, clBallState));
+
+    for (size_t i = 0; success && i < untuned.size(); ++i)
+    {
+        size_t bestSize = TuneKernel(state, untuned[i]);
+        success = bestSize > 0 && SetLocalSize(state, untuned[i].Kernel, bestSize);
+        if (success)
+        {
+            std::string kernelName = GetKernelName(untuned[i].Kernel);
+            cachedSizes[kernelName] = bestSize;
+            std::cout << "  " << kernelName << ": " << bestSize << std::endl;
+        }
+    }
+
+    errCode = clEnqueueCopyBuffer(state.CommandQueue, positionBackup, clBallState.PositionBuf, 0, 0, stateSize, 0, nullptr, nullptr);
+    errCode |= clEnqueueCopyBuffer(state.CommandQueue, velocityBackup, clBallState.VelocityBuf, 0, 0, stateSize, 0, nullptr, nullptr);
+    if (clBallState.GLShared)
+    {
+        errCode |= clEnqueueReleaseGLObjects(state.CommandQueue, 2, sharedBuffers, 0, nullptr, nullptr);
+    }
+    errCode |= clFinish(state.CommandQueue);
+
+    clReleaseMemObject(positionBackup);
+    clReleaseMemObject(velocityBackup);
+
+    if (!success || errCode != CL_SUCCESS)
+    {
+        return false;
+    }
+
+    SaveWorkGroupCache(deviceKey, cachedSizes);
+    return true;
+}
+
+// Everything after InitOpenCL: kernel arguments, collision path and work-group
+// sizes. Shared by the single and multi-device setups and the benchmarks.
+bool InitKernels(CLBallState& clBallState, CLState& clState, CollisionMode collisions, bool retune)
+{
+    if (!SetBallUpdateKernelParamsInit(clBallState, clState))
+    {
+        std::cerr << "SetBallUpdateKernelParamsInit failed!" << std::endl;
+        return false;
+    }
+
+    if (!SetBallCollisionKernelParamsInit(clBallState, clState))
+    {
+        std::cerr << "SetBallCollisionKernelParamsInit failed!" << std::endl;
+        return false;
+    }
+
+    if (!SetBroadphaseKernelParamsInit(clBallState, clState))
+    {
+        std::cerr << "SetBroadphaseKernelParamsInit failed!" << std::endl;
+        return false;
+    }
+
+    if (!SetTiledStepKernelParamsInit(clBallState, clState, collisions))
+    {
+        std::cerr << "SetTiledStepKernelParamsInit failed!" << std::endl;
+        return false;
+    }
+
+    std::cout << "Collisions: " << (clState.UseTiledStep ? "tiled" : "grid") << std::endl;
+
+    if (!TuneWorkGroupSizes(clState, clBallState, retune))
+    {
+        std::cerr << "TuneWorkGroupSizes failed!" << std::endl;
+        return false;
+    }
+
+    return true;
+}
@@ -1,23 +1,100 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
 #include <sstream>
+#include <vector>
 #include <dns_sd.h>
 
 #include "CL/cl.h"
+#include "CL/cl_gl.h"
 
 #include "BallUtils.hpp"
+#include "CLProgramCache.hpp"
+#include "PositionPacking.hpp"
+#include "Profiler.hpp"
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <GL/glx.h>
+#endif
 
 struct CLState
 {
     cl_context CTX;
+    cl_device_id Device;
     cl_command_queue CommandQueue;
     cl_program KernelProgram;
     cl_kernel BallUpdateKernel;
     cl_kernel BallCollisionKernel;
+
+    // Broadphase
+    cl_kernel CellKeysKernel;
+    cl_kernel SortStepKernel;
+    cl_kernel ResetCellsKernel;
+    cl_kernel CellBoundsKernel;
+
+    // Fused all-pairs step for dense scenes, replaces the three passes above.
+    // Its work-group size is also its tile size.
+    cl_kernel TiledStepKernel;
+    bool UseTiledStep;
+
+    // Sleeping bodies, see InitSleeping
+    cl_kernel SleepKernel;
+    cl_kernel ScanBlocksKernel;
+    cl_kernel AddBlockOffsetsKernel;
+    cl_kernel ScatterActiveKernel;
+
+    // Quantized position readback, see CLPositionPacker
+    cl_kernel PackKernel;
+
+    // Swept collisions, see InitSweptCollisions
+    cl_kernel FirstImpactsKernel;
+
+    // Morton reordering, see InitReordering
+    cl_kernel MortonKeysKernel;
+    cl_kernel PermuteWordsKernel;
+    cl_kernel PermuteVectorsKernel;
+    cl_kernel ScatterByIdKernel;
+
+    // View culling, see CLCuller
+    cl_kernel CullKernel;
+    cl_kernel CompactVisibleKernel;
+
+    // Work-group size of each kernel, the runtime picks for kernels not in here
+    std::map<cl_kernel, size_t> LocalSizes;
+
+    // Commands are timed on ProfileTrack while set, the queue has to be
+    // created with CL_QUEUE_PROFILING_ENABLE
+    Profiler* Profile;
+    unsigned int ProfileTrack;
+};
+
+// Buffers of a prefix scan over Sizes[0] values, see EnqueueScan. Bufs[0]
+// holds the values and every further level the block totals of the one before.
+struct CLScan
+{
+    std::vector<cl_mem> Bufs;
+    std::vector<cl_uint> Sizes;
 };
 
+void ReleaseScan(CLScan& scan)
+{
+    for (cl_mem buffer : scan.Bufs)
+    {
+        if (buffer)
+        {
+            clReleaseMemObject(buffer);
+        }
+    }
+    scan = CLScan{};
+}
+
 struct CLBallState
 {
     cl_mem MassBuf;
@@ -26,10 +103,61 @@ struct CLBallState
     cl_mem VelocityBuf;
     unsigned int Count;
 
-    cl_mem CountBuf;
-    cl_mem GravityBuf;
-    cl_mem DeltaTBuf;
-    cl_mem WinSizeBuf;
+    // handle_collisions writes the next state here, swapped with the above after each step
+    cl_mem PositionOutBuf;
+    cl_mem VelocityOutBuf;
+
+    // GL vertex buffers behind the two position buffers. When GLShared is set
+    // the CL buffers above are created from them and kernels write the drawn data
+    cl_GLuint PositionGLBuf;
+    cl_GLuint PositionOutGLBuf;
+    bool GLShared;
+
+    // The per-ball buffers wrap the BallState arena (CL_MEM_USE_HOST_PTR) and
+    // the host reaches them through clEnqueueMapBuffer
+    bool ZeroCopy;
+
+    // Passed to the kernels by value, gravity is built into the program, see
+    // KernelBuildOptions
+    cl_float DeltaT;
+    cl_uint WorldSize;
+
+    // Uniform grid, cells are at least one ball diameter wide
+    cl_mem CellKeyBuf;
+    cl_mem CellStartBuf;
+    cl_mem CellEndBuf;
+    cl_float CellSize;
+    cl_uint GridDim;
+    cl_uint CellCount;
+    unsigned int SortSize; // Count rounded up to a power of two
+
+    // Sleeping bodies, only set up by InitSleeping. update_ball and
+    // handle_collisions then run over the first ActiveCountBuf entries of
+    // ActiveListBuf. ActiveScan starts from an awake flag per ball.
+    bool Sleeping;
+    cl_mem AsleepBuf;
+    cl_mem QuietStepsBuf;
+    cl_mem WakeBuf;
+    cl_mem ActiveListBuf;
+    cl_mem ActiveCountBuf;
+    CLScan ActiveScan;
+
+    // Swept collisions, only set up by InitSweptCollisions. MaxSpeedBuf holds
+    // the bits of the largest ball speed of the current step, FirstImpactBuf
+    // the ball each one hits first in it.
+    bool Swept;
+    cl_mem MaxSpeedBuf;
+    cl_mem FirstImpactBuf;
+
+    // Morton reordering, only set up by InitReordering. The balls are sorted
+    // along a Z-order curve every ReorderEvery steps. IdBuf holds the ball in
+    // every slot; readbacks scatter through it into BallOrderBuf, so the host
+    // keeps seeing the balls in the order they were created in.
+    cl_uint ReorderEvery;
+    unsigned int StepsSinceReorder;
+    cl_mem IdBuf;
+    cl_mem BallOrderBuf;
+    cl_mem ReorderScratchBuf;
 };
 
 cl_context CreateCtx()
@@ -61,7 +189,72 @@ cl_context CreateCtx()
     return context;
 }
 
-cl_command_queue CreateCmdQueue(cl_context context, cl_device_id *device)
+// Whether the first platform, the one CreateSharedCtx uses, has cl_khr_gl_sharing
+bool GLSharingSupported(cl_platform_id* platform = nullptr)
+{
+    cl_uint numPlatforms;
+    cl_platform_id platformID;
+
+    cl_int errCode = clGetPlatformIDs(1, &platformID, &numPlatforms);
+    if (errCode != CL_SUCCESS || numPlatforms <= 0)
+    {
+        return false;
+    }
+
+    if (platform)
+    {
+        *platform = platformID;
+    }
+
+    size_t extensionsSize = 0;
+    clGetPlatformInfo(platformID, CL_PLATFORM_EXTENSIONS, 0, nullptr, &extensionsSize);
+    std::string extensions(extensionsSize, '\0');
+    clGetPlatformInfo(platformID, CL_PLATFORM_EXTENSIONS, extensionsSize, &extensions[0], nullptr);
+    return extensions.find("cl_khr_gl_sharing") != std::string::npos;
+}
+
+// Context that can share buffers with the OpenGL context current on this
+// thread. Returns nullptr when the platform or the driver can't do it.
+cl_context CreateSharedCtx()
+{
+    cl_platform_id platformID;
+    if (!GLSharingSupported(&platformID))
+    {
+        std::cout << "OpenCL platform does not support cl_khr_gl_sharing." << std::endl;
+        return nullptr;
+    }
+
+#if defined(_WIN32)
+    cl_context_properties contextProperties[] = {
+        CL_GL_CONTEXT_KHR, (cl_context_properties) wglGetCurrentContext(),
+        CL_WGL_HDC_KHR, (cl_context_properties) wglGetCurrentDC(),
+        CL_CONTEXT_PLATFORM, (cl_context_properties) platformID,
+        0
+    };
+#elif defined(__linux__)
+    cl_context_properties contextProperties[] = {
+        CL_GL_CONTEXT_KHR, (cl_context_properties) glXGetCurrentContext(),
+        CL_GLX_DISPLAY_KHR, (cl_context_properties) glXGetCurrentDisplay(),
+        CL_CONTEXT_PLATFORM, (cl_context_properties) platformID,
+        0
+    };
+#else
+    std::cout << "CL/GL sharing is not implemented for this OS." << std::endl;
+    return nullptr;
+#endif
+
+    cl_int errCode;
+    cl_context context = clCreateContextFromType(contextProperties, CL_DEVICE_TYPE_GPU, nullptr, nullptr, &errCode);
+    if (errCode != CL_SUCCESS)
+    {
+        std::cout << "Could not create a GL sharing context." << std::endl;
+        return nullptr;
+    }
+
+    return context;
+}
+
+cl_command_queue CreateCmdQueue(cl_context context, cl_device_id *device, cl_command_queue_properties properties = 0)
 {
 
     size_t deviceBufferSize = -1;
@@ -87,7 +280,7 @@ cl_command_queue CreateCmdQueue(cl_context context, cl_device_id *device)
         return nullptr;
     }
 
-    cl_command_queue commandQueue = clCreateCommandQueue(context, devices[0], 0, nullptr);
+    cl_command_queue commandQueue = clCreateCommandQueue(context, devices[0], properties, nullptr);
     if (commandQueue == nullptr)
     {
         delete [] devices;
@@ -100,7 +293,29 @@ cl_command_queue CreateCmdQueue(cl_context context, cl_device_id *device)
     return commandQueue;
 }
 
-cl_program CreateProgram(cl_context context, cl_device_id device, const char* fileName)
+// The -D values BallLogic.cl is built with for these balls, see the
+// build-time specialization there. The binary cache keys on them, so only
+// values with a few possible settings go in here, anything that changes with
+// the ball count is passed by value.
+std::string KernelBuildOptions(const BallState& balls)
+{
+    std::ostringstream options;
+    options << std::showpoint << std::setprecision(9);
+    options << "-D GRAVITY=(" << gravity << "f)";
+    options << " -D RESTITUTION=(" << Restitution << "f) -D IMPULSE_SCALE=(" << ImpulseScale << "f)";
+
+    const cl_uint* radii = balls.Radius;
+    if (balls.Count > 0 && std::all_of(radii, radii + balls.Count, [radii](cl_uint radius) { return radius == radii[0]; }))
+    {
+        options << " -D UNIFORM_RADIUS=" << radii[0] << "u";
+    }
+
+    return options.str();
+}
+
+// Loads the program from the binary cache when it matches, otherwise builds it
+// from source and refreshes the cache
+cl_program CreateProgram(cl_context context, cl_device_id device, const char* fileName, const std::string& options = "")
 {
     std::ifstream kernelFile(fileName, std::ios::in);
     if (!kernelFile.is_open())
@@ -113,8 +328,17 @@ cl_program CreateProgram(cl_context context, cl_device_id device, const char* fi
     oss << kernelFile.rdbuf();
 
     std::string srcStdStr = oss.str();
+
+    std::string cachePath = ProgramCachePath(fileName, device, options);
+    std::string cacheKey = ProgramCacheKey(device, options, srcStdStr);
+    cl_program program = LoadCachedProgram(context, device, cachePath, cacheKey, options);
+    if (program)
+    {
+        return program;
+    }
+
     const char *srcStr = srcStdStr.c_str();
-    cl_program program = clCreateProgramWithSource(context, 1, (const char**)&srcStr, nullptr, nullptr);
+    program = clCreateProgramWithSource(context, 1, (const char**)&srcStr, nullptr, nullptr);
 
     if (program == nullptr)
     {
@@ -122,7 +346,7 @@ cl_program CreateProgram(cl_context context, cl_device_id device, const char* fi
         return nullptr;
     }
 
-    cl_int errCode = clBuildProgram(program, 0, nullptr, nullptr, nullptr, nullptr);
+    cl_int errCode = clBuildProgram(program, 1, &device, options.c_str(), nullptr, nullptr);
     if (errCode != CL_SUCCESS)
     {
         char buildLog[16384];
@@ -133,6 +357,8 @@ cl_program CreateProgram(cl_context context, cl_device_id device, const char* fi
         return nullptr;
     }
 
+    SaveCachedProgram(program, device, cachePath, cacheKey);
+
     return program;
 }
 
@@ -140,7 +366,30 @@ bool CreateKernels(CLState& state)
 {
     state.BallUpdateKernel = clCreateKernel(state.KernelProgram, "update_ball", nullptr);
     state.BallCollisionKernel = clCreateKernel(state.KernelProgram, "handle_collisions", nullptr);
-    if (!state.BallUpdateKernel || !state.BallCollisionKernel)
+    state.CellKeysKernel = clCreateKernel(state.KernelProgram, "compute_cell_keys", nullptr);
+    state.SortStepKernel = clCreateKernel(state.KernelProgram, "bitonic_sort_step", nullptr);
+    state.ResetCellsKernel = clCreateKernel(state.KernelProgram, "reset_cells", nullptr);
+    state.CellBoundsKernel = clCreateKernel(state.KernelProgram, "find_cell_bounds", nullptr);
+    state.TiledStepKernel = clCreateKernel(state.KernelProgram, "step_tiled", nullptr);
+    state.SleepKernel = clCreateKernel(state.KernelProgram, "update_sleep", nullptr);
+    state.ScanBlocksKernel = clCreateKernel(state.KernelProgram, "scan_blocks", nullptr);
+    state.AddBlockOffsetsKernel = clCreateKernel(state.KernelProgram, "add_block_offsets", nullptr);
+    state.ScatterActiveKernel = clCreateKernel(state.KernelProgram, "scatter_active", nullptr);
+    state.PackKernel = clCreateKernel(state.KernelProgram, "pack_positions", nullptr);
+    state.FirstImpactsKernel = clCreateKernel(state.KernelProgram, "find_first_impacts", nullptr);
+    state.MortonKeysKernel = clCreateKernel(state.KernelProgram, "compute_morton_keys", nullptr);
+    state.PermuteWordsKernel = clCreateKernel(state.KernelProgram, "permute_words", nullptr);
+    state.PermuteVectorsKernel = clCreateKernel(state.KernelProgram, "permute_vectors", nullptr);
+    state.ScatterByIdKernel = clCreateKernel(state.KernelProgram, "scatter_by_id", nullptr);
+    state.CullKernel = clCreateKernel(state.KernelProgram, "cull_visible", nullptr);
+    state.CompactVisibleKernel = clCreateKernel(state.KernelProgram, "compact_visible", nullptr);
+    if (!state.BallUpdateKernel || !state.BallCollisionKernel
+    || !state.CellKeysKernel || !state.SortStepKernel || !state.ResetCellsKernel || !state.CellBoundsKernel
+    || !state.TiledStepKernel
+    || !state.SleepKernel || !state.ScanBlocksKernel || !state.AddBlockOffsetsKernel || !state.ScatterActiveKernel
+    || !state.PackKernel || !state.FirstImpactsKernel
+    || !state.MortonKeysKernel || !state.PermuteWordsKernel || !state.PermuteVectorsKernel || !state.ScatterByIdKernel
+    || !state.CullKernel || !state.CompactVisibleKernel)
     {
         std::cerr << "Failed to create kernel" << std::endl;
         return false;
@@ -150,28 +399,69 @@ bool CreateKernels(CLState& state)
 
 bool AllocateMemObjects(cl_context context, BallState &state, CLBallState& clState)
 {
-    clState.MassBuf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, state.Count * sizeof(cl_float), state.Mass, nullptr);
-    clState.RadiusBuf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, state.Count * sizeof(cl_uint), state.Radius, nullptr);
-    clState.PositionBuf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, state.Count * sizeof(cl_float2), state.Position, nullptr);
-    clState.VelocityBuf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, state.Count * sizeof(cl_float2), state.Velocity, nullptr);
-
-    clState.CountBuf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint), (cl_uint*)&state.Count, nullptr);
-    clState.GravityBuf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(cl_float), (cl_float*)&gravity, nullptr);
-    clState.WinSizeBuf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint), (cl_uint*)&WinSize, nullptr);
+    size_t vectorSize = state.Count * sizeof(cl_float2);
+    if (clState.ZeroCopy)
+    {
+        // The buffers wrap the arena arrays, which are page aligned and padded
+        // to whole pages, so the device works on them in place
+        cl_mem_flags flags = CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR;
+        clState.MassBuf = clCreateBuffer(context, flags, arena_size(state.Count * sizeof(cl_float)), state.Mass, nullptr);
+        clState.RadiusBuf = clCreateBuffer(context, flags, arena_size(state.Count * sizeof(cl_uint)), state.Radius, nullptr);
+        clState.VelocityBuf = clCreateBuffer(context, flags, arena_size(vectorSize), state.Velocity, nullptr);
+        clState.VelocityOutBuf = clCreateBuffer(context, flags, arena_size(vectorSize), state.VelocityOut, nullptr);
+    }
+    else
+    {
+        clState.MassBuf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, state.Count * sizeof(cl_float), state.Mass, nullptr);
+        clState.RadiusBuf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, state.Count * sizeof(cl_uint), state.Radius, nullptr);
+        clState.VelocityBuf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, vectorSize, state.Velocity, nullptr);
+        clState.VelocityOutBuf = clCreateBuffer(context, CL_MEM_READ_WRITE, vectorSize, nullptr, nullptr);
+    }
 
-    cl_float f = 0;
-    clState.DeltaTBuf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(cl_float), &f, nullptr);
+    if (clState.GLShared)
+    {
+        // The GL buffers were filled with the initial positions when created
+        clState.PositionBuf = clCreateFromGLBuffer(context, CL_MEM_READ_WRITE, clState.PositionGLBuf, nullptr);
+        clState.PositionOutBuf = clCreateFromGLBuffer(context, CL_MEM_READ_WRITE, clState.PositionOutGLBuf, nullptr);
+    }
+    else if (clState.ZeroCopy)
+    {
+        clState.PositionBuf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, arena_size(vectorSize), state.Position, nullptr);
+        clState.PositionOutBuf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, arena_size(vectorSize), state.PositionOut, nullptr);
+    }
+    else
+    {
+        clState.PositionBuf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, vectorSize, state.Position, nullptr);
+        clState.PositionOutBuf = clCreateBuffer(context, CL_MEM_READ_WRITE, vectorSize, nullptr, nullptr);
+    }
 
     clState.Count = state.Count;
+    clState.DeltaT = 0.0f;
+    clState.WorldSize = WorldSize;
+
+    cl_uint maxRadius = *std::max_element(state.Radius, state.Radius + state.Count);
+    clState.CellSize = 2.0f * maxRadius;
+    clState.GridDim = (cl_uint)std::ceil(WorldSize / clState.CellSize);
+    clState.SortSize = 1;
+    while (clState.SortSize < clState.Count)
+    {
+        clState.SortSize <<= 1;
+    }
+
+    clState.CellCount = clState.GridDim * clState.GridDim;
+    clState.CellKeyBuf = clCreateBuffer(context, CL_MEM_READ_WRITE, clState.SortSize * sizeof(cl_uint2), nullptr, nullptr);
+    clState.CellStartBuf = clCreateBuffer(context, CL_MEM_READ_WRITE, clState.CellCount * sizeof(cl_uint), nullptr, nullptr);
+    clState.CellEndBuf = clCreateBuffer(context, CL_MEM_READ_WRITE, clState.CellCount * sizeof(cl_uint), nullptr, nullptr);
 
     if (clState.MassBuf == nullptr
     || clState.RadiusBuf == nullptr
     || clState.PositionBuf == nullptr
     || clState.VelocityBuf == nullptr
-    || clState.CountBuf == nullptr
-    || clState.GravityBuf == nullptr
-    || clState.DeltaTBuf == nullptr
-    || clState.WinSizeBuf == nullptr)
+    || clState.PositionOutBuf == nullptr
+    || clState.VelocityOutBuf == nullptr
+    || clState.CellKeyBuf == nullptr
+    || clState.CellStartBuf == nullptr
+    || clState.CellEndBuf == nullptr)
     {
         std::cerr << "Failed to create CL mem objects" << std::endl;
         return false;
@@ -187,11 +477,35 @@ void Deallocate(CLState& clState, CLBallState& clBallState)
     clReleaseMemObject(clBallState.RadiusBuf);
     clReleaseMemObject(clBallState.PositionBuf);
     clReleaseMemObject(clBallState.VelocityBuf);
+    clReleaseMemObject(clBallState.PositionOutBuf);
+    clReleaseMemObject(clBallState.VelocityOutBuf);
+
+    clReleaseMemObject(clBallState.CellKeyBuf);
+    clReleaseMemObject(clBallState.CellStartBuf);
+    clReleaseMemObject(clBallState.CellEndBuf);
+
+    if (clBallState.Sleeping)
+    {
+        cl_mem sleepBuffers[] = { clBallState.AsleepBuf, clBallState.QuietStepsBuf, clBallState.WakeBuf, clBallState.ActiveListBuf, clBallState.ActiveCountBuf };
+        for (cl_mem buffer : sleepBuffers)
+        {
+            clReleaseMemObject(buffer);
+        }
+        ReleaseScan(clBallState.ActiveScan);
+    }
+
+    if (clBallState.Swept)
+    {
+        clReleaseMemObject(clBallState.MaxSpeedBuf);
+        clReleaseMemObject(clBallState.FirstImpactBuf);
+    }
 
-    clReleaseMemObject(clBallState.CountBuf);
-    clReleaseMemObject(clBallState.GravityBuf);
-    clReleaseMemObject(clBallState.WinSizeBuf);
-    clReleaseMemObject(clBallState.DeltaTBuf);
+    if (clBallState.ReorderEvery)
+    {
+        clReleaseMemObject(clBallState.IdBuf);
+        clReleaseMemObject(clBallState.BallOrderBuf);
+        clReleaseMemObject(clBallState.ReorderScratchBuf);
+    }
 
     if (clState.CommandQueue)
     {
@@ -208,6 +522,19 @@ void Deallocate(CLState& clState, CLBallState& clBallState)
         clReleaseKernel(clState.BallCollisionKernel);
     }
 
+    cl_kernel stepKernels[] = { clState.CellKeysKernel, clState.SortStepKernel, clState.ResetCellsKernel, clState.CellBoundsKernel, clState.TiledStepKernel,
+                                clState.SleepKernel, clState.ScanBlocksKernel, clState.AddBlockOffsetsKernel, clState.ScatterActiveKernel,
+                                clState.PackKernel, clState.FirstImpactsKernel,
+                                clState.MortonKeysKernel, clState.PermuteWordsKernel, clState.PermuteVectorsKernel, clState.ScatterByIdKernel,
+                                clState.CullKernel, clState.CompactVisibleKernel };
+    for (cl_kernel kernel : stepKernels)
+    {
+        if (kernel)
+        {
+            clReleaseKernel(kernel);
+        }
+    }
+
     if (clState.KernelProgram)
     {
         clReleaseProgram(clState.KernelProgram);
@@ -219,23 +546,48 @@ void Deallocate(CLState& clState, CLBallState& clBallState)
     }
 }
 
-int InitOpenCL(BallState& ballState, CLBallState& clBallState, CLState& clState)
+// CPUs and integrated GPUs work on host memory, so wrapping host arrays costs nothing
+bool HasUnifiedMemory(cl_device_id device)
+{
+    cl_device_type type = 0;
+    cl_bool unified = CL_FALSE;
+    clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(cl_device_type), &type, nullptr);
+    clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &unified, nullptr);
+    return (type & CL_DEVICE_TYPE_CPU) || unified == CL_TRUE;
+}
+
+// With glSharing the position buffers are created from PositionGLBuf and
+// PositionOutGLBuf if the device allows it, clBallState.GLShared tells which
+int InitOpenCL(BallState& ballState, CLBallState& clBallState, CLState& clState, bool glSharing = false, bool profiling = false)
 {
-    clState.CTX = CreateCtx();
+    clBallState.GLShared = false;
+    if (glSharing)
+    {
+        clState.CTX = CreateSharedCtx();
+        clBallState.GLShared = clState.CTX != nullptr;
+    }
+
+    if (!clState.CTX)
+    {
+        clState.CTX = CreateCtx();
+    }
+
     if (!clState.CTX)
     {
         return -1;
     }
 
     cl_device_id deviceID = nullptr;
-    clState.CommandQueue = CreateCmdQueue(clState.CTX, &deviceID);
+    clState.CommandQueue = CreateCmdQueue(clState.CTX, &deviceID, profiling ? CL_QUEUE_PROFILING_ENABLE : 0);
     if (!clState.CommandQueue)
     {
         Deallocate(clState, clBallState);
         return -2;
     }
+    clState.Device = deviceID;
+    clBallState.ZeroCopy = HasUnifiedMemory(deviceID);
 
-    clState.KernelProgram = CreateProgram(clState.CTX, deviceID, "BallLogic.cl");
+    clState.KernelProgram = CreateProgram(clState.CTX, deviceID, "BallLogic.cl", KernelBuildOptions(ballState));
     if (!clState.KernelProgram)
     {
         Deallocate(clState, clBallState);
@@ -257,84 +609,1363 @@ int InitOpenCL(BallState& ballState, CLBallState& clBallState, CLState& clState)
     return 0;
 }
 
-bool SetBallUpdateKernelParamsInit(CLBallState& clBallState, CLState& clState, cl_float& gravity, cl_uint& WinSize)
+bool WaitAndRelease(cl_event event)
+{
+    bool success = clWaitForEvents(1, &event) == CL_SUCCESS;
+    clReleaseEvent(event);
+    return success;
+}
+
+std::string GetKernelName(cl_kernel kernel)
+{
+    size_t size = 0;
+    if (clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, nullptr, &size) != CL_SUCCESS || size == 0)
+    {
+        return "";
+    }
+
+    std::vector<char> name(size);
+    clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, size, name.data(), nullptr);
+    return std::string(name.data());
+}
+
+// Hands a command's event to the profiler, if there is one
+void ProfileCommand(CLState& state, const std::string& name, cl_event event)
+{
+    if (state.Profile)
+    {
+        TrackEvent(*state.Profile, state.ProfileTrack, name, event);
+    }
+}
+
+void ProfileKernel(CLState& state, cl_kernel kernel, cl_event event)
+{
+    std::lock_guard<std::recursive_mutex> lock(state.Profile->Lock);
+    std::map<cl_kernel, std::string>& names = state.Profile->KernelNames;
+    std::map<cl_kernel, std::string>::iterator name = names.find(kernel);
+    if (name == names.end())
+    {
+        name = names.insert(std::make_pair(kernel, GetKernelName(kernel))).first;
+    }
+
+    ProfileCommand(state, name->second, event);
+}
+
+bool SetBallUpdateKernelParamsInit(CLBallState& clBallState, CLState& clState)
 {
     cl_int errCode = clSetKernelArg(clState.BallUpdateKernel, 0, sizeof(cl_mem), &clBallState.MassBuf);
     errCode |= clSetKernelArg(clState.BallUpdateKernel, 1, sizeof(cl_mem), &clBallState.RadiusBuf);
     errCode |= clSetKernelArg(clState.BallUpdateKernel, 2, sizeof(cl_mem), &clBallState.PositionBuf);
     errCode |= clSetKernelArg(clState.BallUpdateKernel, 3, sizeof(cl_mem), &clBallState.VelocityBuf);
-    errCode |= clSetKernelArg(clState.BallUpdateKernel, 4, sizeof(cl_mem), &clBallState.GravityBuf);
-    errCode |= clSetKernelArg(clState.BallUpdateKernel, 5, sizeof(cl_mem), &clBallState.DeltaTBuf);
-    errCode |= clSetKernelArg(clState.BallUpdateKernel, 6, sizeof(cl_mem), &clBallState.WinSizeBuf);
+    errCode |= clSetKernelArg(clState.BallUpdateKernel, 4, sizeof(cl_float), &clBallState.DeltaT);
+    errCode |= clSetKernelArg(clState.BallUpdateKernel, 5, sizeof(cl_uint), &clBallState.WorldSize);
+    errCode |= clSetKernelArg(clState.BallUpdateKernel, 6, sizeof(cl_uint), &clBallState.Count);
+
+    // Every ball until InitSleeping sets an active list, integrated here until InitSweptCollisions
+    errCode |= clSetKernelArg(clState.BallUpdateKernel, 7, sizeof(cl_mem), nullptr);
+    errCode |= clSetKernelArg(clState.BallUpdateKernel, 8, sizeof(cl_mem), nullptr);
+    errCode |= clSetKernelArg(clState.BallUpdateKernel, 9, sizeof(cl_mem), nullptr);
 
     return errCode == CL_SUCCESS;
 }
 
-bool BallUpdateBufferUpdate(CLState& clState, CLBallState& clBallState, float& deltaT)
+// The kernels capture their arguments when they are enqueued, so steps
+// already queued keep the length they were queued with
+bool SetTimeStepArgs(CLState& clState, CLBallState& clBallState, float deltaT)
 {
-    cl_event readEvent;
+    clBallState.DeltaT = deltaT;
+    cl_int errCode = clSetKernelArg(clState.BallUpdateKernel, 4, sizeof(cl_float), &clBallState.DeltaT);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 17, sizeof(cl_float), &clBallState.DeltaT);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 6, sizeof(cl_float), &clBallState.DeltaT);
+    errCode |= clSetKernelArg(clState.FirstImpactsKernel, 12, sizeof(cl_float), &clBallState.DeltaT);
+    return errCode == CL_SUCCESS;
+}
 
-    if(clEnqueueWriteBuffer(clState.CommandQueue, clBallState.DeltaTBuf, CL_TRUE, 0, sizeof(cl_float), (cl_float*)&deltaT, 0, nullptr, &readEvent) != CL_SUCCESS)
+bool SetBallCollisionKernelParamsInit(CLBallState& clBallState, CLState& clState)
+{
+    cl_int errCode = clSetKernelArg(clState.BallCollisionKernel, 0, sizeof(cl_mem), &clBallState.MassBuf);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 1, sizeof(cl_mem), &clBallState.RadiusBuf);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 2, sizeof(cl_mem), &clBallState.PositionBuf);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 3, sizeof(cl_mem), &clBallState.VelocityBuf);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 4, sizeof(cl_mem), &clBallState.PositionOutBuf);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 5, sizeof(cl_mem), &clBallState.VelocityOutBuf);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 6, sizeof(cl_mem), &clBallState.CellKeyBuf);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 7, sizeof(cl_mem), &clBallState.CellStartBuf);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 8, sizeof(cl_mem), &clBallState.CellEndBuf);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 9, sizeof(cl_float), &clBallState.CellSize);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 10, sizeof(cl_uint), &clBallState.GridDim);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 11, sizeof(cl_uint), &clBallState.Count);
+
+    for (cl_uint sleepArg = 12; sleepArg <= 16; ++sleepArg)
     {
-        return false;
+        errCode |= clSetKernelArg(clState.BallCollisionKernel, sleepArg, sizeof(cl_mem), nullptr);
     }
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 17, sizeof(cl_float), &clBallState.DeltaT);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 18, sizeof(cl_uint), &clBallState.WorldSize);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 19, sizeof(cl_mem), nullptr);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 20, sizeof(cl_mem), nullptr);
 
-    return clWaitForEvents(1, &readEvent) == CL_SUCCESS;
+    return errCode == CL_SUCCESS;
 }
 
-bool BallUpdateBufferRead(CLState& clState, CLBallState& clBallState, float& deltaT)
+bool SetBroadphaseKernelParamsInit(CLBallState& clBallState, CLState& clState)
 {
-    cl_event writeEvent;
+    cl_int errCode = clSetKernelArg(clState.CellKeysKernel, 0, sizeof(cl_mem), &clBallState.PositionBuf);
+    errCode |= clSetKernelArg(clState.CellKeysKernel, 1, sizeof(cl_mem), &clBallState.CellKeyBuf);
+    errCode |= clSetKernelArg(clState.CellKeysKernel, 2, sizeof(cl_uint), &clBallState.Count);
+    errCode |= clSetKernelArg(clState.CellKeysKernel, 3, sizeof(cl_uint), &clBallState.SortSize);
+    errCode |= clSetKernelArg(clState.CellKeysKernel, 4, sizeof(cl_float), &clBallState.CellSize);
+    errCode |= clSetKernelArg(clState.CellKeysKernel, 5, sizeof(cl_uint), &clBallState.GridDim);
+
+    errCode |= clSetKernelArg(clState.SortStepKernel, 0, sizeof(cl_mem), &clBallState.CellKeyBuf);
+    errCode |= clSetKernelArg(clState.SortStepKernel, 3, sizeof(cl_uint), &clBallState.SortSize);
+
+    errCode |= clSetKernelArg(clState.ResetCellsKernel, 0, sizeof(cl_mem), &clBallState.CellStartBuf);
+    errCode |= clSetKernelArg(clState.ResetCellsKernel, 1, sizeof(cl_uint), &clBallState.CellCount);
 
-    if (clEnqueueReadBuffer(clState.CommandQueue, clBallState.DeltaTBuf, CL_TRUE, 0, sizeof(cl_float), (void *)&deltaT, 0, NULL, &writeEvent) != CL_SUCCESS)
+    errCode |= clSetKernelArg(clState.CellBoundsKernel, 0, sizeof(cl_mem), &clBallState.CellKeyBuf);
+    errCode |= clSetKernelArg(clState.CellBoundsKernel, 1, sizeof(cl_mem), &clBallState.CellStartBuf);
+    errCode |= clSetKernelArg(clState.CellBoundsKernel, 2, sizeof(cl_mem), &clBallState.CellEndBuf);
+    errCode |= clSetKernelArg(clState.CellBoundsKernel, 3, sizeof(cl_uint), &clBallState.Count);
+
+    return errCode == CL_SUCCESS;
+}
+
+// Changes how many balls the kernels work on, at most the count the buffers
+// were allocated for
+bool SetBallCount(CLState& clState, CLBallState& clBallState, cl_uint count)
+{
+    clBallState.Count = count;
+    clBallState.SortSize = 1;
+    while (clBallState.SortSize < count)
     {
-        return false;
+        clBallState.SortSize <<= 1;
     }
 
-    return clWaitForEvents(1, &writeEvent) == CL_SUCCESS;
+    cl_int errCode = clSetKernelArg(clState.BallUpdateKernel, 6, sizeof(cl_uint), &clBallState.Count);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 11, sizeof(cl_uint), &clBallState.Count);
+    errCode |= clSetKernelArg(clState.CellKeysKernel, 2, sizeof(cl_uint), &clBallState.Count);
+    errCode |= clSetKernelArg(clState.CellKeysKernel, 3, sizeof(cl_uint), &clBallState.SortSize);
+    errCode |= clSetKernelArg(clState.SortStepKernel, 3, sizeof(cl_uint), &clBallState.SortSize);
+    errCode |= clSetKernelArg(clState.CellBoundsKernel, 3, sizeof(cl_uint), &clBallState.Count);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 8, sizeof(cl_uint), &clBallState.Count);
+    errCode |= clSetKernelArg(clState.FirstImpactsKernel, 8, sizeof(cl_uint), &clBallState.Count);
+
+    return errCode == CL_SUCCESS;
+}
+
+// update_sleep freezes balls into both state buffers, in the order they are current in
+cl_int SetSleepStateArgs(CLBallState& clBallState, CLState& clState)
+{
+    cl_int errCode = clSetKernelArg(clState.SleepKernel, 0, sizeof(cl_mem), &clBallState.PositionBuf);
+    errCode |= clSetKernelArg(clState.SleepKernel, 1, sizeof(cl_mem), &clBallState.VelocityBuf);
+    errCode |= clSetKernelArg(clState.SleepKernel, 2, sizeof(cl_mem), &clBallState.PositionOutBuf);
+    errCode |= clSetKernelArg(clState.SleepKernel, 3, sizeof(cl_mem), &clBallState.VelocityOutBuf);
+    return errCode;
 }
 
-bool SetBallCollisionKernelParamsInit(CLBallState& clBallState, CLState& clState, cl_uint& WinSize)
+// Makes the state written by handle_collisions the input of the next step
+bool SwapStateBuffers(CLBallState& clBallState, CLState& clState)
 {
-    cl_int errCode = clSetKernelArg(clState.BallCollisionKernel, 0, sizeof(cl_mem), &clBallState.MassBuf);
-    errCode |= clSetKernelArg(clState.BallCollisionKernel, 1, sizeof(cl_mem), &clBallState.RadiusBuf);
+    std::swap(clBallState.PositionBuf, clBallState.PositionOutBuf);
+    std::swap(clBallState.VelocityBuf, clBallState.VelocityOutBuf);
+    std::swap(clBallState.PositionGLBuf, clBallState.PositionOutGLBuf);
+
+    cl_int errCode = clSetKernelArg(clState.BallUpdateKernel, 2, sizeof(cl_mem), &clBallState.PositionBuf);
+    errCode |= clSetKernelArg(clState.BallUpdateKernel, 3, sizeof(cl_mem), &clBallState.VelocityBuf);
+    errCode |= clSetKernelArg(clState.CellKeysKernel, 0, sizeof(cl_mem), &clBallState.PositionBuf);
     errCode |= clSetKernelArg(clState.BallCollisionKernel, 2, sizeof(cl_mem), &clBallState.PositionBuf);
     errCode |= clSetKernelArg(clState.BallCollisionKernel, 3, sizeof(cl_mem), &clBallState.VelocityBuf);
-    errCode |= clSetKernelArg(clState.BallCollisionKernel, 4, sizeof(cl_mem), &clBallState.CountBuf);
-    errCode |= clSetKernelArg(clState.BallCollisionKernel, 5, sizeof(cl_mem), &clBallState.WinSizeBuf);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 4, sizeof(cl_mem), &clBallState.PositionOutBuf);
+    errCode |= clSetKernelArg(clState.BallCollisionKernel, 5, sizeof(cl_mem), &clBallState.VelocityOutBuf);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 2, sizeof(cl_mem), &clBallState.PositionBuf);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 3, sizeof(cl_mem), &clBallState.VelocityBuf);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 4, sizeof(cl_mem), &clBallState.PositionOutBuf);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 5, sizeof(cl_mem), &clBallState.VelocityOutBuf);
+
+    if (clBallState.Sleeping)
+    {
+        errCode |= SetSleepStateArgs(clBallState, clState);
+    }
+
+    if (clBallState.Swept)
+    {
+        errCode |= clSetKernelArg(clState.FirstImpactsKernel, 1, sizeof(cl_mem), &clBallState.PositionBuf);
+        errCode |= clSetKernelArg(clState.FirstImpactsKernel, 2, sizeof(cl_mem), &clBallState.VelocityBuf);
+    }
 
     return errCode == CL_SUCCESS;
 }
 
-bool RunKernels(CLState& state, CLBallState& clBallState)
+// Launches globalSize work-items with the kernel's work-group size. The global
+// size is padded up to a multiple of it and the kernels skip the extra items.
+bool EnqueueKernel(CLState& state, cl_kernel kernel, size_t globalSize, cl_event* event = nullptr)
 {
-    size_t localWorkSize = 1;
-    cl_event runEvents[2];
-    cl_int errCode = clEnqueueNDRangeKernel(state.CommandQueue, state.BallUpdateKernel, 1, nullptr, (size_t*)&clBallState.Count, &localWorkSize, 0, nullptr, &runEvents[0]);
-    errCode = clEnqueueNDRangeKernel(state.CommandQueue, state.BallCollisionKernel, 1, nullptr, (size_t*)&clBallState.Count, &localWorkSize, 0, nullptr, &runEvents[1]);
+    // The profiler needs an event for every launch, not just the ones the caller waits on
+    cl_event profileEvent = nullptr;
+    cl_event* launchEvent = event ? event : (state.Profile ? &profileEvent : nullptr);
+
+    std::map<cl_kernel, size_t>::iterator localSize = state.LocalSizes.find(kernel);
+    size_t globalWorkSize = globalSize;
+    const size_t* localWorkSize = nullptr;
+    if (localSize != state.LocalSizes.end())
+    {
+        globalWorkSize = (globalSize + localSize->second - 1) / localSize->second * localSize->second;
+        localWorkSize = &localSize->second;
+    }
+
+    if (clEnqueueNDRangeKernel(state.CommandQueue, kernel, 1, nullptr, &globalWorkSize, localWorkSize, 0, nullptr, launchEvent) != CL_SUCCESS)
+    {
+        return false;
+    }
 
-    return errCode == CL_SUCCESS && clWaitForEvents(2, runEvents) == CL_SUCCESS;
+    if (state.Profile)
+    {
+        ProfileKernel(state, kernel, *launchEvent);
+    }
+    if (profileEvent)
+    {
+        clReleaseEvent(profileEvent);
+    }
+    return true;
 }
 
-bool ReadPositionBuffer(BallState& ballState, CLBallState& clBallState, CLState& clState)
+// Sorts the SortSize keys in CellKeyBuf
+bool RunKeySort(CLState& state, CLBallState& clBallState)
 {
-    cl_event readEvent;
+    for (cl_uint stage = 2; stage <= clBallState.SortSize; stage <<= 1)
+    {
+        for (cl_uint pass = stage >> 1; pass > 0; pass >>= 1)
+        {
+            cl_int errCode = clSetKernelArg(state.SortStepKernel, 1, sizeof(cl_uint), &stage);
+            errCode |= clSetKernelArg(state.SortStepKernel, 2, sizeof(cl_uint), &pass);
+            if (errCode != CL_SUCCESS || !EnqueueKernel(state, state.SortStepKernel, clBallState.SortSize))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Bins every ball into the grid and rebuilds the per-cell ranges of the sorted keys
+bool RunBroadphase(CLState& state, CLBallState& clBallState)
+{
+    return EnqueueKernel(state, state.CellKeysKernel, clBallState.SortSize)
+        && RunKeySort(state, clBallState)
+        && EnqueueKernel(state, state.ResetCellsKernel, clBallState.CellCount)
+        && EnqueueKernel(state, state.CellBoundsKernel, clBallState.Count);
+}
+
+// Largest work-group of the scan, a power of two. Each group scans twice its size.
+const size_t MaxScanGroupSize = 128;
+
+// Allocates the levels of a scan over count values. The first scan set up
+// also picks the work-group size every scan uses.
+bool InitScan(CLState& state, CLScan& scan, cl_uint count)
+{
+    if (state.LocalSizes.find(state.ScanBlocksKernel) == state.LocalSizes.end())
+    {
+        size_t kernelMaxSize = 1;
+        clGetKernelWorkGroupInfo(state.ScanBlocksKernel, state.Device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernelMaxSize, nullptr);
+        size_t groupSize = 1;
+        while (groupSize * 2 <= std::min(MaxScanGroupSize, kernelMaxSize))
+        {
+            groupSize *= 2;
+        }
+        state.LocalSizes[state.ScanBlocksKernel] = groupSize;
+
+        cl_uint blockSize = (cl_uint)(2 * groupSize);
+        cl_int errCode = clSetKernelArg(state.ScanBlocksKernel, 3, blockSize * sizeof(cl_uint), nullptr);
+        errCode |= clSetKernelArg(state.AddBlockOffsetsKernel, 3, sizeof(cl_uint), &blockSize);
+        if (errCode != CL_SUCCESS)
+        {
+            return false;
+        }
+    }
+
+    cl_uint blockSize = (cl_uint)(2 * state.LocalSizes[state.ScanBlocksKernel]);
+    for (cl_uint size = count; ; size = (size + blockSize - 1) / blockSize)
+    {
+        scan.Sizes.push_back(size);
+        scan.Bufs.push_back(clCreateBuffer(state.CTX, CL_MEM_READ_WRITE, size * sizeof(cl_uint), nullptr, nullptr));
+        if (!scan.Bufs.back())
+        {
+            return false;
+        }
+        if (size <= blockSize)
+        {
+            break;
+        }
+    }
+
+    return true;
+}
 
-    if(clEnqueueReadBuffer(clState.CommandQueue, clBallState.PositionBuf, CL_TRUE, 0, clBallState.Count * sizeof(cl_float2), ballState.Position, 0, nullptr, &readEvent) != CL_SUCCESS)
+// Turns the values in scan.Bufs[0] into their exclusive prefix sums and
+// writes their total to total
+bool EnqueueScan(CLState& state, CLScan& scan, cl_mem total)
+{
+    size_t groupSize = state.LocalSizes[state.ScanBlocksKernel];
+    cl_uint blockSize = (cl_uint)(2 * groupSize);
+    size_t levels = scan.Bufs.size();
+
+    // Scan every level, the totals of the last one are the total
+    for (size_t level = 0; level < levels; ++level)
+    {
+        cl_mem blockSums = level + 1 < levels ? scan.Bufs[level + 1] : total;
+        cl_uint size = scan.Sizes[level];
+        size_t blocks = (size + blockSize - 1) / blockSize;
+
+        cl_int errCode = clSetKernelArg(state.ScanBlocksKernel, 0, sizeof(cl_mem), &scan.Bufs[level]);
+        errCode |= clSetKernelArg(state.ScanBlocksKernel, 1, sizeof(cl_mem), &blockSums);
+        errCode |= clSetKernelArg(state.ScanBlocksKernel, 2, sizeof(cl_uint), &size);
+        if (errCode != CL_SUCCESS || !EnqueueKernel(state, state.ScanBlocksKernel, blocks * groupSize))
+        {
+            return false;
+        }
+    }
+
+    // Then add the scanned totals back, top level first
+    for (size_t level = levels - 1; level > 0; --level)
+    {
+        cl_uint size = scan.Sizes[level - 1];
+        cl_int errCode = clSetKernelArg(state.AddBlockOffsetsKernel, 0, sizeof(cl_mem), &scan.Bufs[level - 1]);
+        errCode |= clSetKernelArg(state.AddBlockOffsetsKernel, 1, sizeof(cl_mem), &scan.Bufs[level]);
+        errCode |= clSetKernelArg(state.AddBlockOffsetsKernel, 2, sizeof(cl_uint), &size);
+        if (errCode != CL_SUCCESS || !EnqueueKernel(state, state.AddBlockOffsetsKernel, size))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Sets up sleeping bodies for the grid step, with every ball awake. Runs after
+// InitKernels, so the tuner still times the kernels over all the balls.
+bool InitSleeping(CLState& state, CLBallState& clBallState)
+{
+    if (state.UseTiledStep)
     {
+        std::cerr << "Sleeping bodies need the grid collisions" << std::endl;
         return false;
     }
 
-    return clWaitForEvents(1, &readEvent) == CL_SUCCESS;
+    // Set first, so Deallocate releases whatever gets created
+    clBallState.Sleeping = true;
+
+    cl_uint count = clBallState.Count;
+    std::vector<cl_uint> zeros(count, 0);
+    cl_mem_flags flags = CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR;
+    clBallState.AsleepBuf = clCreateBuffer(state.CTX, flags, count * sizeof(cl_uint), zeros.data(), nullptr);
+    clBallState.QuietStepsBuf = clCreateBuffer(state.CTX, flags, count * sizeof(cl_uint), zeros.data(), nullptr);
+    clBallState.WakeBuf = clCreateBuffer(state.CTX, flags, count * sizeof(cl_uint), zeros.data(), nullptr);
+    clBallState.ActiveListBuf = clCreateBuffer(state.CTX, CL_MEM_READ_WRITE, count * sizeof(cl_uint), nullptr, nullptr);
+    clBallState.ActiveCountBuf = clCreateBuffer(state.CTX, flags, sizeof(cl_uint), &count, nullptr);
+
+    bool allocated = clBallState.AsleepBuf && clBallState.QuietStepsBuf && clBallState.WakeBuf && clBallState.ActiveListBuf && clBallState.ActiveCountBuf;
+    allocated = InitScan(state, clBallState.ActiveScan, count) && allocated;
+
+    if (!allocated)
+    {
+        std::cerr << "Failed to create the sleeping body buffers" << std::endl;
+        return false;
+    }
+
+    cl_int errCode = SetSleepStateArgs(clBallState, state);
+    errCode |= clSetKernelArg(state.SleepKernel, 4, sizeof(cl_mem), &clBallState.AsleepBuf);
+    errCode |= clSetKernelArg(state.SleepKernel, 5, sizeof(cl_mem), &clBallState.QuietStepsBuf);
+    errCode |= clSetKernelArg(state.SleepKernel, 6, sizeof(cl_mem), &clBallState.WakeBuf);
+    errCode |= clSetKernelArg(state.SleepKernel, 7, sizeof(cl_mem), &clBallState.ActiveScan.Bufs[0]);
+    errCode |= clSetKernelArg(state.SleepKernel, 8, sizeof(cl_uint), &count);
+
+    errCode |= clSetKernelArg(state.ScatterActiveKernel, 0, sizeof(cl_mem), &clBallState.AsleepBuf);
+    errCode |= clSetKernelArg(state.ScatterActiveKernel, 1, sizeof(cl_mem), &clBallState.ActiveScan.Bufs[0]);
+    errCode |= clSetKernelArg(state.ScatterActiveKernel, 2, sizeof(cl_mem), &clBallState.ActiveListBuf);
+    errCode |= clSetKernelArg(state.ScatterActiveKernel, 3, sizeof(cl_uint), &count);
+
+    errCode |= clSetKernelArg(state.BallUpdateKernel, 7, sizeof(cl_mem), &clBallState.ActiveListBuf);
+    errCode |= clSetKernelArg(state.BallUpdateKernel, 8, sizeof(cl_mem), &clBallState.ActiveCountBuf);
+
+    errCode |= clSetKernelArg(state.BallCollisionKernel, 12, sizeof(cl_mem), &clBallState.ActiveListBuf);
+    errCode |= clSetKernelArg(state.BallCollisionKernel, 13, sizeof(cl_mem), &clBallState.ActiveCountBuf);
+    errCode |= clSetKernelArg(state.BallCollisionKernel, 14, sizeof(cl_mem), &clBallState.AsleepBuf);
+    errCode |= clSetKernelArg(state.BallCollisionKernel, 15, sizeof(cl_mem), &clBallState.QuietStepsBuf);
+    errCode |= clSetKernelArg(state.BallCollisionKernel, 16, sizeof(cl_mem), &clBallState.WakeBuf);
+
+    return errCode == CL_SUCCESS;
 }
 
+// Wakes and freezes balls, then compacts the awake ones into the active list.
+// The kernels after it still launch one work-item per ball, the ones past the
+// number of awake balls return straight away.
+bool EnqueueActiveList(CLState& state, CLBallState& clBallState)
+{
+    return EnqueueKernel(state, state.SleepKernel, clBallState.Count)
+        && EnqueueScan(state, clBallState.ActiveScan, clBallState.ActiveCountBuf)
+        && EnqueueKernel(state, state.ScatterActiveKernel, clBallState.Count);
+}
+
+// Switches the grid step to swept collisions. Runs after InitKernels, and
+// after InitSleeping when both are on.
+bool InitSweptCollisions(CLState& state, CLBallState& clBallState)
+{
+    if (state.UseTiledStep)
+    {
+        std::cerr << "Swept collisions need the grid collisions" << std::endl;
+        return false;
+    }
+
+    // Set first, so Deallocate releases whatever gets created
+    clBallState.Swept = true;
+
+    cl_uint zero = 0;
+    clBallState.MaxSpeedBuf = clCreateBuffer(state.CTX, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint), &zero, nullptr);
+    clBallState.FirstImpactBuf = clCreateBuffer(state.CTX, CL_MEM_READ_WRITE, clBallState.Count * sizeof(cl_uint), nullptr, nullptr);
+    if (!clBallState.MaxSpeedBuf || !clBallState.FirstImpactBuf)
+    {
+        std::cerr << "Failed to create the swept collision buffers" << std::endl;
+        return false;
+    }
 
+    cl_kernel kernel = state.FirstImpactsKernel;
+    cl_int errCode = clSetKernelArg(kernel, 0, sizeof(cl_mem), &clBallState.RadiusBuf);
+    errCode |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &clBallState.PositionBuf);
+    errCode |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &clBallState.VelocityBuf);
+    errCode |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &clBallState.CellKeyBuf);
+    errCode |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &clBallState.CellStartBuf);
+    errCode |= clSetKernelArg(kernel, 5, sizeof(cl_mem), &clBallState.CellEndBuf);
+    errCode |= clSetKernelArg(kernel, 6, sizeof(cl_float), &clBallState.CellSize);
+    errCode |= clSetKernelArg(kernel, 7, sizeof(cl_uint), &clBallState.GridDim);
+    errCode |= clSetKernelArg(kernel, 8, sizeof(cl_uint), &clBallState.Count);
+
+    // NULL without sleeping, like the rest of the active list arguments
+    errCode |= clSetKernelArg(kernel, 9, sizeof(cl_mem), &clBallState.ActiveListBuf);
+    errCode |= clSetKernelArg(kernel, 10, sizeof(cl_mem), &clBallState.ActiveCountBuf);
+    errCode |= clSetKernelArg(kernel, 11, sizeof(cl_mem), &clBallState.AsleepBuf);
+    errCode |= clSetKernelArg(kernel, 12, sizeof(cl_float), &clBallState.DeltaT);
+    errCode |= clSetKernelArg(kernel, 13, sizeof(cl_mem), &clBallState.MaxSpeedBuf);
+    errCode |= clSetKernelArg(kernel, 14, sizeof(cl_mem), &clBallState.FirstImpactBuf);
+
+    errCode |= clSetKernelArg(state.BallUpdateKernel, 9, sizeof(cl_mem), &clBallState.MaxSpeedBuf);
+    errCode |= clSetKernelArg(state.BallCollisionKernel, 19, sizeof(cl_mem), &clBallState.MaxSpeedBuf);
+    errCode |= clSetKernelArg(state.BallCollisionKernel, 20, sizeof(cl_mem), &clBallState.FirstImpactBuf);
 
+    return errCode == CL_SUCCESS;
+}
 
+// update_ball only ever raises the maximum, so it starts over every step
+bool EnqueueResetMaxSpeed(CLState& state, CLBallState& clBallState)
+{
+    static const cl_uint zero = 0;
 
+    cl_event writeEvent = nullptr;
+    if (clEnqueueWriteBuffer(state.CommandQueue, clBallState.MaxSpeedBuf, CL_FALSE, 0, sizeof(cl_uint), &zero, 0, nullptr,
+                             state.Profile ? &writeEvent : nullptr) != CL_SUCCESS)
+    {
+        return false;
+    }
 
+    ProfileCommand(state, "reset max speed", writeEvent);
+    if (writeEvent)
+    {
+        clReleaseEvent(writeEvent);
+    }
+    return true;
+}
 
+// Number of balls awake in the last step, waits for the queue
+bool ReadActiveCount(CLState& state, CLBallState& clBallState, cl_uint& activeCount)
+{
+    activeCount = clBallState.Count;
+    return !clBallState.Sleeping
+        || clEnqueueReadBuffer(state.CommandQueue, clBallState.ActiveCountBuf, CL_TRUE, 0, sizeof(cl_uint), &activeCount, 0, nullptr, nullptr) == CL_SUCCESS;
+}
 
+// Points every kernel that reads the masses and radii at the current buffers
+cl_int SetBallPropertyArgs(CLState& state, CLBallState& clBallState)
+{
+    cl_int errCode = clSetKernelArg(state.BallUpdateKernel, 0, sizeof(cl_mem), &clBallState.MassBuf);
+    errCode |= clSetKernelArg(state.BallUpdateKernel, 1, sizeof(cl_mem), &clBallState.RadiusBuf);
+    errCode |= clSetKernelArg(state.BallCollisionKernel, 0, sizeof(cl_mem), &clBallState.MassBuf);
+    errCode |= clSetKernelArg(state.BallCollisionKernel, 1, sizeof(cl_mem), &clBallState.RadiusBuf);
+    errCode |= clSetKernelArg(state.TiledStepKernel, 0, sizeof(cl_mem), &clBallState.MassBuf);
+    errCode |= clSetKernelArg(state.TiledStepKernel, 1, sizeof(cl_mem), &clBallState.RadiusBuf);
+    errCode |= clSetKernelArg(state.FirstImpactsKernel, 0, sizeof(cl_mem), &clBallState.RadiusBuf);
+    return errCode;
+}
 
+// Copies buffer into a new buffer only the device works on
+cl_mem CopyToDeviceBuffer(CLState& state, cl_mem buffer, size_t size)
+{
+    cl_mem copy = clCreateBuffer(state.CTX, CL_MEM_READ_WRITE, size, nullptr, nullptr);
+    if (copy && clEnqueueCopyBuffer(state.CommandQueue, buffer, copy, 0, 0, size, 0, nullptr, nullptr) != CL_SUCCESS)
+    {
+        clReleaseMemObject(copy);
+        return nullptr;
+    }
+    return copy;
+}
 
+// Sorts the balls along a Z-order curve every reorderEvery steps. Runs after
+// InitKernels, and after InitSleeping and InitSweptCollisions when they are on.
+bool InitReordering(CLState& state, CLBallState& clBallState, cl_uint reorderEvery)
+{
+    cl_uint count = clBallState.Count;
+    if (clBallState.ZeroCopy)
+    {
+        // Zero-copy masses and radii are the host's arrays, which have to stay
+        // in creation order, so the device sorts copies of them
+        cl_mem masses = CopyToDeviceBuffer(state, clBallState.MassBuf, count * sizeof(cl_float));
+        cl_mem radii = CopyToDeviceBuffer(state, clBallState.RadiusBuf, count * sizeof(cl_uint));
+        if (!masses || !radii)
+        {
+            std::cerr << "Failed to copy the masses and radii for reordering" << std::endl;
+            if (masses)
+            {
+                clReleaseMemObject(masses);
+            }
+            if (radii)
+            {
+                clReleaseMemObject(radii);
+            }
+            return false;
+        }
 
+        clReleaseMemObject(clBallState.MassBuf);
+        clReleaseMemObject(clBallState.RadiusBuf);
+        clBallState.MassBuf = masses;
+        clBallState.RadiusBuf = radii;
+        if (SetBallPropertyArgs(state, clBallState) != CL_SUCCESS)
+        {
+            return false;
+        }
+    }
+
+    // Set first, so Deallocate releases whatever gets created
+    clBallState.ReorderEvery = reorderEvery;
+    clBallState.StepsSinceReorder = 0;
+
+    std::vector<cl_uint> ids(count);
+    for (cl_uint i = 0; i < count; ++i)
+    {
+        ids[i] = i;
+    }
+
+    clBallState.IdBuf = clCreateBuffer(state.CTX, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, count * sizeof(cl_uint), ids.data(), nullptr);
+    clBallState.BallOrderBuf = clCreateBuffer(state.CTX, CL_MEM_READ_WRITE, count * sizeof(cl_float2), nullptr, nullptr);
+    clBallState.ReorderScratchBuf = clCreateBuffer(state.CTX, CL_MEM_READ_WRITE, count * sizeof(cl_uint), nullptr, nullptr);
+    if (!clBallState.IdBuf || !clBallState.BallOrderBuf || !clBallState.ReorderScratchBuf)
+    {
+        std::cerr << "Failed to create the reordering buffers" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Gathers values into permuted in the order of the sorted keys
+bool EnqueuePermute(CLState& state, CLBallState& clBallState, cl_kernel kernel, cl_mem values, cl_mem permuted)
+{
+    cl_int errCode = clSetKernelArg(kernel, 0, sizeof(cl_mem), &values);
+    errCode |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &permuted);
+    errCode |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &clBallState.CellKeyBuf);
+    errCode |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &clBallState.Count);
+    return errCode == CL_SUCCESS && EnqueueKernel(state, kernel, clBallState.Count);
+}
+
+// Per-ball arrays without a second buffer go through the scratch one
+bool EnqueuePermuteWords(CLState& state, CLBallState& clBallState, cl_mem values)
+{
+    if (!EnqueuePermute(state, clBallState, state.PermuteWordsKernel, values, clBallState.ReorderScratchBuf))
+    {
+        return false;
+    }
+
+    cl_event copyEvent = nullptr;
+    if (clEnqueueCopyBuffer(state.CommandQueue, clBallState.ReorderScratchBuf, values, 0, 0, clBallState.Count * sizeof(cl_uint), 0, nullptr,
+                            state.Profile ? &copyEvent : nullptr) != CL_SUCCESS)
+    {
+        return false;
+    }
+
+    ProfileCommand(state, "copy reordered", copyEvent);
+    if (copyEvent)
+    {
+        clReleaseEvent(copyEvent);
+    }
+    return true;
+}
+
+// Sorts the balls along the Z-order curve of the cells they are in. The
+// active list and first impacts are rebuilt every step, so they don't move.
+bool EnqueueReorder(CLState& state, CLBallState& clBallState)
+{
+    cl_kernel keys = state.MortonKeysKernel;
+    cl_int errCode = clSetKernelArg(keys, 0, sizeof(cl_mem), &clBallState.PositionBuf);
+    errCode |= clSetKernelArg(keys, 1, sizeof(cl_mem), &clBallState.CellKeyBuf);
+    errCode |= clSetKernelArg(keys, 2, sizeof(cl_uint), &clBallState.Count);
+    errCode |= clSetKernelArg(keys, 3, sizeof(cl_uint), &clBallState.SortSize);
+    errCode |= clSetKernelArg(keys, 4, sizeof(cl_float), &clBallState.CellSize);
+    errCode |= clSetKernelArg(keys, 5, sizeof(cl_uint), &clBallState.GridDim);
+    if (errCode != CL_SUCCESS || !EnqueueKernel(state, keys, clBallState.SortSize) || !RunKeySort(state, clBallState))
+    {
+        return false;
+    }
+
+    // The state goes into the output buffers and is swapped in, like after a step
+    if (!EnqueuePermute(state, clBallState, state.PermuteVectorsKernel, clBallState.PositionBuf, clBallState.PositionOutBuf)
+        || !EnqueuePermute(state, clBallState, state.PermuteVectorsKernel, clBallState.VelocityBuf, clBallState.VelocityOutBuf)
+        || !SwapStateBuffers(clBallState, state))
+    {
+        return false;
+    }
+
+    // A step only writes the awake balls to the output buffers, so the sleeping
+    // ones would come back from the old order after the next swap
+    if (clBallState.Sleeping)
+    {
+        size_t stateSize = clBallState.Count * sizeof(cl_float2);
+        errCode = clEnqueueCopyBuffer(state.CommandQueue, clBallState.PositionBuf, clBallState.PositionOutBuf, 0, 0, stateSize, 0, nullptr, nullptr);
+        errCode |= clEnqueueCopyBuffer(state.CommandQueue, clBallState.VelocityBuf, clBallState.VelocityOutBuf, 0, 0, stateSize, 0, nullptr, nullptr);
+        if (errCode != CL_SUCCESS)
+        {
+            return false;
+        }
+    }
+
+    std::vector<cl_mem> words = { clBallState.MassBuf, clBallState.RadiusBuf, clBallState.IdBuf };
+    if (clBallState.Sleeping)
+    {
+        words.push_back(clBallState.AsleepBuf);
+        words.push_back(clBallState.QuietStepsBuf);
+        words.push_back(clBallState.WakeBuf);
+    }
+
+    for (cl_mem buffer : words)
+    {
+        if (!EnqueuePermuteWords(state, clBallState, buffer))
+        {
+            return false;
+        }
+    }
+
+    clBallState.StepsSinceReorder = 0;
+    return true;
+}
+
+// A per-ball float2 buffer in the order the balls were created in: buffer
+// itself, or BallOrderBuf once it was scattered there when reordering is on.
+// nullptr when the scatter could not be queued.
+cl_mem EnqueueBallOrder(CLState& state, CLBallState& clBallState, cl_mem buffer)
+{
+    if (!clBallState.ReorderEvery)
+    {
+        return buffer;
+    }
+
+    cl_kernel kernel = state.ScatterByIdKernel;
+    cl_int errCode = clSetKernelArg(kernel, 0, sizeof(cl_mem), &buffer);
+    errCode |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &clBallState.IdBuf);
+    errCode |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &clBallState.BallOrderBuf);
+    errCode |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &clBallState.Count);
+    if (errCode != CL_SUCCESS || !EnqueueKernel(state, kernel, clBallState.Count))
+    {
+        return nullptr;
+    }
+
+    return clBallState.BallOrderBuf;
+}
+
+// Below this many balls, or when the grid is only a few cells wide, nearly every
+// ball is a neighbour anyway and the all-pairs tiled step beats the grid
+const unsigned int TiledStepMaxBalls = 4096;
+const cl_uint TiledStepMaxGridDim = 3;
+
+const size_t DefaultTileSize = 256;
+const size_t TileBytesPerBall = 2 * sizeof(cl_float2) + 2 * sizeof(cl_float);
+
+// Largest tile the tiled step can use, bounded by the kernel and by half the local memory
+size_t MaxTileSize(CLState& clState)
+{
+    size_t kernelMaxSize = 0;
+    cl_ulong localMemSize = 0;
+    cl_int errCode = clGetKernelWorkGroupInfo(clState.TiledStepKernel, clState.Device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernelMaxSize, nullptr);
+    errCode |= clGetDeviceInfo(clState.Device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMemSize, nullptr);
+    if (errCode != CL_SUCCESS)
+    {
+        return 1;
+    }
+
+    return std::max((size_t)1, std::min(kernelMaxSize, (size_t)(localMemSize / 2 / TileBytesPerBall)));
+}
+
+// The tile lives in local memory, so its arguments change with the work-group size
+bool SetTileSize(CLState& clState, size_t tileSize)
+{
+    clState.LocalSizes[clState.TiledStepKernel] = tileSize;
+
+    cl_int errCode = clSetKernelArg(clState.TiledStepKernel, 9, tileSize * sizeof(cl_float2), nullptr);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 10, tileSize * sizeof(cl_float2), nullptr);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 11, tileSize * sizeof(cl_float), nullptr);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 12, tileSize * sizeof(cl_float), nullptr);
+
+    return errCode == CL_SUCCESS;
+}
+
+bool SetTiledStepKernelParamsInit(CLBallState& clBallState, CLState& clState, CollisionMode mode)
+{
+    // Largest power of two tile up to the default, the tuner may pick another one
+    size_t maxTileSize = std::min(DefaultTileSize, MaxTileSize(clState));
+    size_t tileSize = 1;
+    while (tileSize * 2 <= maxTileSize)
+    {
+        tileSize *= 2;
+    }
+
+    switch (mode)
+    {
+        case CollisionMode::Grid:
+            clState.UseTiledStep = false;
+            break;
+        case CollisionMode::Tiled:
+            clState.UseTiledStep = true;
+            break;
+        case CollisionMode::Auto:
+            clState.UseTiledStep = clBallState.Count <= TiledStepMaxBalls || clBallState.GridDim <= TiledStepMaxGridDim;
+            break;
+    }
+
+    cl_int errCode = clSetKernelArg(clState.TiledStepKernel, 0, sizeof(cl_mem), &clBallState.MassBuf);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 1, sizeof(cl_mem), &clBallState.RadiusBuf);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 2, sizeof(cl_mem), &clBallState.PositionBuf);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 3, sizeof(cl_mem), &clBallState.VelocityBuf);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 4, sizeof(cl_mem), &clBallState.PositionOutBuf);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 5, sizeof(cl_mem), &clBallState.VelocityOutBuf);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 6, sizeof(cl_float), &clBallState.DeltaT);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 7, sizeof(cl_uint), &clBallState.WorldSize);
+    errCode |= clSetKernelArg(clState.TiledStepKernel, 8, sizeof(cl_uint), &clBallState.Count);
+
+    return errCode == CL_SUCCESS && SetTileSize(clState, tileSize);
+}
+
+bool EnqueueTiledStep(CLState& state, CLBallState& clBallState, cl_event* event)
+{
+    return EnqueueKernel(state, state.TiledStepKernel, clBallState.Count, event) && SwapStateBuffers(clBallState, state);
+}
+
+// Queues one full step without waiting for it. The kernel arguments are
+// captured at enqueue time, so the buffers can be swapped right away.
+bool EnqueueStep(CLState& state, CLBallState& clBallState, cl_event* event = nullptr)
+{
+    if (clBallState.ReorderEvery && ++clBallState.StepsSinceReorder >= clBallState.ReorderEvery && !EnqueueReorder(state, clBallState))
+    {
+        return false;
+    }
+
+    if (state.UseTiledStep)
+    {
+        return EnqueueTiledStep(state, clBallState, event);
+    }
+
+    return (!clBallState.Sleeping || EnqueueActiveList(state, clBallState))
+        && (!clBallState.Swept || EnqueueResetMaxSpeed(state, clBallState))
+        && EnqueueKernel(state, state.BallUpdateKernel, clBallState.Count)
+        && RunBroadphase(state, clBallState)
+        && (!clBallState.Swept || EnqueueKernel(state, state.FirstImpactsKernel, clBallState.Count))
+        && EnqueueKernel(state, state.BallCollisionKernel, clBallState.Count, event)
+        && SwapStateBuffers(clBallState, state);
+}
+
+// Queues substeps steps back to back, only the last one signals event
+bool EnqueueSteps(CLState& state, CLBallState& clBallState, unsigned int substeps, cl_event* event = nullptr)
+{
+    for (unsigned int step = 0; step < substeps; ++step)
+    {
+        if (!EnqueueStep(state, clBallState, step + 1 == substeps ? event : nullptr))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs substeps steps with a single host sync at the end
+bool RunKernels(CLState& state, CLBallState& clBallState, unsigned int substeps = 1)
+{
+    cl_event runEvent;
+    return EnqueueSteps(state, clBallState, substeps, &runEvent) && WaitAndRelease(runEvent);
+}
+
+// Copies one of the per-ball float2 buffers to the host. Zero-copy buffers
+// are mapped instead, and mapping a CL_MEM_USE_HOST_PTR buffer hands back the
+// array it wraps, so reading into that same array copies nothing.
+bool ReadBallVectors(CLState& clState, CLBallState& clBallState, cl_mem buffer, bool zeroCopy, const std::string& name, cl_float2* vectors)
+{
+    size_t size = clBallState.Count * sizeof(cl_float2);
+    if (!zeroCopy)
+    {
+        cl_event readEvent;
+        if (clEnqueueReadBuffer(clState.CommandQueue, buffer, CL_FALSE, 0, size, vectors, 0, nullptr, &readEvent) != CL_SUCCESS)
+        {
+            return false;
+        }
+
+        ProfileCommand(clState, "read " + name, readEvent);
+        return WaitAndRelease(readEvent);
+    }
+
+    cl_int errCode = CL_SUCCESS;
+    cl_event mapEvent = nullptr;
+    cl_float2* mapped = (cl_float2*)clEnqueueMapBuffer(clState.CommandQueue, buffer, CL_TRUE, CL_MAP_READ, 0, size, 0, nullptr,
+                                                       &mapEvent, &errCode);
+    if (errCode != CL_SUCCESS)
+    {
+        return false;
+    }
+
+    ProfileCommand(clState, "map " + name, mapEvent);
+    clReleaseEvent(mapEvent);
+
+    if (mapped != vectors)
+    {
+        std::copy(mapped, mapped + clBallState.Count, vectors);
+    }
+
+    cl_event unmapEvent;
+    if (clEnqueueUnmapMemObject(clState.CommandQueue, buffer, mapped, 0, nullptr, &unmapEvent) != CL_SUCCESS)
+    {
+        return false;
+    }
+
+    ProfileCommand(clState, "unmap " + name, unmapEvent);
+    return WaitAndRelease(unmapEvent);
+}
+
+// Reordered balls are read through BallOrderBuf, which is never zero-copy
+bool ReadPositions(CLState& clState, CLBallState& clBallState, cl_float2* positions)
+{
+    cl_mem buffer = EnqueueBallOrder(clState, clBallState, clBallState.PositionBuf);
+    bool zeroCopy = clBallState.ZeroCopy && !clBallState.GLShared && !clBallState.ReorderEvery;
+    return buffer && ReadBallVectors(clState, clBallState, buffer, zeroCopy, "positions", positions);
+}
+
+bool ReadVelocities(CLState& clState, CLBallState& clBallState, cl_float2* velocities)
+{
+    cl_mem buffer = EnqueueBallOrder(clState, clBallState, clBallState.VelocityBuf);
+    return buffer && ReadBallVectors(clState, clBallState, buffer, clBallState.ZeroCopy && !clBallState.ReorderEvery, "velocities", velocities);
+}
+
+bool ReadPositionBuffer(BallState& ballState, CLBallState& clBallState, CLState& clState)
+{
+    return ReadPositions(clState, clBallState, ballState.Position);
+}
+
+// Quantized position readback
+//
+// With a packed format the positions drawn each frame leave the device as
+// 16-bit fixed point, half the bytes, or as byte deltas against the frame
+// before, a quarter. The 16-bit values of the last PackedFrameSlots frames
+// stay on the device, so when a delta overflows the host can still fetch its
+// frame while the next ones are queued. Frames must be unpacked in the order
+// they were queued, at most PackedFrameSlots - 1 behind.
+
+const unsigned int PackedFrameSlots = 3;
+
+struct CLPositionPacker
+{
+    ReadbackFormat Format;
+    cl_mem QuantizedBufs[PackedFrameSlots];
+    cl_mem DeltaBuf;
+    cl_mem OverflowBuf;
+    unsigned int Frame;                 // Frames queued so far
+    std::vector<cl_ushort> Reference;   // The last unpacked frame, the base of the next deltas
+    bool HasReference;
+};
+
+// Bytes EnqueuePackedRead reads back per frame
+size_t PackedPositionsSize(CLPositionPacker& packer, unsigned int count)
+{
+    return count * (packer.Format == ReadbackFormat::Delta8 ? sizeof(cl_char2) : sizeof(cl_ushort2));
+}
+
+void ReleasePositionPacker(CLPositionPacker& packer)
+{
+    for (cl_mem buffer : packer.QuantizedBufs)
+    {
+        if (buffer)
+        {
+            clReleaseMemObject(buffer);
+        }
+    }
+
+    if (packer.DeltaBuf)
+    {
+        clReleaseMemObject(packer.DeltaBuf);
+    }
+
+    if (packer.OverflowBuf)
+    {
+        clReleaseMemObject(packer.OverflowBuf);
+    }
+
+    packer = CLPositionPacker{};
+}
+
+bool InitPositionPacker(CLPositionPacker& packer, CLState& clState, CLBallState& clBallState, ReadbackFormat format)
+{
+    packer = CLPositionPacker{};
+    packer.Format = format;
+    if (format == ReadbackFormat::Float)
+    {
+        return true;
+    }
+
+    bool allocated = true;
+    for (cl_mem& buffer : packer.QuantizedBufs)
+    {
+        buffer = clCreateBuffer(clState.CTX, CL_MEM_READ_WRITE, clBallState.Count * sizeof(cl_ushort2), nullptr, nullptr);
+        allocated = allocated && buffer;
+    }
+
+    if (format == ReadbackFormat::Delta8)
+    {
+        packer.DeltaBuf = clCreateBuffer(clState.CTX, CL_MEM_READ_WRITE, clBallState.Count * sizeof(cl_char2), nullptr, nullptr);
+        packer.OverflowBuf = clCreateBuffer(clState.CTX, CL_MEM_READ_WRITE, sizeof(cl_uint), nullptr, nullptr);
+        packer.Reference.resize(2 * clBallState.Count);
+        allocated = allocated && packer.DeltaBuf && packer.OverflowBuf;
+    }
+
+    if (!allocated)
+    {
+        std::cerr << "Failed to create the packed position buffers" << std::endl;
+        ReleasePositionPacker(packer);
+        return false;
+    }
+
+    return true;
+}
+
+// Queues packing the current positions, then non-blocking reads of them into
+// packed and, for deltas, of the overflow flag into overflow. readEvent
+// completes once both are on the host.
+bool EnqueuePackedRead(CLState& clState, CLBallState& clBallState, CLPositionPacker& packer, void* packed, cl_uint* overflow, cl_event* readEvent)
+{
+    static const cl_uint noOverflow = 0;
+
+    unsigned int slot = packer.Frame % PackedFrameSlots;
+    unsigned int previous = (packer.Frame + PackedFrameSlots - 1) % PackedFrameSlots;
+    bool delta = packer.Format == ReadbackFormat::Delta8;
+    cl_mem deltaBuf = delta ? packer.DeltaBuf : nullptr;
+    cl_float scale = PackedPositionRange / WorldSize;
+    cl_uint count = clBallState.Count;
+
+    cl_mem positions = EnqueueBallOrder(clState, clBallState, clBallState.PositionBuf);
+    if (!positions)
+    {
+        return false;
+    }
+
+    cl_int errCode = clSetKernelArg(clState.PackKernel, 0, sizeof(cl_mem), &positions);
+    errCode |= clSetKernelArg(clState.PackKernel, 1, sizeof(cl_mem), &packer.QuantizedBufs[previous]);
+    errCode |= clSetKernelArg(clState.PackKernel, 2, sizeof(cl_mem), &packer.QuantizedBufs[slot]);
+    errCode |= clSetKernelArg(clState.PackKernel, 3, sizeof(cl_mem), &deltaBuf);
+    errCode |= clSetKernelArg(clState.PackKernel, 4, sizeof(cl_mem), &packer.OverflowBuf);
+    errCode |= clSetKernelArg(clState.PackKernel, 5, sizeof(cl_float), &scale);
+    errCode |= clSetKernelArg(clState.PackKernel, 6, sizeof(cl_uint), &count);
+    if (delta)
+    {
+        errCode |= clEnqueueWriteBuffer(clState.CommandQueue, packer.OverflowBuf, CL_FALSE, 0, sizeof(cl_uint), &noOverflow, 0, nullptr, nullptr);
+    }
+
+    if (errCode != CL_SUCCESS || !EnqueueKernel(clState, clState.PackKernel, count))
+    {
+        return false;
+    }
+
+    cl_event dataEvent = nullptr;
+    if (clEnqueueReadBuffer(clState.CommandQueue, delta ? packer.DeltaBuf : packer.QuantizedBufs[slot], CL_FALSE, 0, PackedPositionsSize(packer, count),
+                            packed, 0, nullptr, delta ? (clState.Profile ? &dataEvent : nullptr) : readEvent) != CL_SUCCESS)
+    {
+        return false;
+    }
+
+    ProfileCommand(clState, "read packed positions", delta ? dataEvent : *readEvent);
+    if (dataEvent)
+    {
+        clReleaseEvent(dataEvent);
+    }
+
+    // The queue is in order, the flag arrives after the deltas
+    if (delta && clEnqueueReadBuffer(clState.CommandQueue, packer.OverflowBuf, CL_FALSE, 0, sizeof(cl_uint), overflow, 0, nullptr, readEvent) != CL_SUCCESS)
+    {
+        return false;
+    }
+
+    ++packer.Frame;
+    return true;
+}
+
+// Turns what EnqueuePackedRead read into packed for frame back into positions
+bool UnpackPositions(CLState& clState, CLBallState& clBallState, CLPositionPacker& packer, unsigned int frame, const void* packed, cl_uint overflow, cl_float2* positions)
+{
+    if (packer.Format == ReadbackFormat::Fixed16)
+    {
+        DecodeFixed16((const cl_ushort*)packed, clBallState.Count, (float)WorldSize, positions);
+        return true;
+    }
+
+    if (packer.HasReference && !overflow)
+    {
+        ApplyDeltas8(packer.Reference.data(), (const cl_char*)packed, clBallState.Count);
+    }
+    else
+    {
+        // The first frame, or a ball moved too far for a byte: fetch the whole frame
+        cl_event readEvent;
+        if (clEnqueueReadBuffer(clState.CommandQueue, packer.QuantizedBufs[frame % PackedFrameSlots], CL_FALSE, 0, clBallState.Count * sizeof(cl_ushort2),
+                                packer.Reference.data(), 0, nullptr, &readEvent) != CL_SUCCESS)
+        {
+            return false;
+        }
+
+        ProfileCommand(clState, "read position keyframe", readEvent);
+        if (!WaitAndRelease(readEvent))
+        {
+            return false;
+        }
+        packer.HasReference = true;
+    }
+
+    DecodeFixed16(packer.Reference.data(), clBallState.Count, (float)WorldSize, positions);
+    return true;
+}
+
+// View culling
+//
+// Draws of a world larger than the window only need the balls in view. The
+// device flags them, scans the flags and compacts their ids and positions
+// into a draw list. The simulation thread reads back the count and then just
+// that many entries instead of every position. With GL sharing the list is
+// compacted straight into the renderer's vertex buffers and only the count
+// comes back, see RunSharedFrame.
+
+struct CLCuller
+{
+    CLScan Scan;        // Starts from a visible flag per ball
+    cl_mem CountBuf;
+    cl_mem IdBuf;
+    cl_mem PositionBuf;
+    bool GLShared;      // IdBuf and PositionBuf are GL vertex buffers
+
+    // Set before RunSharedFrame, which leaves the length of the list it wrote
+    cl_float2 ViewMin;
+    cl_float2 ViewMax;
+    cl_uint Visible;
+};
+
+void ReleaseCuller(CLCuller& culler)
+{
+    ReleaseScan(culler.Scan);
+    cl_mem buffers[] = { culler.CountBuf, culler.IdBuf, culler.PositionBuf };
+    for (cl_mem buffer : buffers)
+    {
+        if (buffer)
+        {
+            clReleaseMemObject(buffer);
+        }
+    }
+    culler = CLCuller{};
+}
+
+// Compacts into idGLBuf and positionGLBuf when given, which need room for
+// every ball, the position buffers must be shared with GL as well
+bool InitCuller(CLCuller& culler, CLState& clState, CLBallState& clBallState, cl_GLuint idGLBuf = 0, cl_GLuint positionGLBuf = 0)
+{
+    culler = CLCuller{};
+    cl_uint count = clBallState.Count;
+    culler.CountBuf = clCreateBuffer(clState.CTX, CL_MEM_READ_WRITE, sizeof(cl_uint), nullptr, nullptr);
+    if (idGLBuf && positionGLBuf && clBallState.GLShared)
+    {
+        culler.IdBuf = clCreateFromGLBuffer(clState.CTX, CL_MEM_WRITE_ONLY, idGLBuf, nullptr);
+        culler.PositionBuf = clCreateFromGLBuffer(clState.CTX, CL_MEM_WRITE_ONLY, positionGLBuf, nullptr);
+        culler.GLShared = true;
+    }
+    else if (!idGLBuf && !positionGLBuf)
+    {
+        culler.IdBuf = clCreateBuffer(clState.CTX, CL_MEM_READ_WRITE, count * sizeof(cl_uint), nullptr, nullptr);
+        culler.PositionBuf = clCreateBuffer(clState.CTX, CL_MEM_READ_WRITE, count * sizeof(cl_float2), nullptr, nullptr);
+    }
+    bool allocated = culler.CountBuf && culler.IdBuf && culler.PositionBuf;
+    allocated = InitScan(clState, culler.Scan, count) && allocated;
+
+    if (!allocated)
+    {
+        std::cerr << "Failed to create the view culling buffers" << std::endl;
+        ReleaseCuller(culler);
+        return false;
+    }
+
+    cl_int errCode = clSetKernelArg(clState.CullKernel, 1, sizeof(cl_mem), &culler.Scan.Bufs[0]);
+    errCode |= clSetKernelArg(clState.CullKernel, 4, sizeof(cl_uint), &count);
+    errCode |= clSetKernelArg(clState.CompactVisibleKernel, 1, sizeof(cl_mem), &culler.Scan.Bufs[0]);
+    errCode |= clSetKernelArg(clState.CompactVisibleKernel, 4, sizeof(cl_mem), &culler.IdBuf);
+    errCode |= clSetKernelArg(clState.CompactVisibleKernel, 5, sizeof(cl_mem), &culler.PositionBuf);
+    errCode |= clSetKernelArg(clState.CompactVisibleKernel, 6, sizeof(cl_uint), &count);
+    return errCode == CL_SUCCESS;
+}
+
+// Enqueues the compaction of the balls whose centre lies in [viewMin, viewMax]
+// into the draw list, by increasing id. Grow the view by the largest radius
+// to keep the balls that only overlap it.
+bool EnqueueCull(CLState& clState, CLBallState& clBallState, CLCuller& culler, cl_float2 viewMin, cl_float2 viewMax)
+{
+    cl_mem source = EnqueueBallOrder(clState, clBallState, clBallState.PositionBuf);
+    if (!source)
+    {
+        return false;
+    }
+
+    cl_int errCode = clSetKernelArg(clState.CullKernel, 0, sizeof(cl_mem), &source);
+    errCode |= clSetKernelArg(clState.CullKernel, 2, sizeof(cl_float2), &viewMin);
+    errCode |= clSetKernelArg(clState.CullKernel, 3, sizeof(cl_float2), &viewMax);
+    errCode |= clSetKernelArg(clState.CompactVisibleKernel, 0, sizeof(cl_mem), &source);
+    errCode |= clSetKernelArg(clState.CompactVisibleKernel, 2, sizeof(cl_float2), &viewMin);
+    errCode |= clSetKernelArg(clState.CompactVisibleKernel, 3, sizeof(cl_float2), &viewMax);
+    return errCode == CL_SUCCESS
+        && EnqueueKernel(clState, clState.CullKernel, clBallState.Count)
+        && EnqueueScan(clState, culler.Scan, culler.CountBuf)
+        && EnqueueKernel(clState, clState.CompactVisibleKernel, clBallState.Count);
+}
+
+// Waits for the queue and reads the length of the last compacted list
+bool ReadVisibleCount(CLState& clState, CLCuller& culler, cl_uint& visible)
+{
+    cl_event readEvent;
+    if (clEnqueueReadBuffer(clState.CommandQueue, culler.CountBuf, CL_FALSE, 0, sizeof(cl_uint), &visible, 0, nullptr, &readEvent) != CL_SUCCESS)
+    {
+        return false;
+    }
+    ProfileCommand(clState, "read visible count", readEvent);
+    return WaitAndRelease(readEvent);
+}
+
+// Compacts the balls in [viewMin, viewMax] and reads back their ids, in
+// increasing order, and positions. Waits for the queue.
+bool CullPositions(CLState& clState, CLBallState& clBallState, CLCuller& culler, cl_float2 viewMin, cl_float2 viewMax,
+                   std::vector<cl_uint>& ids, std::vector<cl_float2>& positions)
+{
+    cl_uint visible = 0;
+    if (!EnqueueCull(clState, clBallState, culler, viewMin, viewMax) || !ReadVisibleCount(clState, culler, visible))
+    {
+        return false;
+    }
+
+    ids.resize(visible);
+    positions.resize(visible);
+    if (visible == 0)
+    {
+        return true;
+    }
+
+    cl_event idEvent;
+    if (clEnqueueReadBuffer(clState.CommandQueue, culler.IdBuf, CL_FALSE, 0, visible * sizeof(cl_uint), ids.data(), 0, nullptr, &idEvent) != CL_SUCCESS)
+    {
+        return false;
+    }
+    ProfileCommand(clState, "read visible ids", idEvent);
+    clReleaseEvent(idEvent);
+
+    // The in-order queue finishes the id read before this one
+    cl_event readEvent;
+    if (clEnqueueReadBuffer(clState.CommandQueue, culler.PositionBuf, CL_FALSE, 0, visible * sizeof(cl_float2), positions.data(), 0, nullptr, &readEvent) != CL_SUCCESS)
+    {
+        return false;
+    }
+    ProfileCommand(clState, "read visible positions", readEvent);
+    return WaitAndRelease(readEvent);
+}
+
+// Double-buffered frame pipeline
+//
+// Each frame queues its deltaT write, its step and a non-blocking readback
+// into one of two host position buffers, then flushes and returns. While the
+// device works on frame N the host draws frame N - 1 from the other buffer,
+// so a frame costs max(compute, render) instead of their sum. The host
+// buffers are pinned so the readback is a straight DMA on discrete GPUs.
+
+const unsigned int FramePipelineDepth = 2;
+
+struct CLFramePipeline
+{
+    cl_mem PinnedBufs[FramePipelineDepth]; // nullptr when Positions is a plain allocation
+    cl_float2* Positions[FramePipelineDepth];
+    cl_event ReadEvents[FramePipelineDepth];
+    unsigned int Frame; // Number of frames enqueued so far
+
+    // Set to read packed positions into Positions, unpacked into Unpacked
+    CLPositionPacker* Packer;
+    cl_uint Overflow[FramePipelineDepth];
+    std::vector<cl_float2> Unpacked;
+};
+
+void InitFramePipeline(CLFramePipeline& pipeline, CLState& clState, CLBallState& clBallState, CLPositionPacker* packer = nullptr)
+{
+    pipeline = CLFramePipeline{};
+    if (packer)
+    {
+        pipeline.Packer = packer;
+        pipeline.Unpacked.resize(clBallState.Count);
+    }
+
+    size_t size = clBallState.Count * sizeof(cl_float2);
+    for (unsigned int slot = 0; slot < FramePipelineDepth; ++slot)
+    {
+        // Mapped once and kept mapped, reads from the other buffers land in it
+        cl_int errCode = CL_SUCCESS;
+        pipeline.PinnedBufs[slot] = clCreateBuffer(clState.CTX, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, nullptr, &errCode);
+        if (errCode == CL_SUCCESS)
+        {
+            pipeline.Positions[slot] = (cl_float2*)clEnqueueMapBuffer(clState.CommandQueue, pipeline.PinnedBufs[slot], CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+                                                                      0, size, 0, nullptr, nullptr, &errCode);
+        }
+
+        if (errCode != CL_SUCCESS || !pipeline.Positions[slot])
+        {
+            if (pipeline.PinnedBufs[slot])
+            {
+                clReleaseMemObject(pipeline.PinnedBufs[slot]);
+                pipeline.PinnedBufs[slot] = nullptr;
+            }
+            pipeline.Positions[slot] = new cl_float2[clBallState.Count];
+        }
+    }
+}
+
+// deltaT is the length of one substep
+bool EnqueueFrame(CLState& clState, CLBallState& clBallState, CLFramePipeline& pipeline, float deltaT, unsigned int substeps = 1)
+{
+    unsigned int slot = pipeline.Frame % FramePipelineDepth;
+    if (!SetTimeStepArgs(clState, clBallState, deltaT) || !EnqueueSteps(clState, clBallState, substeps))
+    {
+        return false;
+    }
+
+    if (pipeline.Packer)
+    {
+        if (!EnqueuePackedRead(clState, clBallState, *pipeline.Packer, pipeline.Positions[slot], &pipeline.Overflow[slot], &pipeline.ReadEvents[slot]))
+        {
+            pipeline.ReadEvents[slot] = nullptr;
+            return false;
+        }
+    }
+    else
+    {
+        cl_mem positions = EnqueueBallOrder(clState, clBallState, clBallState.PositionBuf);
+        if (!positions || clEnqueueReadBuffer(clState.CommandQueue, positions, CL_FALSE, 0, clBallState.Count * sizeof(cl_float2),
+                                              pipeline.Positions[slot], 0, nullptr, &pipeline.ReadEvents[slot]) != CL_SUCCESS)
+        {
+            pipeline.ReadEvents[slot] = nullptr;
+            return false;
+        }
+
+        ProfileCommand(clState, "read positions", pipeline.ReadEvents[slot]);
+    }
+
+    ++pipeline.Frame;
+    return clFlush(clState.CommandQueue) == CL_SUCCESS;
+}
+
+// Blocks until the positions of an already enqueued frame are on the host.
+// Frames have to be waited for in order when they are packed.
+cl_float2* WaitForFrame(CLState& clState, CLBallState& clBallState, CLFramePipeline& pipeline, unsigned int frame)
+{
+    unsigned int slot = frame % FramePipelineDepth;
+    cl_event readEvent = pipeline.ReadEvents[slot];
+    pipeline.ReadEvents[slot] = nullptr;
+
+    if (readEvent == nullptr || !WaitAndRelease(readEvent))
+    {
+        return nullptr;
+    }
+
+    if (pipeline.Packer)
+    {
+        bool unpacked = UnpackPositions(clState, clBallState, *pipeline.Packer, frame, pipeline.Positions[slot], pipeline.Overflow[slot], pipeline.Unpacked.data());
+        return unpacked ? pipeline.Unpacked.data() : nullptr;
+    }
+
+    return pipeline.Positions[slot];
+}
+
+void ReleaseFramePipeline(CLState& clState, CLFramePipeline& pipeline)
+{
+    for (unsigned int slot = 0; slot < FramePipelineDepth; ++slot)
+    {
+        if (pipeline.ReadEvents[slot])
+        {
+            WaitAndRelease(pipeline.ReadEvents[slot]);
+        }
+
+        if (pipeline.PinnedBufs[slot])
+        {
+            clEnqueueUnmapMemObject(clState.CommandQueue, pipeline.PinnedBufs[slot], pipeline.Positions[slot], 0, nullptr, nullptr);
+            clFinish(clState.CommandQueue);
+            clReleaseMemObject(pipeline.PinnedBufs[slot]);
+        }
+        else
+        {
+            delete [] pipeline.Positions[slot];
+        }
+    }
+    pipeline = CLFramePipeline{};
+}
+
+// Runs a frame straight on the shared GL position buffers. Without
+// cl_khr_gl_event the only portable sync is glFinish before the acquire and
+// waiting for the release, after which PositionGLBuf holds the new positions.
+// A shared culler also compacts the balls in its view into the GL draw list.
+bool RunSharedFrame(CLState& clState, CLBallState& clBallState, float deltaT, unsigned int substeps = 1, CLCuller* culler = nullptr)
+{
+    glFinish();
+
+    bool culling = culler && culler->GLShared;
+    cl_mem sharedBuffers[] = { clBallState.PositionBuf, clBallState.PositionOutBuf, culling ? culler->IdBuf : nullptr, culling ? culler->PositionBuf : nullptr };
+    cl_uint sharedCount = culling ? 4 : 2;
+    cl_event acquireEvent = nullptr;
+    if (clEnqueueAcquireGLObjects(clState.CommandQueue, sharedCount, sharedBuffers, 0, nullptr, &acquireEvent) != CL_SUCCESS)
+    {
+        return false;
+    }
+
+    ProfileCommand(clState, "acquire GL buffers", acquireEvent);
+    clReleaseEvent(acquireEvent);
+
+    if (!SetTimeStepArgs(clState, clBallState, deltaT) || !EnqueueSteps(clState, clBallState, substeps))
+    {
+        return false;
+    }
+
+    if (culling && !EnqueueCull(clState, clBallState, *culler, culler->ViewMin, culler->ViewMax))
+    {
+        return false;
+    }
+
+    cl_event releaseEvent;
+    if (clEnqueueReleaseGLObjects(clState.CommandQueue, sharedCount, sharedBuffers, 0, nullptr, &releaseEvent) != CL_SUCCESS)
+    {
+        return false;
+    }
+
+    ProfileCommand(clState, "release GL buffers", releaseEvent);
+    if (!culling)
+    {
+        return WaitAndRelease(releaseEvent);
+    }
+
+    // The in-order queue finishes the release before the count read
+    clReleaseEvent(releaseEvent);
+    return ReadVisibleCount(clState, *culler, culler->Visible);
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Backend.hpp"
+#include "BallUtils.hpp"
+#include "MappedFile.hpp"
+
+// Checkpoints
+//
+// A checkpoint is one header page followed by the ball arena exactly as
+// arena_layout lays it out. Restoring maps the file copy on write and points
+// the BallState arrays into the mapping, so nothing is parsed or copied: the
+// pages load on first touch, zero-copy devices wrap them and other devices
+// upload straight from them when their buffers are created. The output arrays
+// only ever hold kernel results and stay holes in the file.
+//
+// Everything else in CLBallState (count, grid, sort size) follows from the
+// balls, WorldSize and gravity, which the header holds, so InitOpenCL sets it
+// up as for a new scene.
+
+const char CheckpointMagic[8] = { 'B', 'A', 'L', 'L', 'C', 'K', 'P', 'T' };
+const uint32_t CheckpointVersion = 1;
+const uint32_t CheckpointByteOrder = 0x01020304;
+
+struct CheckpointHeader
+{
+    char Magic[8];
+    uint32_t Version;
+    uint32_t ByteOrder;     // Files are in native byte order
+    uint64_t ArenaOffset;   // One header page
+    uint64_t ArenaBytes;
+    uint32_t BallCount;
+    uint32_t WorldSize;
+    float Gravity;
+    float TimeStep;
+    uint64_t Seed;
+    uint64_t Frame;         // Frames simulated since the scene was created
+
+    // Where the arrays start in the arena, they have to match arena_layout
+    uint64_t MassOffset;
+    uint64_t RadiusOffset;
+    uint64_t PositionOffset;
+    uint64_t VelocityOffset;
+    uint64_t ColorOffset;
+};
+
+bool write_at(FILE* file, uint64_t offset, const void* data, size_t bytes)
+{
+#if defined(_WIN32)
+    if (_fseeki64(file, (__int64)offset, SEEK_SET) != 0)
+#else
+    if (fseeko(file, (off_t)offset, SEEK_SET) != 0)
+#endif
+    {
+        return false;
+    }
+    return fwrite(data, 1, bytes, file) == bytes;
+}
+
+// Saves the balls with the positions and velocities the backend holds now
+bool write_checkpoint(const std::string& fileName, BallState& balls, SimBackend& backend, float timeStep, uint64_t seed, uint64_t frame)
+{
+    size_t count = balls.Count;
+    std::vector<cl_float2> positions(count);
+    std::vector<cl_float2> velocities(count);
+    if (!backend.ReadPositions(positions.data()) || !backend.ReadVelocities(velocities.data()))
+    {
+        std::cerr << "Failed to read the state to checkpoint!" << std::endl;
+        return false;
+    }
+
+    ArenaLayout layout = arena_layout(balls.Count);
+    CheckpointHeader header{};
+    std::memcpy(header.Magic, CheckpointMagic, sizeof(CheckpointMagic));
+    header.Version = CheckpointVersion;
+    header.ByteOrder = CheckpointByteOrder;
+    header.ArenaOffset = ArenaAlignment;
+    header.ArenaBytes = layout.Size;
+    header.BallCount = balls.Count;
+    header.WorldSize = WorldSize;
+    header.Gravity = gravity;
+    header.TimeStep = timeStep;
+    header.Seed = seed;
+    header.Frame = frame;
+    header.MassOffset = layout.Mass;
+    header.RadiusOffset = layout.Radius;
+    header.PositionOffset = layout.Position;
+    header.VelocityOffset = layout.Velocity;
+    header.ColorOffset = layout.Color;
+
+    // Written next to the target and renamed, a crash never leaves half a checkpoint
+    std::string tempPath = fileName + ".tmp";
+    FILE* file = fopen(tempPath.c_str(), "wb");
+    if (!file)
+    {
+        std::cerr << "Could not open " << tempPath << " for the checkpoint" << std::endl;
+        return false;
+    }
+
+    uint64_t arena = header.ArenaOffset;
+    char end = 0;
+    bool success = write_at(file, 0, &header, sizeof(header))
+        && write_at(file, arena + layout.Mass, balls.Mass, count * sizeof(cl_float))
+        && write_at(file, arena + layout.Radius, balls.Radius, count * sizeof(cl_uint))
+        && write_at(file, arena + layout.Position, positions.data(), count * sizeof(cl_float2))
+        && write_at(file, arena + layout.Velocity, velocities.data(), count * sizeof(cl_float2))
+        && write_at(file, arena + layout.Color, balls.Color, count * sizeof(glm::vec3))
+        // Pads the file to the end of the arena, so the mapping covers all of it
+        && write_at(file, arena + layout.Size - 1, &end, 1);
+    success = fclose(file) == 0 && success;
+
+    if (!success || !ReplaceFile(tempPath, fileName))
+    {
+        std::remove(tempPath.c_str());
+        std::cerr << "Writing the checkpoint " << fileName << " failed!" << std::endl;
+        return false;
+    }
+
+    std::cout << "Checkpoint of " << count << " balls at frame " << frame << " saved to " << fileName << std::endl;
+    return true;
+}
+
+// Maps the checkpoint as the arena of balls and restores WorldSize and gravity
+bool restore_balls(const std::string& fileName, BallState& balls, CheckpointHeader& header)
+{
+    MappedFile file;
+    if (!MapFile(file, fileName, true))
+    {
+        std::cerr << "Could not map the checkpoint " << fileName << std::endl;
+        return false;
+    }
+
+    if (file.Size < sizeof(CheckpointHeader))
+    {
+        std::cerr << fileName << " is not a checkpoint" << std::endl;
+        UnmapFile(file);
+        return false;
+    }
+
+    header = *(const CheckpointHeader*)file.Data;
+    ArenaLayout layout = arena_layout(header.BallCount);
+    if (std::memcmp(header.Magic, CheckpointMagic, sizeof(CheckpointMagic)) != 0
+        || header.Version != CheckpointVersion
+        || header.ByteOrder != CheckpointByteOrder)
+    {
+        std::cerr << fileName << " is not a checkpoint of this version or byte order" << std::endl;
+        UnmapFile(file);
+        return false;
+    }
+
+    if (header.BallCount == 0 || header.BallCount > (uint32_t)MaxHeadlessBalls
+        || header.ArenaOffset != ArenaAlignment || header.ArenaBytes != layout.Size
+        || header.MassOffset != layout.Mass || header.RadiusOffset != layout.Radius
+        || header.PositionOffset != layout.Position || header.VelocityOffset != layout.Velocity
+        || header.ColorOffset != layout.Color
+        || file.Size < header.ArenaOffset + header.ArenaBytes)
+    {
+        std::cerr << "The layout of " << fileName << " does not match, the checkpoint is damaged" << std::endl;
+        UnmapFile(file);
+        return false;
+    }
+
+    balls = BallState{};
+    assign_arena(balls, file.Data + header.ArenaOffset, header.BallCount);
+    balls.ArenaFile = file;
+
+    WorldSize = header.WorldSize;
+    gravity = header.Gravity;
+
+    std::cout << "Restored " << balls.Count << " balls in a " << WorldSize << "x" << WorldSize << " world from " << fileName
+              << " at frame " << header.Frame << " (seed " << header.Seed << ")." << std::endl;
+    return true;
+}
@@ -1,73 +1,518 @@
 #pragma once
 
-#define _USE_MATH_DEFINES
+#include <algorithm>
 #include <cmath>
+#include <iostream>
+#include <vector>
 
+// GLEW has to come before anything that pulls in the GL headers
+#include "GL/glew.h"
 #include "GLFW/glfw3.h"
 #include "glm/glm.hpp"
 
 
 const unsigned int WinSize = 1000;
-const double pi = 3.1415926535897;
 
 float LinearInterpolation(float destMin, float destMax, float srcMin, float srcMax, float srcVal);
 glm::vec2 PixelToGLPos(glm::vec2 pixelPos);
 
-void DrawGradientSquare(glm::vec2 position)
+float LinearInterpolation(float destMin, float destMax, float srcMin, float srcMax, float srcVal)
 {
-    glPushMatrix();
+    return ((destMax - destMin)/(srcMax - srcMin)) * (srcVal - srcMin) + destMin;
+}
+
+glm::vec2 PixelToGLPos(glm::vec2 pixelPos)
+{
+    float glX = LinearInterpolation(-1.0f, 1.0f, 0, WinSize, pixelPos.x);
+    float glY = LinearInterpolation(1.0f, -1.0f, 0, WinSize, pixelPos.y);
+    return glm::vec2{glX, glY};
+}
 
-    glm::vec2 glPos = PixelToGLPos(position);
+// Pan and zoom over a world larger than the window. Zoom is in window pixels
+// per world unit. Scrolling zooms about the cursor and dragging with the left
+// button pans, see AttachCamera.
+struct Camera
+{
+    glm::vec2 Centre;
+    float Zoom;
+    float MinZoom;      // Shows the whole world
+    bool Dragging;
+    glm::dvec2 LastCursor;
+};
 
-    glTranslatef(glPos.x, glPos.y, -0.001f);
+// The square of the world a camera shows
+struct ViewRect
+{
+    glm::vec2 Min;
+    float Size;
+};
 
-    glBegin(GL_QUADS);					// Start Drawing Quads
-    glColor3f(1.0f,0.0f,0.0f);
-    glVertex3f(-0.25f, 0.25f, 0.0f);
-    glColor3f(0.0f,1.0f,0.0f);
-    glVertex3f( 0.25f, 0.25f, 0.0f);
-    glColor3f(0.0f,0.0f,1.0f);
-    glVertex3f( 0.25f,-0.25f, 0.0f);
-    glColor3f(1.0f,1.0f,1.0f);
-    glVertex3f(-0.25f,-0.25f, 0.0f);
-    glEnd();
+const float CameraZoomStep = 1.2f;  // Per scroll notch
+const float MaxCameraZoom = 8.0f;
 
-    glPopMatrix();
+void InitCamera(Camera& camera, float worldSize)
+{
+    camera = Camera{};
+    camera.Centre = glm::vec2{worldSize / 2};
+    camera.Zoom = WinSize / worldSize;
+    camera.MinZoom = camera.Zoom;
 }
 
-void DrawCircle(glm::vec2 position, glm::vec3 color, unsigned int radius)
+ViewRect CameraView(const Camera& camera)
 {
-    const unsigned int numSegments = 100;
+    float size = WinSize / camera.Zoom;
+    return ViewRect{ camera.Centre - size / 2, size };
+}
 
-    glPushMatrix();
+// World position under a cursor position in window pixels
+glm::vec2 CursorToWorld(const Camera& camera, glm::dvec2 cursor)
+{
+    return CameraView(camera).Min + glm::vec2{cursor} / camera.Zoom;
+}
 
-    glm::vec2 glPos = PixelToGLPos(position);
-    glTranslatef(glPos.x, glPos.y, 0.0f);
+void CameraScrollCallback(GLFWwindow* window, double xOffset, double yOffset)
+{
+    Camera& camera = *(Camera*)glfwGetWindowUserPointer(window);
+    glm::dvec2 cursor;
+    glfwGetCursorPos(window, &cursor.x, &cursor.y);
 
-    float glRadius = LinearInterpolation(0, 1, 0, (float)WinSize / 2, (float)radius);
+    // Keep the world position under the cursor where it is
+    glm::vec2 anchor = CursorToWorld(camera, cursor);
+    float zoom = camera.Zoom * std::pow(CameraZoomStep, (float)yOffset);
+    camera.Zoom = std::min(MaxCameraZoom, std::max(camera.MinZoom, zoom));
+    camera.Centre += anchor - CursorToWorld(camera, cursor);
+}
 
-    glBegin(GL_TRIANGLE_FAN);
-    glColor4f(color.x, color.y, color.z, 0.5f);
+void CameraButtonCallback(GLFWwindow* window, int button, int action, int mods)
+{
+    Camera& camera = *(Camera*)glfwGetWindowUserPointer(window);
+    if (button == GLFW_MOUSE_BUTTON_LEFT)
+    {
+        camera.Dragging = action == GLFW_PRESS;
+        glfwGetCursorPos(window, &camera.LastCursor.x, &camera.LastCursor.y);
+    }
+}
 
-    glVertex3f(0.0, 0.0f, 0.0f);       // Center of circle
-    float angle;
-    for (int i = 0; i <= numSegments; i++) { // Last vertex same as first vertex
-        angle = (float)i * 2.0f * (float)pi / numSegments;  // 360 deg for all segments
-        glVertex3f(cos(angle) * glRadius, sin(angle) * glRadius, 0.0f);
+void CameraCursorCallback(GLFWwindow* window, double x, double y)
+{
+    Camera& camera = *(Camera*)glfwGetWindowUserPointer(window);
+    if (camera.Dragging)
+    {
+        glm::dvec2 cursor{x, y};
+        camera.Centre -= glm::vec2{cursor - camera.LastCursor} / camera.Zoom;
+        camera.LastCursor = cursor;
     }
-    glEnd();
+}
 
-    glPopMatrix();
+// Lets the window's mouse move camera, which has to outlive the window's event polling
+void AttachCamera(GLFWwindow* window, Camera& camera)
+{
+    glfwSetWindowUserPointer(window, &camera);
+    glfwSetScrollCallback(window, CameraScrollCallback);
+    glfwSetMouseButtonCallback(window, CameraButtonCallback);
+    glfwSetCursorPosCallback(window, CameraCursorCallback);
 }
 
-float LinearInterpolation(float destMin, float destMax, float srcMin, float srcMax, float srcVal)
+GLuint CompileShader(GLenum type, const char* source)
 {
-    return ((destMax - destMin)/(srcMax - srcMin)) * (srcVal - srcMin) + destMin;
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
+
+    GLint status = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        char log[4096];
+        glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+        std::cerr << "[ERROR][GL]: Failed to compile shader:" << std::endl << log << std::endl;
+        glDeleteShader(shader);
+        return 0;
+    }
+
+    return shader;
 }
 
-glm::vec2 PixelToGLPos(glm::vec2 pixelPos)
+// attributes are bound to their index in the array before linking
+GLuint CreateShaderProgram(const char* vertexSource, const char* fragmentSource, const char** attributes, GLuint attributeCount)
 {
-    float glX = LinearInterpolation(-1.0f, 1.0f, 0, WinSize, pixelPos.x);
-    float glY = LinearInterpolation(1.0f, -1.0f, 0, WinSize, pixelPos.y);
-    return glm::vec2{glX, glY};
+    GLuint vertexShader = CompileShader(GL_VERTEX_SHADER, vertexSource);
+    GLuint fragmentShader = CompileShader(GL_FRAGMENT_SHADER, fragmentSource);
+    if (!vertexShader || !fragmentShader)
+    {
+        glDeleteShader(vertexShader);
+        glDeleteShader(fragmentShader);
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertexShader);
+    glAttachShader(program, fragmentShader);
+    for (GLuint i = 0; i < attributeCount; ++i)
+    {
+        glBindAttribLocation(program, i, attributes[i]);
+    }
+    glLinkProgram(program);
+
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        char log[4096];
+        glGetProgramInfoLog(program, sizeof(log), nullptr, log);
+        std::cerr << "[ERROR][GL]: Failed to link shader program:" << std::endl << log << std::endl;
+        glDeleteProgram(program);
+        return 0;
+    }
+
+    return program;
+}
+
+GLuint CreateVertexBuffer(const void* data, size_t size, GLenum usage)
+{
+    GLuint buffer = 0;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER, size, data, usage);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return buffer;
+}
+
+// Buffer texture over a new static buffer, for per-ball data a shader
+// fetches by ball id
+GLuint CreateBufferTexture(GLuint& buffer, const void* data, size_t size, GLenum format)
+{
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+    glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STATIC_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_BUFFER, texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    return texture;
+}
+
+// Draws every ball with a single instanced call. Each instance is a quad
+// around the ball and the fragment shader cuts the circle out of it with a
+// distance field, so cost doesn't depend on a vertex count per ball. Positions
+// come from a vertex buffer that OpenCL can write to directly when shared.
+// Balls are drawn in between their positions from two buffers, blend 0 is the
+// previous step and 1 the current one.
+//
+// Radii and colours never change, they sit in buffer textures the vertex
+// shader fetches by ball id. That is the instance index for a full draw and
+// the entry of IdVBO for a culled draw list, which only holds some of the
+// balls in any order. OpenCL can compact a list straight into IdVBO and
+// ListPositionVBO when it shares them, see InitCuller.
+struct BallRenderer
+{
+    GLuint Program;
+    GLuint CornerVBO;
+    GLuint RadiusBuffer;
+    GLuint RadiusTexture;
+    GLuint ColorBuffer;
+    GLuint ColorTexture;
+    GLint ViewMinLocation;
+    GLint ViewSizeLocation;
+    GLint BlendLocation;
+    GLint UseIdsLocation;
+
+    GLuint IdVBO;
+    GLuint ListPositionVBO;
+};
+
+const char* BallVertexShader = R"(
+#version 330
+in vec2 corner;
+in vec2 position;
+in vec2 previousPosition;
+in uint ballId;
+
+uniform vec2 viewMin;
+uniform float viewSize;
+uniform float blend;
+uniform bool useIds;
+uniform usamplerBuffer radii;
+uniform samplerBuffer colors;
+
+out vec2 fromCentre;
+out vec3 ballColor;
+
+void main()
+{
+    int id = useIds ? int(ballId) : gl_InstanceID;
+    float radius = float(texelFetch(radii, id).r);
+    vec2 centre = mix(previousPosition, position, blend);
+    vec2 glPos = (centre + corner * radius - viewMin) / viewSize * 2.0 - 1.0;
+    gl_Position = vec4(glPos.x, -glPos.y, 0.0, 1.0);
+    fromCentre = corner;
+    ballColor = texelFetch(colors, id).rgb;
+}
+)";
+
+const char* BallFragmentShader = R"(
+#version 330
+in vec2 fromCentre;
+in vec3 ballColor;
+
+out vec4 fragColor;
+
+void main()
+{
+    float dist = length(fromCentre);
+    float edge = fwidth(dist);
+    float coverage = 1.0 - smoothstep(1.0 - edge, 1.0, dist);
+    if (coverage <= 0.0)
+    {
+        discard;
+    }
+    fragColor = vec4(ballColor, 0.5 * coverage);
+}
+)";
+
+bool CreateBallRenderer(BallRenderer& renderer, const unsigned int* radii, const glm::vec3* colors, int count)
+{
+    if (!GLEW_VERSION_3_3)
+    {
+        std::cerr << "[ERROR][GL]: Instanced ball rendering needs OpenGL 3.3" << std::endl;
+        return false;
+    }
+
+    GLint maxTexels = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+    if (count > maxTexels)
+    {
+        std::cerr << "[ERROR][GL]: " << count << " balls are more than the " << maxTexels << " a buffer texture holds here" << std::endl;
+        return false;
+    }
+
+    const char* attributes[] = { "corner", "position", "previousPosition", "ballId" };
+    renderer.Program = CreateShaderProgram(BallVertexShader, BallFragmentShader, attributes, 4);
+    if (!renderer.Program)
+    {
+        return false;
+    }
+
+    renderer.ViewMinLocation = glGetUniformLocation(renderer.Program, "viewMin");
+    renderer.ViewSizeLocation = glGetUniformLocation(renderer.Program, "viewSize");
+    renderer.BlendLocation = glGetUniformLocation(renderer.Program, "blend");
+    renderer.UseIdsLocation = glGetUniformLocation(renderer.Program, "useIds");
+
+    // Texture units of the two lookups
+    glUseProgram(renderer.Program);
+    glUniform1i(glGetUniformLocation(renderer.Program, "radii"), 0);
+    glUniform1i(glGetUniformLocation(renderer.Program, "colors"), 1);
+    glUseProgram(0);
+
+    const float corners[] = { -1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f };
+    renderer.CornerVBO = CreateVertexBuffer(corners, sizeof(corners), GL_STATIC_DRAW);
+
+    // Three component buffer textures need GL 4.0, so colours get a padding alpha
+    std::vector<glm::vec4> colorData(count);
+    for (int i = 0; i < count; ++i)
+    {
+        colorData[i] = glm::vec4(colors[i], 1.0f);
+    }
+    renderer.RadiusTexture = CreateBufferTexture(renderer.RadiusBuffer, radii, count * sizeof(unsigned int), GL_R32UI);
+    renderer.ColorTexture = CreateBufferTexture(renderer.ColorBuffer, colorData.data(), count * sizeof(glm::vec4), GL_RGBA32F);
+
+    renderer.IdVBO = CreateVertexBuffer(nullptr, count * sizeof(unsigned int), GL_DYNAMIC_DRAW);
+    renderer.ListPositionVBO = CreateVertexBuffer(nullptr, count * sizeof(glm::vec2), GL_DYNAMIC_DRAW);
+
+    return true;
+}
+
+void BindVertexAttribute(GLuint index, GLuint buffer, GLint size, GLuint divisor)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glEnableVertexAttribArray(index);
+    glVertexAttribPointer(index, size, GL_FLOAT, GL_FALSE, 0, nullptr);
+    glVertexAttribDivisor(index, divisor);
+}
+
+void UnbindVertexAttribute(GLuint index)
+{
+    glVertexAttribDivisor(index, 0);
+    glDisableVertexAttribArray(index);
+}
+
+// Replaces the contents of a vertex buffer, used when positions are read back from OpenCL
+void UploadVertexBuffer(GLuint buffer, const void* data, size_t size)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, size, data);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Copies the ids of a draw list read back on the host into IdVBO
+void UploadDrawList(BallRenderer& renderer, const unsigned int* ids, size_t count)
+{
+    UploadVertexBuffer(renderer.IdVBO, ids, count * sizeof(unsigned int));
+}
+
+// idVBO 0 draws the first count balls by instance index
+void DrawBallInstances(BallRenderer& renderer, GLuint previousVBO, GLuint positionVBO, GLuint idVBO, float blend, int count, ViewRect view)
+{
+    glUseProgram(renderer.Program);
+    glUniform2f(renderer.ViewMinLocation, view.Min.x, view.Min.y);
+    glUniform1f(renderer.ViewSizeLocation, view.Size);
+    glUniform1f(renderer.BlendLocation, blend);
+    glUniform1i(renderer.UseIdsLocation, idVBO != 0);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_BUFFER, renderer.RadiusTexture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_BUFFER, renderer.ColorTexture);
+
+    BindVertexAttribute(0, renderer.CornerVBO, 2, 0);
+    BindVertexAttribute(1, positionVBO, 2, 1);
+    BindVertexAttribute(2, previousVBO, 2, 1);
+    GLuint attributeCount = 3;
+    if (idVBO)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, idVBO);
+        glEnableVertexAttribArray(3);
+        glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, 0, nullptr);
+        glVertexAttribDivisor(3, 1);
+        attributeCount = 4;
+    }
+
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+
+    for (GLuint i = 0; i < attributeCount; ++i)
+    {
+        UnbindVertexAttribute(i);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glUseProgram(0);
+}
+
+// Pass positionVBO as previousVBO with a blend of 1 to draw one set of positions
+void DrawBalls(BallRenderer& renderer, GLuint previousVBO, GLuint positionVBO, float blend, int count, ViewRect view)
+{
+    DrawBallInstances(renderer, previousVBO, positionVBO, 0, blend, count, view);
+}
+
+// Same for the first count balls of the draw list in IdVBO, whose positions
+// are in the same order in the position buffers
+void DrawBallList(BallRenderer& renderer, GLuint previousVBO, GLuint positionVBO, float blend, int count, ViewRect view)
+{
+    DrawBallInstances(renderer, previousVBO, positionVBO, renderer.IdVBO, blend, count, view);
+}
+
+void DestroyBallRenderer(BallRenderer& renderer)
+{
+    GLuint buffers[] = { renderer.CornerVBO, renderer.RadiusBuffer, renderer.ColorBuffer, renderer.IdVBO, renderer.ListPositionVBO };
+    GLuint textures[] = { renderer.RadiusTexture, renderer.ColorTexture };
+    glDeleteBuffers(5, buffers);
+    glDeleteTextures(2, textures);
+    glDeleteProgram(renderer.Program);
+    renderer = BallRenderer{};
+}
+
+// The 4x4 gradient squares behind the balls, built once into a static buffer
+struct BackgroundRenderer
+{
+    GLuint Program;
+    GLuint VBO;
+    GLsizei VertexCount;
+};
+
+const char* BackgroundVertexShader = R"(
+#version 120
+attribute vec2 position;
+attribute vec3 color;
+
+varying vec3 vertexColor;
+
+void main()
+{
+    gl_Position = vec4(position, 0.0, 1.0);
+    vertexColor = color;
+}
+)";
+
+const char* BackgroundFragmentShader = R"(
+#version 120
+varying vec3 vertexColor;
+
+void main()
+{
+    gl_FragColor = vec4(vertexColor, 1.0);
+}
+)";
+
+bool CreateBackgroundRenderer(BackgroundRenderer& renderer)
+{
+    const char* attributes[] = { "position", "color" };
+    renderer.Program = CreateShaderProgram(BackgroundVertexShader, BackgroundFragmentShader, attributes, 2);
+    if (!renderer.Program)
+    {
+        return false;
+    }
+
+    // Corners of a square with their colours, as two triangles
+    const float square[6][5] = {
+        { -0.25f,  0.25f, 1.0f, 0.0f, 0.0f },
+        {  0.25f,  0.25f, 0.0f, 1.0f, 0.0f },
+        {  0.25f, -0.25f, 0.0f, 0.0f, 1.0f },
+        { -0.25f,  0.25f, 1.0f, 0.0f, 0.0f },
+        {  0.25f, -0.25f, 0.0f, 0.0f, 1.0f },
+        { -0.25f, -0.25f, 1.0f, 1.0f, 1.0f },
+    };
+
+    std::vector<float> vertices;
+    for (int x = 0; x < 4; ++x)
+    {
+        for (int y = 0; y < 4; ++y)
+        {
+            float posX = ((float)(2 * x) + 1) * (float)WinSize / 8;
+            float posY = ((float)(2 * y) + 1) * (float)WinSize / 8;
+            glm::vec2 glPos = PixelToGLPos(glm::vec2{posX, posY});
+
+            for (auto& vertex : square)
+            {
+                vertices.insert(vertices.end(), { glPos.x + vertex[0], glPos.y + vertex[1], vertex[2], vertex[3], vertex[4] });
+            }
+        }
+    }
+
+    renderer.VertexCount = (GLsizei)(vertices.size() / 5);
+    renderer.VBO = CreateVertexBuffer(vertices.data(), vertices.size() * sizeof(float), GL_STATIC_DRAW);
+
+    return true;
+}
+
+void DrawBackground(BackgroundRenderer& renderer)
+{
+    glUseProgram(renderer.Program);
+    glBindBuffer(GL_ARRAY_BUFFER, renderer.VBO);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), nullptr);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(2 * sizeof(float)));
+
+    glDrawArrays(GL_TRIANGLES, 0, renderer.VertexCount);
+
+    glDisableVertexAttribArray(0);
+    glDisableVertexAttribArray(1);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glUseProgram(0);
+}
+
+void DestroyBackgroundRenderer(BackgroundRenderer& renderer)
+{
+    glDeleteBuffers(1, &renderer.VBO);
+    glDeleteProgram(renderer.Program);
+    renderer = BackgroundRenderer{};
 }
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// View of a whole file. The pages are loaded on first touch, so opening a
+// large recording or checkpoint costs nothing until it is read. A copy on
+// write view can be changed, the changes stay in memory and never reach the file.
+struct MappedFile
+{
+    unsigned char* Data;
+    size_t Size;
+
+#if defined(_WIN32)
+    HANDLE File;
+    HANDLE Mapping;
+#else
+    int File;
+#endif
+};
+
+void UnmapFile(MappedFile& file)
+{
+#if defined(_WIN32)
+    if (file.Data)
+    {
+        UnmapViewOfFile(file.Data);
+    }
+    if (file.Mapping)
+    {
+        CloseHandle(file.Mapping);
+    }
+    if (file.File && file.File != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file.File);
+    }
+#else
+    if (file.Data)
+    {
+        munmap(file.Data, file.Size);
+    }
+    if (file.File > 0)
+    {
+        close(file.File);
+    }
+#endif
+    file = MappedFile{};
+}
+
+bool MapFile(MappedFile& file, const std::string& fileName, bool copyOnWrite = false)
+{
+    file = MappedFile{};
+
+#if defined(_WIN32)
+    file.File = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER size;
+    if (file.File == INVALID_HANDLE_VALUE || !GetFileSizeEx(file.File, &size) || size.QuadPart == 0)
+    {
+        UnmapFile(file);
+        return false;
+    }
+    file.Size = (size_t)size.QuadPart;
+
+    file.Mapping = CreateFileMappingA(file.File, nullptr, copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+    if (file.Mapping)
+    {
+        file.Data = (unsigned char*)MapViewOfFile(file.Mapping, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+    }
+#else
+    file.File = open(fileName.c_str(), O_RDONLY);
+    struct stat status;
+    if (file.File < 0 || fstat(file.File, &status) != 0 || status.st_size == 0)
+    {
+        UnmapFile(file);
+        return false;
+    }
+    file.Size = (size_t)status.st_size;
+
+    void* data = copyOnWrite ? mmap(nullptr, file.Size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file.File, 0)
+                             : mmap(nullptr, file.Size, PROT_READ, MAP_SHARED, file.File, 0);
+    file.Data = data == MAP_FAILED ? nullptr : (unsigned char*)data;
+#endif
+
+    if (!file.Data)
+    {
+        UnmapFile(file);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,368 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NATIVE_SSE 1
+#endif
+
+#include "Backend.hpp"
+#include "ThreadPool.hpp"
+
+// Native CPU backend
+//
+// The same step as the grid path of BallLogic.cl, in plain C++ on structure of
+// arrays copies of the balls: integrate, bin into the uniform grid with a
+// counting sort, then gather contacts from the 9 neighbouring cells. Both
+// passes are spread over a work-stealing pool. Integration and the distance
+// test of the contact search run 4 balls at a time with SSE; the few pairs
+// that do touch go through the same scalar math as resolve_contact, visited in
+// the same (cell, index) order, so results match the OpenCL path closely.
+
+const size_t NativeGrain = 1024;
+
+class NativeBackend : public SimBackend
+{
+public:
+    NativeBackend(BallState& balls, unsigned int threadCount)
+    {
+        Count = balls.Count;
+        PosX.resize(Count);
+        PosY.resize(Count);
+        VelX.resize(Count);
+        VelY.resize(Count);
+        InvMass.resize(Count);
+        Radius.resize(Count);
+        RadiusF.resize(Count);
+        for (size_t i = 0; i < Count; ++i)
+        {
+            PosX[i] = balls.Position[i].x;
+            PosY[i] = balls.Position[i].y;
+            VelX[i] = balls.Velocity[i].x;
+            VelY[i] = balls.Velocity[i].y;
+            InvMass[i] = 1 / balls.Mass[i];
+            Radius[i] = balls.Radius[i];
+            RadiusF[i] = (float)balls.Radius[i];
+        }
+
+        OutPosX.resize(Count);
+        OutPosY.resize(Count);
+        OutVelX.resize(Count);
+        OutVelY.resize(Count);
+
+        cl_uint maxRadius = *std::max_element(balls.Radius, balls.Radius + balls.Count);
+        CellSize = 2.0f * maxRadius;
+        GridDim = (cl_uint)std::ceil(WorldSize / CellSize);
+        CellStart.resize((size_t)GridDim * GridDim + 1);
+        BallCell.resize(Count);
+        SortedIndex.resize(Count);
+        SortedX.resize(Count);
+        SortedY.resize(Count);
+        SortedRadius.resize(Count);
+
+        StartPool(Pool, threadCount);
+    }
+
+    ~NativeBackend()
+    {
+        StopPool(Pool);
+    }
+
+    const char* Name() const override
+    {
+        return "native";
+    }
+
+    unsigned int ThreadCount() const
+    {
+        return (unsigned int)Pool.Queues.size();
+    }
+
+    bool SetTimeStep(float deltaT) override
+    {
+        DeltaT = deltaT;
+        return true;
+    }
+
+    bool Step(unsigned int substeps) override
+    {
+        for (unsigned int step = 0; step < substeps; ++step)
+        {
+            ParallelFor(Pool, 0, Count, NativeGrain, [this](size_t first, size_t last) { Integrate(first, last); });
+            BinBalls();
+            ParallelFor(Pool, 0, Count, NativeGrain, [this](size_t first, size_t last) { Collide(first, last); });
+
+            PosX.swap(OutPosX);
+            PosY.swap(OutPosY);
+            VelX.swap(OutVelX);
+            VelY.swap(OutVelY);
+        }
+        return true;
+    }
+
+    bool ReadPositions(cl_float2* positions) override
+    {
+        for (size_t i = 0; i < Count; ++i)
+        {
+            positions[i].x = PosX[i];
+            positions[i].y = PosY[i];
+        }
+        return true;
+    }
+
+    bool ReadVelocities(cl_float2* velocities) override
+    {
+        for (size_t i = 0; i < Count; ++i)
+        {
+            velocities[i].x = VelX[i];
+            velocities[i].y = VelY[i];
+        }
+        return true;
+    }
+
+private:
+    size_t Count;
+    float DeltaT = 0.0f;
+
+    std::vector<float> PosX, PosY, VelX, VelY;
+    std::vector<float> OutPosX, OutPosY, OutVelX, OutVelY;
+    std::vector<float> InvMass;
+    std::vector<cl_uint> Radius;
+    std::vector<float> RadiusF;
+
+    // Uniform grid, the balls of cell c are SortedIndex[CellStart[c]..CellStart[c + 1])
+    float CellSize;
+    cl_uint GridDim;
+    std::vector<cl_uint> CellStart;
+    std::vector<cl_uint> CellInsert;
+    std::vector<cl_uint> BallCell;
+    std::vector<cl_uint> SortedIndex;
+    std::vector<float> SortedX, SortedY, SortedRadius;
+
+    WorkStealingPool Pool;
+
+    // update_ball
+    void Integrate(size_t first, size_t last)
+    {
+        float dt = DeltaT;
+        float gdt = gravity * dt;
+        float worldSize = (float)WorldSize;
+
+        size_t i = first;
+#ifdef NATIVE_SSE
+        __m128 dtV = _mm_set1_ps(dt);
+        __m128 gdtV = _mm_set1_ps(gdt);
+        __m128 worldV = _mm_set1_ps(worldSize);
+        for (; i + 4 <= last; i += 4)
+        {
+            __m128 r = _mm_loadu_ps(&RadiusF[i]);
+            __m128 vx = _mm_loadu_ps(&VelX[i]);
+            __m128 vy = _mm_add_ps(_mm_loadu_ps(&VelY[i]), gdtV);
+            __m128 px = _mm_add_ps(_mm_loadu_ps(&PosX[i]), _mm_mul_ps(vx, dtV));
+            __m128 py = _mm_add_ps(_mm_loadu_ps(&PosY[i]), _mm_mul_ps(vy, dtV));
+
+            // Same clamps as the kernel: min(p, world - r), then max(p, r)
+            __m128 limit = _mm_sub_ps(worldV, r);
+            px = _mm_max_ps(_mm_min_ps(px, limit), r);
+            py = _mm_max_ps(_mm_min_ps(py, limit), r);
+
+            _mm_storeu_ps(&PosX[i], px);
+            _mm_storeu_ps(&PosY[i], py);
+            _mm_storeu_ps(&VelY[i], vy);
+        }
+#endif
+        for (; i < last; ++i)
+        {
+            VelY[i] += gdt;
+            float px = PosX[i] + VelX[i] * dt;
+            float py = PosY[i] + VelY[i] * dt;
+
+            float limit = worldSize - RadiusF[i];
+            px = px < limit ? px : limit;
+            px = px > RadiusF[i] ? px : RadiusF[i];
+            py = py < limit ? py : limit;
+            py = py > RadiusF[i] ? py : RadiusF[i];
+
+            PosX[i] = px;
+            PosY[i] = py;
+        }
+    }
+
+    cl_uint CellCoord(float p) const
+    {
+        int c = (int)(p / CellSize);
+        return (cl_uint)std::min(std::max(c, 0), (int)GridDim - 1);
+    }
+
+    // Counting sort by cell, stable so every cell lists its balls by index
+    // like the sorted keys of the OpenCL broadphase
+    void BinBalls()
+    {
+        ParallelFor(Pool, 0, Count, NativeGrain, [this](size_t first, size_t last)
+        {
+            for (size_t i = first; i < last; ++i)
+            {
+                BallCell[i] = CellCoord(PosY[i]) * GridDim + CellCoord(PosX[i]);
+            }
+        });
+
+        std::fill(CellStart.begin(), CellStart.end(), 0);
+        for (size_t i = 0; i < Count; ++i)
+        {
+            ++CellStart[BallCell[i] + 1];
+        }
+        for (size_t c = 1; c < CellStart.size(); ++c)
+        {
+            CellStart[c] += CellStart[c - 1];
+        }
+
+        CellInsert.assign(CellStart.begin(), CellStart.end() - 1);
+        for (size_t i = 0; i < Count; ++i)
+        {
+            cl_uint k = CellInsert[BallCell[i]]++;
+            SortedIndex[k] = (cl_uint)i;
+            SortedX[k] = PosX[i];
+            SortedY[k] = PosY[i];
+            SortedRadius[k] = RadiusF[i];
+        }
+    }
+
+    // handle_wall_collision, including the unsigned arithmetic of the kernel
+    static bool CollidesWithEdge(float p, cl_uint radius, cl_uint worldSize)
+    {
+        return (cl_uint)p - radius == 0 || (cl_uint)p + radius >= worldSize;
+    }
+
+    // resolve_contact
+    void ResolveContact(size_t i, size_t j, float& correctionX, float& correctionY, float& deltaVX, float& deltaVY) const
+    {
+        float deltaX = PosX[i] - PosX[j];
+        float deltaY = PosY[i] - PosY[j];
+
+        float r = RadiusF[i] + RadiusF[j];
+        float dist2 = deltaX * deltaX + deltaY * deltaY;
+        if (dist2 >= r * r)
+        {
+            return;
+        }
+
+        float d = std::sqrt(dist2);
+
+        float mtdX;
+        float mtdY;
+        if (d != 0.0f)
+        {
+            mtdX = deltaX * ((r - d) / d);
+            mtdY = deltaY * ((r - d) / d);
+        }
+        else
+        {
+            d = r - 1.0f;
+            mtdX = (i < j ? r : -r) * ((r - d) / d);
+            mtdY = 0.0f;
+        }
+
+        float im1 = InvMass[i];
+        float im2 = InvMass[j];
+        correctionX += mtdX * (im1 / (im1 + im2));
+        correctionY += mtdY * (im1 / (im1 + im2));
+
+        float vX = VelX[i] - VelX[j];
+        float vY = VelY[i] - VelY[j];
+
+        float mtdLength = std::sqrt(mtdX * mtdX + mtdY * mtdY);
+        float vn = vX * (mtdX / mtdLength) + vY * (mtdY / mtdLength);
+        if (vn > 0.0f)
+        {
+            return;
+        }
+
+        float impulse = (-(1.0f + Restitution) * vn) / (im1 + im2);
+        deltaVX += mtdX * impulse * ImpulseScale * im1;
+        deltaVY += mtdY * impulse * ImpulseScale * im1;
+    }
+
+    // Contacts of ball i with the sorted balls in [start, end)
+    void CollideRange(size_t i, cl_uint start, cl_uint end, float& correctionX, float& correctionY, float& deltaVX, float& deltaVY) const
+    {
+        float x = PosX[i];
+        float y = PosY[i];
+        float radius = RadiusF[i];
+
+        cl_uint k = start;
+#ifdef NATIVE_SSE
+        // Most candidates are not touching, so test 4 at a time and only
+        // resolve the lanes that are, in order
+        __m128 xV = _mm_set1_ps(x);
+        __m128 yV = _mm_set1_ps(y);
+        __m128 radiusV = _mm_set1_ps(radius);
+        for (; k + 4 <= end; k += 4)
+        {
+            __m128 dx = _mm_sub_ps(xV, _mm_loadu_ps(&SortedX[k]));
+            __m128 dy = _mm_sub_ps(yV, _mm_loadu_ps(&SortedY[k]));
+            __m128 r = _mm_add_ps(radiusV, _mm_loadu_ps(&SortedRadius[k]));
+            __m128 dist2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+            int touching = _mm_movemask_ps(_mm_cmplt_ps(dist2, _mm_mul_ps(r, r)));
+
+            for (int lane = 0; touching != 0; ++lane, touching >>= 1)
+            {
+                cl_uint j = SortedIndex[k + lane];
+                if ((touching & 1) && j != i)
+                {
+                    ResolveContact(i, j, correctionX, correctionY, deltaVX, deltaVY);
+                }
+            }
+        }
+#endif
+        for (; k < end; ++k)
+        {
+            cl_uint j = SortedIndex[k];
+            if (j != i)
+            {
+                ResolveContact(i, j, correctionX, correctionY, deltaVX, deltaVY);
+            }
+        }
+    }
+
+    // handle_collisions, writes only ball i so the balls can run in any order
+    void Collide(size_t first, size_t last)
+    {
+        for (size_t i = first; i < last; ++i)
+        {
+            float velocityX = VelX[i];
+            float velocityY = VelY[i];
+            if (CollidesWithEdge(PosX[i], Radius[i], WorldSize))
+            {
+                velocityX = -velocityX;
+            }
+            if (CollidesWithEdge(PosY[i], Radius[i], WorldSize))
+            {
+                velocityY = -velocityY;
+            }
+
+            float correctionX = 0.0f;
+            float correctionY = 0.0f;
+            float deltaVX = 0.0f;
+            float deltaVY = 0.0f;
+
+            int cellX = (int)CellCoord(PosX[i]);
+            int cellY = (int)CellCoord(PosY[i]);
+            for (int y = std::max(cellY - 1, 0); y <= std::min(cellY + 1, (int)GridDim - 1); ++y)
+            {
+                for (int x = std::max(cellX - 1, 0); x <= std::min(cellX + 1, (int)GridDim - 1); ++x)
+                {
+                    cl_uint cell = (cl_uint)y * GridDim + (cl_uint)x;
+                    CollideRange(i, CellStart[cell], CellStart[cell + 1], correctionX, correctionY, deltaVX, deltaVY);
+                }
+            }
+
+            OutPosX[i] = PosX[i] + correctionX;
+            OutPosY[i] = PosY[i] + correctionY;
+            OutVelX[i] = velocityX + deltaVX;
+            OutVelY[i] = velocityY + deltaVY;
+        }
+    }
+};
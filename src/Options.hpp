@@ -0,0 +1,547 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+const int MinWindowedBalls = 3;
+const int MaxWindowedBalls = 10;
+const int MaxHeadlessBalls = 16 * 1024 * 1024;
+
+enum class CollisionMode
+{
+    Auto,
+    Grid,   // Uniform grid broadphase, scales to large sparse scenes
+    Tiled   // Fused all-pairs step through local memory, for small or dense scenes
+};
+
+enum class BackendKind
+{
+    Auto,   // OpenCL, or native when no OpenCL device can be set up
+    OpenCL,
+    Native  // Multithreaded SIMD C++ on the host
+};
+
+// How positions for drawing come back from the OpenCL device
+enum class ReadbackFormat
+{
+    Float,      // As simulated, 8 bytes per ball
+    Fixed16,    // 16-bit fractions of the world size, 4 bytes per ball
+    Delta8      // Signed byte changes of the 16-bit values since the last frame, 2 bytes per ball
+};
+
+struct SimOptions
+{
+    int BallCount;
+
+    // Headless mode: no window, no frame cap, fixed time step
+    bool Headless;
+    unsigned long long Steps;   // 0 when not given
+    double Duration;            // wall-clock seconds, 0 when not given
+
+    // With a fixed time step every frame advances TimeStep in Substeps equal
+    // steps, otherwise a windowed frame advances by the measured frame time
+    bool FixedStep;
+    float TimeStep;
+    bool ExplicitTimeStep; // --dt was given, a restore keeps it over the checkpoint's
+    unsigned int Substeps;
+
+    CollisionMode Collisions;
+
+    // Freeze balls that came to rest and only step the awake ones (OpenCL grid step)
+    bool Sleeping;
+
+    // Sweep balls over the step so they can't tunnel at large steps (OpenCL grid step)
+    bool SweptCollisions;
+
+    // Sort the balls along a Z-order curve every ReorderEvery steps, 0 never (OpenCL)
+    unsigned int ReorderEvery;
+
+    // Share the position buffer with GL instead of reading it back each frame
+    bool GLSharing;
+
+    // Windowed: format of the positions read back from OpenCL for drawing
+    ReadbackFormat Readback;
+
+    // Windowed: side of the world in window sizes, the camera pans and zooms
+    // over it. Up to MaxWindowedBalls balls fit per window-sized area.
+    float WorldScale;
+
+    // Windowed: read back and draw only the balls in the camera's view
+    bool Cull;
+
+    // Windowed: simulate and draw on one thread instead of stepping on a
+    // thread of its own every TimeStep seconds. GL sharing needs it.
+    bool SingleThread;
+
+    // Benchmark the work-group sizes again instead of using the cached ones
+    bool Retune;
+
+    // Headless: split the world into slabs over every OpenCL device, CPU
+    // devices are cut into SubDevices sub-devices when it is above 1
+    bool MultiDevice;
+    unsigned int SubDevices;
+
+    BackendKind Backend;
+    unsigned int Threads; // Host threads for the native backend and the scene setup, 0 for one per hardware thread
+
+    // Same seed, same scene
+    unsigned long long Seed;
+
+    // Time host scopes and OpenCL commands, and print their p50/p99 at exit.
+    // A Chrome trace of the run goes to TraceFile when it is not empty.
+    bool Profile;
+    std::string TraceFile;
+
+    // Headless: write the positions and velocities of every RecordEvery-th
+    // frame to RecordFile, delta compressed unless RecordRaw
+    std::string RecordFile;
+    unsigned int RecordEvery;
+    bool RecordRaw;
+
+    // Print the frames of the recording in DumpFile instead of simulating
+    std::string DumpFile;
+
+    // Start from the scene saved in RestoreFile instead of a new one, and
+    // headless runs save where they ended up to CheckpointFile
+    std::string RestoreFile;
+    std::string CheckpointFile;
+};
+
+void print_usage(const char* program)
+{
+    std::cout << "Usage: " << program << " <ball count> [options]" << std::endl
+              << "       " << program << " --restore <file> [options]" << std::endl
+              << "       " << program << " --dump <recording>" << std::endl
+              << "  --headless         Run without a window and report steps per second" << std::endl
+              << "  --steps <n>        Headless: number of frames to run (default 1000)" << std::endl
+              << "  --duration <s>     Headless: wall-clock seconds to run instead of a frame count" << std::endl
+              << "  --dt <s>           Fixed time step per frame (default 1/30)" << std::endl
+              << "  --substeps <k>     Split every frame into k fixed substeps (default 1)" << std::endl
+              << "  --collisions <m>   auto, grid or tiled (default auto)" << std::endl
+              << "  --sleep            Freeze balls at rest and only simulate the moving ones" << std::endl
+              << "  --ccd              Sweep balls to their time of impact, for larger stable steps" << std::endl
+              << "  --reorder <n>      Sort the balls in memory by where they are every n steps" << std::endl
+              << "  --no-gl-sharing    Read positions back instead of sharing them with OpenGL" << std::endl
+              << "  --readback <f>     Windowed: float, fixed16 or delta8 positions from OpenCL (default float)" << std::endl
+              << "  --world <scale>    Windowed: world side in window sizes, scroll to zoom and drag to pan (default 1)" << std::endl
+              << "  --cull             Windowed: read back and draw only the balls in view" << std::endl
+              << "  --single-thread    Simulate on the render thread, once per drawn frame" << std::endl
+              << "  --retune           Ignore the cached work-group sizes and benchmark them again" << std::endl
+              << "  --multi-device     Headless: spread the world over every OpenCL device" << std::endl
+              << "  --sub-devices <n>  With --multi-device, split CPU devices into n sub-devices" << std::endl
+              << "  --backend <b>      auto, opencl or native (default auto)" << std::endl
+              << "  --threads <n>      Host threads for the native backend and the setup (default one per hardware thread)" << std::endl
+              << "  --seed <n>         Seed of the initial scene (default random, printed at startup)" << std::endl
+              << "  --profile          Time every frame phase and OpenCL command, print p50/p99 at exit" << std::endl
+              << "  --trace <file>     Profile and write a Chrome trace (chrome://tracing) to file" << std::endl
+              << "  --record <file>    Headless: record the positions and velocities of the balls to file" << std::endl
+              << "  --record-every <n> Record every n-th frame (default 1)" << std::endl
+              << "  --record-raw       Store the recorded frames uncompressed" << std::endl
+              << "  --dump <file>      Print every frame of a recording instead of simulating" << std::endl
+              << "  --restore <file>   Continue from a checkpoint instead of a new scene" << std::endl
+              << "  --checkpoint <f>   Headless: save the balls to file f at the end of the run" << std::endl;
+}
+
+template <typename T>
+T parse_number(const char* name, const char* value)
+{
+    try
+    {
+        size_t end = 0;
+        double val = std::stod(value, &end);
+        if (end != std::strlen(value) || val < 0)
+        {
+            throw std::invalid_argument(value);
+        }
+        return (T)val;
+    }
+    catch (std::exception& e)
+    {
+        std::cout << "The value for " << name << " must be a positive number!" << std::endl;
+        std::exit(-1);
+    }
+}
+
+// Seeds use every bit, parse_number would round them through a double
+unsigned long long parse_seed(const char* value)
+{
+    try
+    {
+        size_t end = 0;
+        unsigned long long seed = std::stoull(value, &end);
+        if (end != std::strlen(value) || value[0] == '-')
+        {
+            throw std::invalid_argument(value);
+        }
+        return seed;
+    }
+    catch (std::exception& e)
+    {
+        std::cout << "The value for --seed must be a positive integer!" << std::endl;
+        std::exit(-1);
+    }
+}
+
+// Balls a window can show, MaxWindowedBalls per window-sized area of the world
+int max_windowed_balls(const SimOptions& options)
+{
+    return (int)(MaxWindowedBalls * options.WorldScale * options.WorldScale);
+}
+
+// Exits when count balls can't run in the mode the options ask for
+void check_ball_count(const SimOptions& options, int count)
+{
+    if (options.Headless && (count < 1 || count > MaxHeadlessBalls))
+    {
+        std::cout << "The argument must be in between 1 and " << MaxHeadlessBalls << " in headless mode!" << std::endl;
+        std::exit(-1);
+    }
+
+    if (!options.Headless && (count < MinWindowedBalls || count > max_windowed_balls(options)))
+    {
+        std::cout << "The argument must be in between " << MinWindowedBalls << " and " << max_windowed_balls(options) << "!" << std::endl;
+        std::exit(-1);
+    }
+}
+
+SimOptions parse_options(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cout << "Invalid number of arguments!" << std::endl;
+        print_usage(argv[0]);
+        std::exit(-1);
+    }
+
+    SimOptions options{};
+    options.TimeStep = 1.0f / 30;
+    options.Substeps = 1;
+    options.GLSharing = true;
+    options.RecordEvery = 1;
+    options.WorldScale = 1.0f;
+    bool hasSeed = false;
+
+    // The ball count can be left out when restoring, the checkpoint has it
+    int firstOption = 1;
+    if (argv[1][0] != '-')
+    {
+        try
+        {
+            options.BallCount = std::stoi(argv[1]);
+        }
+        catch (std::exception& e)
+        {
+            std::cout << "The argument must be a number!" << std::endl;
+            std::exit(-1);
+        }
+        firstOption = 2;
+    }
+
+    for (int i = firstOption; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--headless")
+        {
+            options.Headless = true;
+        }
+        else if (arg == "--no-gl-sharing")
+        {
+            options.GLSharing = false;
+        }
+        else if (arg == "--sleep")
+        {
+            options.Sleeping = true;
+        }
+        else if (arg == "--ccd")
+        {
+            options.SweptCollisions = true;
+        }
+        else if (arg == "--reorder" && hasValue)
+        {
+            options.ReorderEvery = parse_number<unsigned int>("--reorder", argv[++i]);
+        }
+        else if (arg == "--world" && hasValue)
+        {
+            options.WorldScale = parse_number<float>("--world", argv[++i]);
+        }
+        else if (arg == "--cull")
+        {
+            options.Cull = true;
+        }
+        else if (arg == "--single-thread")
+        {
+            options.SingleThread = true;
+        }
+        else if (arg == "--retune")
+        {
+            options.Retune = true;
+        }
+        else if (arg == "--profile")
+        {
+            options.Profile = true;
+        }
+        else if (arg == "--record" && hasValue)
+        {
+            options.RecordFile = argv[++i];
+        }
+        else if (arg == "--record-every" && hasValue)
+        {
+            options.RecordEvery = parse_number<unsigned int>("--record-every", argv[++i]);
+        }
+        else if (arg == "--restore" && hasValue)
+        {
+            options.RestoreFile = argv[++i];
+        }
+        else if (arg == "--checkpoint" && hasValue)
+        {
+            options.CheckpointFile = argv[++i];
+        }
+        else if (arg == "--record-raw")
+        {
+            options.RecordRaw = true;
+        }
+        else if (arg == "--dump" && hasValue)
+        {
+            options.DumpFile = argv[++i];
+        }
+        else if (arg == "--trace" && hasValue)
+        {
+            options.TraceFile = argv[++i];
+            options.Profile = true;
+        }
+        else if (arg == "--multi-device")
+        {
+            options.MultiDevice = true;
+        }
+        else if (arg == "--sub-devices" && hasValue)
+        {
+            options.SubDevices = parse_number<unsigned int>("--sub-devices", argv[++i]);
+            options.MultiDevice = true;
+        }
+        else if (arg == "--steps" && hasValue)
+        {
+            options.Steps = parse_number<unsigned long long>("--steps", argv[++i]);
+        }
+        else if (arg == "--duration" && hasValue)
+        {
+            options.Duration = parse_number<double>("--duration", argv[++i]);
+        }
+        else if (arg == "--dt" && hasValue)
+        {
+            options.TimeStep = parse_number<float>("--dt", argv[++i]);
+            options.ExplicitTimeStep = true;
+            options.FixedStep = true;
+        }
+        else if (arg == "--substeps" && hasValue)
+        {
+            options.Substeps = parse_number<unsigned int>("--substeps", argv[++i]);
+            options.FixedStep = true;
+        }
+        else if (arg == "--backend" && hasValue)
+        {
+            std::string backend = argv[++i];
+            if (backend == "auto")
+            {
+                options.Backend = BackendKind::Auto;
+            }
+            else if (backend == "opencl")
+            {
+                options.Backend = BackendKind::OpenCL;
+            }
+            else if (backend == "native")
+            {
+                options.Backend = BackendKind::Native;
+            }
+            else
+            {
+                std::cout << "The backend must be auto, opencl or native!" << std::endl;
+                std::exit(-1);
+            }
+        }
+        else if (arg == "--readback" && hasValue)
+        {
+            std::string format = argv[++i];
+            if (format == "float")
+            {
+                options.Readback = ReadbackFormat::Float;
+            }
+            else if (format == "fixed16")
+            {
+                options.Readback = ReadbackFormat::Fixed16;
+            }
+            else if (format == "delta8")
+            {
+                options.Readback = ReadbackFormat::Delta8;
+            }
+            else
+            {
+                std::cout << "The readback format must be float, fixed16 or delta8!" << std::endl;
+                std::exit(-1);
+            }
+        }
+        else if (arg == "--threads" && hasValue)
+        {
+            options.Threads = parse_number<unsigned int>("--threads", argv[++i]);
+        }
+        else if (arg == "--seed" && hasValue)
+        {
+            options.Seed = parse_seed(argv[++i]);
+            hasSeed = true;
+        }
+        else if (arg == "--collisions" && hasValue)
+        {
+            std::string mode = argv[++i];
+            if (mode == "auto")
+            {
+                options.Collisions = CollisionMode::Auto;
+            }
+            else if (mode == "grid")
+            {
+                options.Collisions = CollisionMode::Grid;
+            }
+            else if (mode == "tiled")
+            {
+                options.Collisions = CollisionMode::Tiled;
+            }
+            else
+            {
+                std::cout << "The collision mode must be auto, grid or tiled!" << std::endl;
+                std::exit(-1);
+            }
+        }
+        else
+        {
+            std::cout << "Unknown or incomplete option: " << arg << std::endl;
+            print_usage(argv[0]);
+            std::exit(-1);
+        }
+    }
+
+    if (options.TimeStep <= 0 || options.Substeps < 1)
+    {
+        std::cout << "The time step and substep count must be greater than 0!" << std::endl;
+        std::exit(-1);
+    }
+
+    if (options.MultiDevice && !options.Headless)
+    {
+        std::cout << "--multi-device only works with --headless!" << std::endl;
+        std::exit(-1);
+    }
+
+    if (!options.RecordFile.empty() && !options.Headless)
+    {
+        std::cout << "--record only works with --headless!" << std::endl;
+        std::exit(-1);
+    }
+
+    if (options.Readback != ReadbackFormat::Float && options.Headless)
+    {
+        std::cout << "--readback only works with a window!" << std::endl;
+        std::exit(-1);
+    }
+
+    if (options.WorldScale < 1.0f)
+    {
+        std::cout << "--world must be at least 1!" << std::endl;
+        std::exit(-1);
+    }
+
+    if ((options.WorldScale != 1.0f || options.Cull) && options.Headless)
+    {
+        std::cout << "--world and --cull only work with a window!" << std::endl;
+        std::exit(-1);
+    }
+
+    if (!options.GLSharing && !options.SingleThread && !options.Headless)
+    {
+        std::cout << "--no-gl-sharing only matters with --single-thread, the simulation thread always reads positions back" << std::endl;
+    }
+
+    if (!options.CheckpointFile.empty() && !options.Headless)
+    {
+        std::cout << "--checkpoint only works with --headless!" << std::endl;
+        std::exit(-1);
+    }
+
+    // Nothing else applies to a dump
+    if (!options.DumpFile.empty())
+    {
+        return options;
+    }
+
+    if (firstOption == 1 && options.RestoreFile.empty())
+    {
+        std::cout << "The ball count is missing!" << std::endl;
+        print_usage(argv[0]);
+        std::exit(-1);
+    }
+
+    if (options.RecordEvery < 1)
+    {
+        std::cout << "--record-every must be at least 1!" << std::endl;
+        std::exit(-1);
+    }
+
+    if (options.MultiDevice && options.Backend == BackendKind::Native)
+    {
+        std::cout << "--multi-device needs the OpenCL backend!" << std::endl;
+        std::exit(-1);
+    }
+
+    if (options.Sleeping)
+    {
+        if (options.Backend == BackendKind::Native || options.MultiDevice || options.Collisions == CollisionMode::Tiled)
+        {
+            std::cout << "--sleep needs the single device OpenCL backend with grid collisions!" << std::endl;
+            std::exit(-1);
+        }
+        options.Collisions = CollisionMode::Grid;
+    }
+
+    if (options.SweptCollisions)
+    {
+        if (options.Backend == BackendKind::Native || options.MultiDevice || options.Collisions == CollisionMode::Tiled)
+        {
+            std::cout << "--ccd needs the single device OpenCL backend with grid collisions!" << std::endl;
+            std::exit(-1);
+        }
+        options.Collisions = CollisionMode::Grid;
+    }
+
+    if (options.ReorderEvery && (options.Backend == BackendKind::Native || options.MultiDevice))
+    {
+        std::cout << "--reorder needs the single device OpenCL backend!" << std::endl;
+        std::exit(-1);
+    }
+
+    if (options.Headless)
+    {
+        options.FixedStep = true;
+
+        if (options.Steps == 0 && options.Duration <= 0)
+        {
+            options.Steps = 1000;
+        }
+    }
+
+    // A restored scene brings its own count, checked once it is loaded
+    if (options.RestoreFile.empty())
+    {
+        check_ball_count(options, options.BallCount);
+    }
+
+    if (!hasSeed)
+    {
+        std::random_device device;
+        options.Seed = ((unsigned long long)device() << 32) | device();
+    }
+
+    return options;
+}
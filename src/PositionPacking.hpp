@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PACKING_SSE 1
+#endif
+
+#include "CL/cl.h"
+
+// Host side of the quantized position readback
+//
+// pack_positions in BallLogic.cl stores every coordinate as a 16-bit fraction
+// of the world size, and in the delta format only its change since the frame
+// before as a signed byte. These turn them back into floats, 8 coordinates at
+// a time with SSE2.
+
+const float PackedPositionRange = 65535.0f;
+
+// Fills count positions from the 2 * count values in quantized
+void DecodeFixed16(const cl_ushort* quantized, size_t count, float worldSize, cl_float2* positions)
+{
+    float* coords = (float*)positions;
+    size_t values = 2 * count;
+    float step = worldSize / PackedPositionRange;
+
+    size_t i = 0;
+#if PACKING_SSE
+    __m128 stepV = _mm_set1_ps(step);
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= values; i += 8)
+    {
+        __m128i q = _mm_loadu_si128((const __m128i*)(quantized + i));
+        __m128 low = _mm_cvtepi32_ps(_mm_unpacklo_epi16(q, zero));
+        __m128 high = _mm_cvtepi32_ps(_mm_unpackhi_epi16(q, zero));
+        _mm_storeu_ps(coords + i, _mm_mul_ps(low, stepV));
+        _mm_storeu_ps(coords + i + 4, _mm_mul_ps(high, stepV));
+    }
+#endif
+    for (; i < values; ++i)
+    {
+        coords[i] = quantized[i] * step;
+    }
+}
+
+// Adds the 2 * count byte deltas to the quantized values of the frame before
+void ApplyDeltas8(cl_ushort* quantized, const cl_char* deltas, size_t count)
+{
+    size_t values = 2 * count;
+
+    size_t i = 0;
+#if PACKING_SSE
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= values; i += 16)
+    {
+        // Sign extends the bytes to 16 bits
+        __m128i d = _mm_loadu_si128((const __m128i*)(deltas + i));
+        __m128i sign = _mm_cmpgt_epi8(zero, d);
+        __m128i* q = (__m128i*)(quantized + i);
+        _mm_storeu_si128(q, _mm_add_epi16(_mm_loadu_si128(q), _mm_unpacklo_epi8(d, sign)));
+        _mm_storeu_si128(q + 1, _mm_add_epi16(_mm_loadu_si128(q + 1), _mm_unpackhi_epi8(d, sign)));
+    }
+#endif
+    for (; i < values; ++i)
+    {
+        quantized[i] = (cl_ushort)(quantized[i] + deltas[i]);
+    }
+}
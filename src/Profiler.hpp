@@ -0,0 +1,292 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "CL/cl.h"
+
+// Frame-time profiler
+//
+// Host code marks scopes with ProfileScope, OpenCL commands hand their events
+// to TrackEvent. Device events are read once they completed, so profiling adds
+// no syncs. Every sample feeds a rolling window per name for the p50/p99
+// summary, and the first MaxTraceEvents samples are kept for the Chrome trace
+// (chrome://tracing or ui.perfetto.dev).
+//
+// Device timestamps come from another clock. A command is placed on the host
+// timeline at the time it was enqueued plus its queued to start delay.
+//
+// The simulation and render threads of a window profile into the same
+// Profiler, every function here takes its lock.
+
+const size_t ProfileWindow = 512;
+const size_t MaxTraceEvents = 1 << 20;
+
+struct ProfileSample
+{
+    const std::string* Name; // Key in Profiler::Stats, stays valid
+    unsigned int Track;
+    double StartUs;
+    double DurationUs;
+};
+
+struct RollingStats
+{
+    std::vector<double> Samples; // Last ProfileWindow durations, in microseconds
+    size_t Next;
+    unsigned long long Count;
+    double TotalUs;
+};
+
+struct PendingEvent
+{
+    cl_event Event;
+    const std::string* Name;
+    unsigned int Track;
+    double EnqueuedUs;
+};
+
+struct Profiler
+{
+    std::chrono::steady_clock::time_point Origin;
+    std::map<std::string, RollingStats> Stats;
+    std::vector<std::string> Tracks; // Track 0 is the host
+    std::vector<bool> DeviceTracks;
+    std::vector<ProfileSample> Trace;
+    std::vector<PendingEvent> Pending;
+    std::map<cl_kernel, std::string> KernelNames;
+    std::recursive_mutex Lock;
+};
+
+void InitProfiler(Profiler& profiler)
+{
+    std::lock_guard<std::recursive_mutex> lock(profiler.Lock);
+    profiler.Origin = std::chrono::steady_clock::now();
+    profiler.Stats.clear();
+    profiler.Tracks.assign(1, "Host");
+    profiler.DeviceTracks.assign(1, false);
+    profiler.Trace.clear();
+    profiler.Pending.clear();
+    profiler.KernelNames.clear();
+}
+
+double ProfileNow(Profiler& profiler)
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - profiler.Origin).count();
+}
+
+// A timeline of its own, for a queue or for another host thread
+unsigned int AddProfileTrack(Profiler& profiler, const std::string& name, bool device = true)
+{
+    std::lock_guard<std::recursive_mutex> lock(profiler.Lock);
+    profiler.Tracks.push_back(name);
+    profiler.DeviceTracks.push_back(device);
+    return (unsigned int)profiler.Tracks.size() - 1;
+}
+
+const std::string* ProfileName(Profiler& profiler, const std::string& name)
+{
+    std::lock_guard<std::recursive_mutex> lock(profiler.Lock);
+    return &profiler.Stats.insert(std::make_pair(name, RollingStats{})).first->first;
+}
+
+void AddSample(Profiler& profiler, const std::string* name, unsigned int track, double startUs, double durationUs)
+{
+    std::lock_guard<std::recursive_mutex> lock(profiler.Lock);
+    RollingStats& stats = profiler.Stats[*name];
+    if (stats.Samples.size() < ProfileWindow)
+    {
+        stats.Samples.push_back(durationUs);
+    }
+    else
+    {
+        stats.Samples[stats.Next] = durationUs;
+    }
+    stats.Next = (stats.Next + 1) % ProfileWindow;
+    ++stats.Count;
+    stats.TotalUs += durationUs;
+
+    if (profiler.Trace.size() < MaxTraceEvents)
+    {
+        profiler.Trace.push_back({ name, track, startUs, durationUs });
+    }
+}
+
+// Times the enclosing host scope on track, does nothing when profiler is nullptr
+class ProfileScope
+{
+public:
+    ProfileScope(Profiler* profiler, const char* name, unsigned int track = 0)
+        : Owner(profiler), Name(nullptr), Track(track), StartUs(0.0)
+    {
+        if (Owner)
+        {
+            Name = ProfileName(*Owner, name);
+            StartUs = ProfileNow(*Owner);
+        }
+    }
+
+    ~ProfileScope()
+    {
+        if (Owner)
+        {
+            AddSample(*Owner, Name, Track, StartUs, ProfileNow(*Owner) - StartUs);
+        }
+    }
+
+private:
+    Profiler* Owner;
+    const std::string* Name;
+    unsigned int Track;
+    double StartUs;
+};
+
+// Keeps a reference to event until its times have been read, the caller still
+// releases its own. The queue needs CL_QUEUE_PROFILING_ENABLE.
+void TrackEvent(Profiler& profiler, unsigned int track, const std::string& name, cl_event event)
+{
+    if (event && clRetainEvent(event) == CL_SUCCESS)
+    {
+        std::lock_guard<std::recursive_mutex> lock(profiler.Lock);
+        profiler.Pending.push_back({ event, ProfileName(profiler, name), track, ProfileNow(profiler) });
+    }
+}
+
+bool ReadEventTimes(Profiler& profiler, PendingEvent& pending)
+{
+    cl_ulong queued = 0;
+    cl_ulong start = 0;
+    cl_ulong end = 0;
+    cl_int errCode = clGetEventProfilingInfo(pending.Event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, nullptr);
+    errCode |= clGetEventProfilingInfo(pending.Event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, nullptr);
+    errCode |= clGetEventProfilingInfo(pending.Event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, nullptr);
+    clReleaseEvent(pending.Event);
+
+    if (errCode != CL_SUCCESS || end < start)
+    {
+        return false;
+    }
+
+    double delayUs = start > queued ? (start - queued) * 1e-3 : 0.0;
+    AddSample(profiler, pending.Name, pending.Track, pending.EnqueuedUs + delayUs, (end - start) * 1e-3);
+    return true;
+}
+
+// Reads the events that completed since the last call, or all of them with wait
+void CollectDeviceEvents(Profiler& profiler, bool wait = false)
+{
+    std::lock_guard<std::recursive_mutex> lock(profiler.Lock);
+    size_t kept = 0;
+    for (size_t i = 0; i < profiler.Pending.size(); ++i)
+    {
+        PendingEvent& pending = profiler.Pending[i];
+
+        cl_int status = CL_COMPLETE;
+        if (wait)
+        {
+            clWaitForEvents(1, &pending.Event);
+        }
+        else
+        {
+            clGetEventInfo(pending.Event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, nullptr);
+        }
+
+        // Failed commands report a negative status and have no times
+        if (status == CL_COMPLETE || status < 0)
+        {
+            ReadEventTimes(profiler, pending);
+        }
+        else
+        {
+            profiler.Pending[kept++] = pending;
+        }
+    }
+    profiler.Pending.resize(kept);
+}
+
+double Percentile(std::vector<double> samples, double fraction)
+{
+    size_t index = std::min(samples.size() - 1, (size_t)(fraction * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+// One line per scope and command over the last ProfileWindow samples
+void PrintProfileSummary(Profiler& profiler)
+{
+    std::lock_guard<std::recursive_mutex> lock(profiler.Lock);
+    std::cout << std::left << std::setw(28) << "Profile (ms)" << std::right
+              << std::setw(10) << "calls" << std::setw(10) << "mean" << std::setw(10) << "p50" << std::setw(10) << "p99" << std::endl;
+
+    for (std::map<std::string, RollingStats>::iterator entry = profiler.Stats.begin(); entry != profiler.Stats.end(); ++entry)
+    {
+        RollingStats& stats = entry->second;
+        if (stats.Count == 0)
+        {
+            continue;
+        }
+
+        std::cout << std::left << std::setw(28) << entry->first << std::right << std::fixed << std::setprecision(3)
+                  << std::setw(10) << stats.Count
+                  << std::setw(10) << stats.TotalUs / stats.Count * 1e-3
+                  << std::setw(10) << Percentile(stats.Samples, 0.5) * 1e-3
+                  << std::setw(10) << Percentile(stats.Samples, 0.99) * 1e-3 << std::endl;
+    }
+    std::cout << std::defaultfloat;
+}
+
+std::string EscapeJson(const std::string& text)
+{
+    std::string escaped;
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+        }
+        escaped += (c >= 0 && c < ' ') ? ' ' : c;
+    }
+    return escaped;
+}
+
+// Chrome trace event format, one thread per track
+bool WriteChromeTrace(Profiler& profiler, const std::string& fileName)
+{
+    std::lock_guard<std::recursive_mutex> lock(profiler.Lock);
+    std::ofstream trace(fileName);
+    if (!trace)
+    {
+        std::cerr << "Could not write the trace to " << fileName << std::endl;
+        return false;
+    }
+
+    trace << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::endl;
+    for (size_t track = 0; track < profiler.Tracks.size(); ++track)
+    {
+        trace << (track > 0 ? "," : "") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track
+              << ",\"args\":{\"name\":\"" << EscapeJson(profiler.Tracks[track]) << "\"}}" << std::endl;
+    }
+
+    trace << std::fixed << std::setprecision(3);
+    for (ProfileSample& sample : profiler.Trace)
+    {
+        trace << ",{\"name\":\"" << EscapeJson(*sample.Name) << "\",\"cat\":\"" << (profiler.DeviceTracks[sample.Track] ? "device" : "host")
+              << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << sample.Track
+              << ",\"ts\":" << sample.StartUs << ",\"dur\":" << sample.DurationUs << "}" << std::endl;
+    }
+    trace << "]}" << std::endl;
+
+    if (profiler.Trace.size() == MaxTraceEvents)
+    {
+        std::cout << "The trace holds the first " << MaxTraceEvents << " events only" << std::endl;
+    }
+    std::cout << "Wrote " << profiler.Trace.size() << " trace events to " << fileName << std::endl;
+    return true;
+}
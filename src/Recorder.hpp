@@ -0,0 +1,491 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CL/cl.h"
+
+#include "MappedFile.hpp"
+
+// Trajectory recorder
+//
+// The simulation loop copies the positions and velocities of every recorded
+// frame into a free slot of a single-producer single-consumer ring and goes
+// on. A writer thread takes the slots in order, packs them into chunks and
+// writes them out, so the loop never waits on the disk. When the writer falls
+// behind and the ring is full the frame is dropped and counted instead, so
+// every frame carries the number of the simulation frame it was taken at.
+//
+// File layout, in native byte order:
+//   TrajectoryHeader
+//   chunks: TrajectoryChunk, the uint64_t simulation frame of each of its
+//           frames, then the frames
+//   uint64_t offset of every chunk, then TrajectoryFooter
+//
+// A frame is the positions then the velocities of all the balls, as float
+// bits. The first frame of a chunk is stored as is. With delta compression
+// the others hold each word minus the same word of the frame before, zigzag
+// encoded as a LEB128 varint. Float bits of one sign are ordered, so the
+// difference counts the units in the last place a value moved by, which for
+// a ball between two frames takes one to three bytes. Any frame can be decoded
+// from the start of its chunk, which the index at the end of the file points to.
+
+const char TrajectoryMagic[8] = { 'B', 'A', 'L', 'L', 'T', 'R', 'A', 'J' };
+const uint32_t TrajectoryVersion = 2;
+const uint32_t TrajectoryChunkMagic = 0x4B4E4843; // "CHNK"
+const uint32_t TrajectoryIndexMagic = 0x58444E49; // "INDX"
+const uint32_t TrajectoryDeltaFlag = 1;
+
+const uint32_t FramesPerChunk = 64;
+const size_t RecorderQueueDepth = 8;
+
+struct TrajectoryHeader
+{
+    char Magic[8];
+    uint32_t Version;
+    uint32_t Flags;
+    uint32_t BallCount;
+    uint32_t FramesPerChunk;
+    uint32_t Interval;  // Simulation frames between two recorded ones, unless some were dropped
+    float TimeStep;     // Simulated time of one simulation frame
+    uint64_t Seed;
+};
+
+struct TrajectoryChunk
+{
+    uint32_t Magic;
+    uint32_t FrameCount;
+    uint64_t FirstFrame;    // Recorded frame number of its first frame
+    uint64_t PayloadBytes;  // Frame numbers and frames
+};
+
+struct TrajectoryFooter
+{
+    uint64_t ChunkCount;
+    uint64_t IndexOffset;
+    uint32_t Magic;
+    uint32_t Padding;
+};
+
+//*********************************************************
+// Encoding
+//*********************************************************
+
+void write_varint(std::vector<unsigned char>& out, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((unsigned char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((unsigned char)value);
+}
+
+// Returns nullptr when the varint runs past end
+const unsigned char* read_varint(const unsigned char* in, const unsigned char* end, uint32_t& value)
+{
+    value = 0;
+    for (unsigned int shift = 0; in < end && shift < 35; shift += 7)
+    {
+        unsigned char byte = *in++;
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            return in;
+        }
+    }
+    return nullptr;
+}
+
+void encode_frame(std::vector<unsigned char>& out, const uint32_t* frame, const uint32_t* previous, size_t words, bool delta)
+{
+    if (!delta || !previous)
+    {
+        const unsigned char* bytes = (const unsigned char*)frame;
+        out.insert(out.end(), bytes, bytes + words * sizeof(uint32_t));
+        return;
+    }
+
+    for (size_t i = 0; i < words; ++i)
+    {
+        int32_t delta = (int32_t)(frame[i] - previous[i]);
+        write_varint(out, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+    }
+}
+
+//*********************************************************
+// Writer
+//*********************************************************
+
+struct TrajectoryRecorder
+{
+    FILE* File;
+    TrajectoryHeader Header;
+    bool Failed; // Written by the writer thread, read after it joined
+
+    // Ring of frame slots, 4 words per ball. The loop fills Slots[Head % depth],
+    // the writer drains Slots[Tail % depth].
+    std::vector<std::vector<uint32_t>> Slots;
+    std::vector<uint64_t> SlotFrames; // Simulation frame of every slot
+    std::atomic<uint64_t> Head;
+    std::atomic<uint64_t> Tail;
+    std::atomic<bool> Stop;
+    unsigned long long Dropped;
+
+    std::thread Writer;
+
+    // Writer thread only
+    std::vector<unsigned char> Chunk;
+    std::vector<uint64_t> ChunkFrameNumbers;
+    std::vector<uint32_t> Previous;
+    uint32_t ChunkFrames;
+    uint64_t FramesWritten;
+    uint64_t FileOffset; // ftell is 32 bits on Windows
+    std::vector<uint64_t> ChunkOffsets;
+};
+
+size_t FrameWords(const TrajectoryRecorder& recorder)
+{
+    return (size_t)recorder.Header.BallCount * 4;
+}
+
+void FlushChunk(TrajectoryRecorder& recorder)
+{
+    if (recorder.ChunkFrames == 0 || recorder.Failed)
+    {
+        return;
+    }
+
+    size_t numberBytes = recorder.ChunkFrameNumbers.size() * sizeof(uint64_t);
+    TrajectoryChunk chunk{ TrajectoryChunkMagic, recorder.ChunkFrames, recorder.FramesWritten - recorder.ChunkFrames, numberBytes + recorder.Chunk.size() };
+    recorder.ChunkOffsets.push_back(recorder.FileOffset);
+    if (fwrite(&chunk, sizeof(chunk), 1, recorder.File) != 1
+        || fwrite(recorder.ChunkFrameNumbers.data(), 1, numberBytes, recorder.File) != numberBytes
+        || fwrite(recorder.Chunk.data(), 1, recorder.Chunk.size(), recorder.File) != recorder.Chunk.size())
+    {
+        recorder.Failed = true;
+    }
+    recorder.FileOffset += sizeof(chunk) + chunk.PayloadBytes;
+
+    recorder.Chunk.clear();
+    recorder.ChunkFrameNumbers.clear();
+    recorder.ChunkFrames = 0;
+}
+
+void WriteFrame(TrajectoryRecorder& recorder, const std::vector<uint32_t>& frame, uint64_t simulationFrame)
+{
+    recorder.ChunkFrameNumbers.push_back(simulationFrame);
+    bool delta = (recorder.Header.Flags & TrajectoryDeltaFlag) != 0;
+    encode_frame(recorder.Chunk, frame.data(), recorder.ChunkFrames > 0 ? recorder.Previous.data() : nullptr, frame.size(), delta);
+    if (delta)
+    {
+        recorder.Previous = frame;
+    }
+
+    ++recorder.ChunkFrames;
+    ++recorder.FramesWritten;
+    if (recorder.ChunkFrames == recorder.Header.FramesPerChunk)
+    {
+        FlushChunk(recorder);
+    }
+}
+
+void RecorderWriter(TrajectoryRecorder& recorder)
+{
+    while (true)
+    {
+        uint64_t tail = recorder.Tail.load(std::memory_order_relaxed);
+        if (tail == recorder.Head.load(std::memory_order_acquire))
+        {
+            // Stop is only set after the last frame was published
+            if (recorder.Stop.load(std::memory_order_acquire) && tail == recorder.Head.load(std::memory_order_acquire))
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        size_t slot = tail % recorder.Slots.size();
+        WriteFrame(recorder, recorder.Slots[slot], recorder.SlotFrames[slot]);
+        recorder.Tail.store(tail + 1, std::memory_order_release);
+    }
+
+    FlushChunk(recorder);
+}
+
+bool StartRecorder(TrajectoryRecorder& recorder, const std::string& fileName, uint32_t ballCount, uint32_t interval, float timeStep,
+                   uint64_t seed, bool delta)
+{
+    recorder.File = fopen(fileName.c_str(), "wb");
+    if (!recorder.File)
+    {
+        std::cerr << "Could not open " << fileName << " for recording" << std::endl;
+        return false;
+    }
+
+    std::memcpy(recorder.Header.Magic, TrajectoryMagic, sizeof(TrajectoryMagic));
+    recorder.Header.Version = TrajectoryVersion;
+    recorder.Header.Flags = delta ? TrajectoryDeltaFlag : 0;
+    recorder.Header.BallCount = ballCount;
+    recorder.Header.FramesPerChunk = FramesPerChunk;
+    recorder.Header.Interval = interval;
+    recorder.Header.TimeStep = timeStep;
+    recorder.Header.Seed = seed;
+    if (fwrite(&recorder.Header, sizeof(TrajectoryHeader), 1, recorder.File) != 1)
+    {
+        fclose(recorder.File);
+        recorder.File = nullptr;
+        return false;
+    }
+
+    recorder.Failed = false;
+    recorder.Slots.assign(RecorderQueueDepth, std::vector<uint32_t>(FrameWords(recorder)));
+    recorder.SlotFrames.assign(RecorderQueueDepth, 0);
+    recorder.Head = 0;
+    recorder.Tail = 0;
+    recorder.Stop = false;
+    recorder.Dropped = 0;
+    recorder.ChunkFrameNumbers.clear();
+    recorder.ChunkFrames = 0;
+    recorder.FramesWritten = 0;
+    recorder.FileOffset = sizeof(TrajectoryHeader);
+    recorder.ChunkOffsets.clear();
+    recorder.Writer = std::thread(RecorderWriter, std::ref(recorder));
+    return true;
+}
+
+// Where the next frame goes, nullptr when the writer is behind and the ring
+// is full, unless wait is set. Fill the positions then the velocities and
+// publish it.
+cl_float2* AcquireFrameSlot(TrajectoryRecorder& recorder, bool wait = false)
+{
+    uint64_t head = recorder.Head.load(std::memory_order_relaxed);
+    while (head - recorder.Tail.load(std::memory_order_acquire) == recorder.Slots.size())
+    {
+        if (!wait)
+        {
+            ++recorder.Dropped;
+            return nullptr;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return (cl_float2*)recorder.Slots[head % recorder.Slots.size()].data();
+}
+
+void PublishFrameSlot(TrajectoryRecorder& recorder, uint64_t simulationFrame)
+{
+    uint64_t head = recorder.Head.load(std::memory_order_relaxed);
+    recorder.SlotFrames[head % recorder.Slots.size()] = simulationFrame;
+    recorder.Head.store(head + 1, std::memory_order_release);
+}
+
+// Writes what is still queued, the index and the footer
+bool StopRecorder(TrajectoryRecorder& recorder)
+{
+    if (!recorder.File)
+    {
+        return false;
+    }
+
+    recorder.Stop.store(true, std::memory_order_release);
+    recorder.Writer.join();
+
+    TrajectoryFooter footer{ recorder.ChunkOffsets.size(), recorder.FileOffset, TrajectoryIndexMagic, 0 };
+    bool success = !recorder.Failed
+        && fwrite(recorder.ChunkOffsets.data(), sizeof(uint64_t), recorder.ChunkOffsets.size(), recorder.File) == recorder.ChunkOffsets.size()
+        && fwrite(&footer, sizeof(footer), 1, recorder.File) == 1;
+    success = fclose(recorder.File) == 0 && success;
+    recorder.File = nullptr;
+
+    std::cout << "Recorded " << recorder.FramesWritten << " frames";
+    if (recorder.Dropped > 0)
+    {
+        std::cout << ", dropped " << recorder.Dropped << " while the writer was behind";
+    }
+    std::cout << std::endl;
+
+    if (!success)
+    {
+        std::cerr << "Writing the recording failed!" << std::endl;
+    }
+    return success;
+}
+
+//*********************************************************
+// Reader
+//*********************************************************
+
+struct TrajectoryReader
+{
+    MappedFile File;
+    const TrajectoryHeader* Header;
+    std::vector<uint64_t> ChunkOffsets;
+    uint64_t FrameCount;
+};
+
+void CloseTrajectory(TrajectoryReader& reader)
+{
+    UnmapFile(reader.File);
+    reader = TrajectoryReader{};
+}
+
+const TrajectoryChunk* GetChunk(TrajectoryReader& reader, uint64_t offset)
+{
+    if (offset + sizeof(TrajectoryChunk) > reader.File.Size)
+    {
+        return nullptr;
+    }
+
+    const TrajectoryChunk* chunk = (const TrajectoryChunk*)(reader.File.Data + offset);
+    if (chunk->Magic != TrajectoryChunkMagic || chunk->PayloadBytes > reader.File.Size - offset - sizeof(TrajectoryChunk))
+    {
+        return nullptr;
+    }
+    return chunk;
+}
+
+// Uses the index when the recording was closed properly, otherwise walks the
+// chunks that made it to the disk
+bool OpenTrajectory(TrajectoryReader& reader, const std::string& fileName)
+{
+    reader = TrajectoryReader{};
+    if (!MapFile(reader.File, fileName))
+    {
+        std::cerr << "Could not map " << fileName << std::endl;
+        return false;
+    }
+
+    reader.Header = (const TrajectoryHeader*)reader.File.Data;
+    if (reader.File.Size < sizeof(TrajectoryHeader) || std::memcmp(reader.Header->Magic, TrajectoryMagic, sizeof(TrajectoryMagic)) != 0
+        || reader.Header->Version != TrajectoryVersion || reader.Header->FramesPerChunk == 0)
+    {
+        std::cerr << fileName << " is not a trajectory recording of this version" << std::endl;
+        CloseTrajectory(reader);
+        return false;
+    }
+
+    const TrajectoryFooter* footer = nullptr;
+    if (reader.File.Size >= sizeof(TrajectoryHeader) + sizeof(TrajectoryFooter))
+    {
+        footer = (const TrajectoryFooter*)(reader.File.Data + reader.File.Size - sizeof(TrajectoryFooter));
+        uint64_t indexEnd = footer->IndexOffset + footer->ChunkCount * sizeof(uint64_t);
+        if (footer->Magic != TrajectoryIndexMagic || indexEnd != reader.File.Size - sizeof(TrajectoryFooter))
+        {
+            footer = nullptr;
+        }
+    }
+
+    if (footer)
+    {
+        const uint64_t* offsets = (const uint64_t*)(reader.File.Data + footer->IndexOffset);
+        reader.ChunkOffsets.assign(offsets, offsets + footer->ChunkCount);
+    }
+    else
+    {
+        uint64_t offset = sizeof(TrajectoryHeader);
+        while (const TrajectoryChunk* chunk = GetChunk(reader, offset))
+        {
+            reader.ChunkOffsets.push_back(offset);
+            offset += sizeof(TrajectoryChunk) + chunk->PayloadBytes;
+        }
+    }
+
+    for (uint64_t offset : reader.ChunkOffsets)
+    {
+        const TrajectoryChunk* chunk = GetChunk(reader, offset);
+        if (!chunk)
+        {
+            std::cerr << fileName << " has a broken chunk index" << std::endl;
+            CloseTrajectory(reader);
+            return false;
+        }
+        reader.FrameCount = chunk->FirstFrame + chunk->FrameCount;
+    }
+
+    return true;
+}
+
+// Decodes recorded frame number frame and the simulation frame it was taken
+// at. The positions, velocities and simulationFrame may be nullptr.
+bool ReadTrajectoryFrame(TrajectoryReader& reader, uint64_t frame, cl_float2* positions, cl_float2* velocities, uint64_t* simulationFrame = nullptr)
+{
+    uint64_t chunkIndex = frame / reader.Header->FramesPerChunk;
+    if (frame >= reader.FrameCount || chunkIndex >= reader.ChunkOffsets.size())
+    {
+        return false;
+    }
+
+    const TrajectoryChunk* chunk = GetChunk(reader, reader.ChunkOffsets[chunkIndex]);
+    uint64_t frameInChunk = frame - chunk->FirstFrame;
+    size_t words = (size_t)reader.Header->BallCount * 4;
+    size_t frameBytes = words * sizeof(uint32_t);
+
+    const unsigned char* in = (const unsigned char*)(chunk + 1);
+    const unsigned char* end = in + chunk->PayloadBytes;
+    std::vector<uint32_t> decoded(words);
+
+    size_t numberBytes = (size_t)chunk->FrameCount * sizeof(uint64_t);
+    if (frameInChunk >= chunk->FrameCount || (size_t)(end - in) < numberBytes)
+    {
+        return false;
+    }
+    if (simulationFrame)
+    {
+        std::memcpy(simulationFrame, in + frameInChunk * sizeof(uint64_t), sizeof(uint64_t));
+    }
+    in += numberBytes;
+
+    if (!(reader.Header->Flags & TrajectoryDeltaFlag))
+    {
+        // Fixed size frames, jump straight to it
+        if ((size_t)(end - in) < (frameInChunk + 1) * frameBytes)
+        {
+            return false;
+        }
+        in += frameInChunk * frameBytes;
+        std::memcpy(decoded.data(), in, frameBytes);
+    }
+    else
+    {
+        if ((size_t)(end - in) < frameBytes)
+        {
+            return false;
+        }
+        std::memcpy(decoded.data(), in, frameBytes);
+        in += frameBytes;
+
+        for (uint64_t f = 1; f <= frameInChunk; ++f)
+        {
+            for (size_t i = 0; i < words; ++i)
+            {
+                uint32_t zigzag = 0;
+                in = read_varint(in, end, zigzag);
+                if (!in)
+                {
+                    return false;
+                }
+                decoded[i] += (zigzag >> 1) ^ (0u - (zigzag & 1));
+            }
+        }
+    }
+
+    size_t ballCount = reader.Header->BallCount;
+    if (positions)
+    {
+        std::memcpy(positions, decoded.data(), ballCount * sizeof(cl_float2));
+    }
+    if (velocities)
+    {
+        std::memcpy(velocities, decoded.data() + ballCount * 2, ballCount * sizeof(cl_float2));
+    }
+    return true;
+}
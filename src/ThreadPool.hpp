@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool
+//
+// Every thread, the caller of ParallelFor included, has its own queue of
+// ranges. A thread takes work from the back of its own queue and, once that
+// is empty, steals from the front of the others, so a thread that got cheap
+// ranges (empty cells, few contacts) helps with the expensive ones instead of
+// idling at the end of the loop.
+
+struct PoolTask
+{
+    const std::function<void(size_t, size_t)>* Func;
+    size_t Begin;
+    size_t End;
+    std::atomic<size_t>* Remaining;
+};
+
+struct WorkerQueue
+{
+    std::mutex Mutex;
+    std::deque<PoolTask> Tasks;
+};
+
+struct WorkStealingPool
+{
+    std::vector<std::thread> Threads;
+    std::vector<std::unique_ptr<WorkerQueue>> Queues; // Queue 0 belongs to the calling thread
+
+    std::mutex WakeMutex;
+    std::condition_variable Wake;
+    std::atomic<size_t> Queued;
+    bool Stop;
+};
+
+bool TryPopTask(WorkStealingPool& pool, size_t self, PoolTask& task)
+{
+    size_t queueCount = pool.Queues.size();
+    for (size_t offset = 0; offset < queueCount; ++offset)
+    {
+        WorkerQueue& queue = *pool.Queues[(self + offset) % queueCount];
+        std::lock_guard<std::mutex> lock(queue.Mutex);
+        if (queue.Tasks.empty())
+        {
+            continue;
+        }
+
+        // Own work from the back, stolen work from the front
+        if (offset == 0)
+        {
+            task = queue.Tasks.back();
+            queue.Tasks.pop_back();
+        }
+        else
+        {
+            task = queue.Tasks.front();
+            queue.Tasks.pop_front();
+        }
+
+        --pool.Queued;
+        return true;
+    }
+
+    return false;
+}
+
+void RunPoolTask(PoolTask& task)
+{
+    (*task.Func)(task.Begin, task.End);
+    --*task.Remaining;
+}
+
+void PoolWorker(WorkStealingPool& pool, size_t self)
+{
+    while (true)
+    {
+        PoolTask task;
+        if (TryPopTask(pool, self, task))
+        {
+            RunPoolTask(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(pool.WakeMutex);
+        pool.Wake.wait(lock, [&]() { return pool.Stop || pool.Queued > 0; });
+        if (pool.Stop)
+        {
+            return;
+        }
+    }
+}
+
+// threadCount includes the calling thread, 0 means one per hardware thread
+void StartPool(WorkStealingPool& pool, unsigned int threadCount)
+{
+    if (threadCount == 0)
+    {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    pool.Stop = false;
+    pool.Queued = 0;
+    for (unsigned int i = 0; i < threadCount; ++i)
+    {
+        pool.Queues.emplace_back(new WorkerQueue());
+    }
+
+    for (unsigned int i = 1; i < threadCount; ++i)
+    {
+        pool.Threads.emplace_back(PoolWorker, std::ref(pool), i);
+    }
+}
+
+void StopPool(WorkStealingPool& pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.WakeMutex);
+        pool.Stop = true;
+    }
+    pool.Wake.notify_all();
+
+    for (std::thread& thread : pool.Threads)
+    {
+        thread.join();
+    }
+    pool.Threads.clear();
+    pool.Queues.clear();
+}
+
+// Calls func(first, last) over [begin, end) in ranges of about grain items
+// and returns once all of them are done
+void ParallelFor(WorkStealingPool& pool, size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& func)
+{
+    if (begin >= end)
+    {
+        return;
+    }
+
+    grain = std::max((size_t)1, grain);
+    size_t taskCount = (end - begin + grain - 1) / grain;
+    if (taskCount == 1 || pool.Queues.size() == 1)
+    {
+        func(begin, end);
+        return;
+    }
+
+    std::atomic<size_t> remaining(taskCount);
+
+    // Count the tasks before they are visible, so a thief popping one right
+    // away never takes Queued below zero
+    {
+        std::lock_guard<std::mutex> lock(pool.WakeMutex);
+        pool.Queued += taskCount;
+    }
+
+    // Deal the ranges out in contiguous blocks so neighbouring ranges stay on one thread
+    size_t queueCount = pool.Queues.size();
+    for (size_t q = 0; q < queueCount; ++q)
+    {
+        WorkerQueue& queue = *pool.Queues[q];
+        std::lock_guard<std::mutex> lock(queue.Mutex);
+        for (size_t t = taskCount * q / queueCount; t < taskCount * (q + 1) / queueCount; ++t)
+        {
+            queue.Tasks.push_back({ &func, begin + t * grain, std::min(end, begin + (t + 1) * grain), &remaining });
+        }
+    }
+    pool.Wake.notify_all();
+
+    while (remaining > 0)
+    {
+        PoolTask task;
+        if (TryPopTask(pool, 0, task))
+        {
+            RunPoolTask(task);
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+}
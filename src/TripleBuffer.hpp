@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+
+// Lock-free triple buffer
+//
+// One writer and one reader pass whole snapshots without waiting on each
+// other. The writer fills the back slot and swaps it with the middle one, the
+// reader swaps the middle slot with its front one whenever a newer snapshot
+// was published. The writer always has a slot to fill and the reader always
+// has the latest complete one, snapshots published in between are skipped.
+
+const unsigned int TripleBufferFresh = 4; // Set on Middle while it holds an unread snapshot
+
+template <typename T>
+struct TripleBuffer
+{
+    T Slots[3];
+    std::atomic<unsigned int> Middle; // Slot index, or'ed with TripleBufferFresh
+    unsigned int Back;                // Owned by the writer
+    unsigned int Front;               // Owned by the reader
+};
+
+// Every slot starts as a copy of initial, the reader sees it until the first publish
+template <typename T>
+void InitTripleBuffer(TripleBuffer<T>& buffer, const T& initial)
+{
+    for (T& slot : buffer.Slots)
+    {
+        slot = initial;
+    }
+    buffer.Front = 0;
+    buffer.Middle = 1;
+    buffer.Back = 2;
+}
+
+// The slot the writer fills next
+template <typename T>
+T& WriteSlot(TripleBuffer<T>& buffer)
+{
+    return buffer.Slots[buffer.Back];
+}
+
+// Hands the filled slot to the reader and takes the middle one back
+template <typename T>
+void PublishWrite(TripleBuffer<T>& buffer)
+{
+    unsigned int previous = buffer.Middle.exchange(buffer.Back | TripleBufferFresh, std::memory_order_acq_rel);
+    buffer.Back = previous & ~TripleBufferFresh;
+}
+
+// Takes the latest published snapshot if there is a newer one than the
+// front slot, and returns whether it did
+template <typename T>
+bool AcquireLatest(TripleBuffer<T>& buffer)
+{
+    if (!(buffer.Middle.load(std::memory_order_relaxed) & TripleBufferFresh))
+    {
+        return false;
+    }
+
+    unsigned int previous = buffer.Middle.exchange(buffer.Front, std::memory_order_acq_rel);
+    buffer.Front = previous & ~TripleBufferFresh;
+    return true;
+}
+
+// The snapshot the reader holds
+template <typename T>
+const T& ReadSlot(TripleBuffer<T>& buffer)
+{
+    return buffer.Slots[buffer.Front];
+}
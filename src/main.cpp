@@ -1,10 +1,23 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <iostream>
+#include <memory>
 #include <thread>
+#include <vector>
 
 #include "BallUtils.hpp"
 #include "GLUtils.hpp"
 #include "CLUtils.hpp"
+#include "CLTuner.hpp"
+#include "CLMultiDevice.hpp"
+#include "Backend.hpp"
+#include "NativeBackend.hpp"
+#include "Options.hpp"
+#include "Checkpoint.hpp"
+#include "Profiler.hpp"
+#include "Recorder.hpp"
+#include "TripleBuffer.hpp"
 
 //*********************************************************
 // Constants
@@ -12,6 +25,13 @@
 const unsigned int FrameRate = 30;
 const float FrameTime = 1.0f / FrameRate;
 
+// How often a window with --profile prints the rolling summary
+const double ProfileReportSeconds = 5.0;
+
+// Late steps the simulation thread runs back to back before it drops the
+// backlog instead, so a long stall doesn't turn into a burst of steps
+const unsigned int MaxCatchUpSteps = 5;
+
 
 static void error_callback(int error, const char* description)
 {
@@ -25,7 +45,7 @@ double do_frame_rate_limiting(double& lastFrameStartTime)
     double deltaTime = currentTime - lastFrameStartTime;
     if (deltaTime < FrameTime)
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds((unsigned int)((FrameTime - deltaTime) * 1000)));
+        std::this_thread::sleep_for(std::chrono::duration<double>(FrameTime - deltaTime));
     }
 
     currentTime = glfwGetTime();
@@ -36,113 +56,859 @@ double do_frame_rate_limiting(double& lastFrameStartTime)
     return deltaT;
 }
 
-void display_background()
+bool init_simulation(SimOptions& options, BallState& state, CLBallState& clBallState, CLState& clState)
 {
-    for (int x = 0; x < 4; ++x)
+    // Shared buffers are drawn as they are, reordered balls would get the wrong colours
+    bool glSharing = !options.Headless && options.SingleThread && options.GLSharing && !options.ReorderEvery;
+
+    // The simulation thread has no GL context, so its steps always come back through the host
+    if (!options.Headless && !options.SingleThread && options.GLSharing && !options.ReorderEvery && GLSharingSupported())
+    {
+        std::cout << "Reading positions back for the simulation thread, --single-thread shares them with OpenGL and pipelines the readback instead" << std::endl;
+    }
+    if (InitOpenCL(state, clBallState, clState, glSharing, options.Profile))
+    {
+        std::cout << "INIT OPENCL FAILED!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!" << std::endl;
+        return false;
+    }
+    else
+    {
+        std::cout << "INIT OPENCL SUCCESS" << std::endl;
+    }
+
+    if (!InitKernels(clBallState, clState, options.Collisions, options.Retune))
+    {
+        return false;
+    }
+
+    if (options.Sleeping && !InitSleeping(clState, clBallState))
+    {
+        std::cerr << "InitSleeping failed!" << std::endl;
+        return false;
+    }
+
+    if (options.SweptCollisions && !InitSweptCollisions(clState, clBallState))
     {
-        for (int y = 0; y < 4; ++y)
+        std::cerr << "InitSweptCollisions failed!" << std::endl;
+        return false;
+    }
+
+    if (options.ReorderEvery && !InitReordering(clState, clBallState, options.ReorderEvery))
+    {
+        std::cerr << "InitReordering failed!" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool init_multi_device(SimOptions& options, BallState& state, CLMultiDevice& multi)
+{
+    if (!InitMultiDevice(multi, state, options.SubDevices))
+    {
+        std::cout << "INIT OPENCL FAILED!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!" << std::endl;
+        return false;
+    }
+
+    for (CLSlab& slab : multi.Slabs)
+    {
+        std::cout << "Device: " << GetDeviceString(slab.CL.Device, CL_DEVICE_NAME) << std::endl;
+        if (!InitKernels(slab.Balls, slab.CL, options.Collisions, options.Retune))
         {
-            float posX = ((float)(2 * x) + 1) * (float)WinSize / 8;
-            float posY = ((float)(2 * y) + 1) * (float)WinSize / 8;
-            DrawGradientSquare(glm::vec2{posX, posY});
+            ReleaseMultiDevice(multi);
+            return false;
         }
     }
+
+    std::cout << "INIT OPENCL SUCCESS on " << multi.Slabs.size() << " devices" << std::endl;
+    return true;
 }
 
+// Starts timing a queue once the tuner is done with it
+void profile_queue(CLState& clState, Profiler* profiler)
+{
+    if (profiler)
+    {
+        clState.Profile = profiler;
+        clState.ProfileTrack = AddProfileTrack(*profiler, GetDeviceString(clState.Device, CL_DEVICE_NAME));
+    }
+}
 
-void display_circles(BallState& state)
+// Sets up the engine picked with --backend, nullptr if it can't run here.
+// The vertex buffers are only used by OpenCL when it can share them with GL.
+std::unique_ptr<SimBackend> create_backend(SimOptions& options, BallState& state, Profiler* profiler, GLuint positionVBO = 0, GLuint positionOutVBO = 0)
 {
-    for (auto i = 0; i < state.Count; ++i)
+    if (options.Backend != BackendKind::Native)
     {
-        DrawCircle(glm::vec2 {state.Position[i].x, state.Position[i].y}, state.Color[i], state.Radius[i]);
+        if (options.MultiDevice)
+        {
+            std::unique_ptr<CLMultiDeviceBackend> multi(new CLMultiDeviceBackend(state));
+            multi->Initialized = init_multi_device(options, state, multi->Multi);
+            if (multi->Initialized)
+            {
+                for (CLSlab& slab : multi->Multi.Slabs)
+                {
+                    profile_queue(slab.CL, profiler);
+                }
+                return multi;
+            }
+        }
+        else
+        {
+            std::unique_ptr<CLBackend> cl(new CLBackend());
+            cl->Balls.PositionGLBuf = positionVBO;
+            cl->Balls.PositionOutGLBuf = positionOutVBO;
+            cl->Initialized = init_simulation(options, state, cl->Balls, cl->State);
+            if (cl->Initialized)
+            {
+                profile_queue(cl->State, profiler);
+                if (options.Readback != ReadbackFormat::Float && !InitPositionPacker(cl->Packer, cl->State, cl->Balls, options.Readback))
+                {
+                    std::cout << "Reading back full precision positions instead" << std::endl;
+                }
+                // A single thread culls into the renderer's draw list, see run_windowed
+                if (options.Cull && !options.SingleThread && !InitCuller(cl->Culler, cl->State, cl->Balls))
+                {
+                    std::cout << "Culling the balls on the host instead" << std::endl;
+                }
+                return cl;
+            }
+        }
+
+        if (options.Backend == BackendKind::OpenCL)
+        {
+            return nullptr;
+        }
+
+        std::cout << "Falling back to the native backend" << std::endl;
+        if (options.Sleeping)
+        {
+            std::cout << "The native backend has no sleeping balls, all of them are simulated" << std::endl;
+        }
+        if (options.SweptCollisions)
+        {
+            std::cout << "The native backend has no swept collisions, keep the time step small" << std::endl;
+        }
+        if (options.ReorderEvery)
+        {
+            std::cout << "The native backend keeps the balls in creation order" << std::endl;
+        }
     }
+
+    std::unique_ptr<NativeBackend> native(new NativeBackend(state, options.Threads));
+    std::cout << "Native backend on " << native->ThreadCount() << " threads" << std::endl;
+    return native;
 }
 
+// Waits for the last device times, then reports them
+void finish_profile(SimOptions& options, Profiler* profiler)
+{
+    if (!profiler)
+    {
+        return;
+    }
 
-int main(int argc, char **argv)
+    CollectDeviceEvents(*profiler, true);
+    PrintProfileSummary(*profiler);
+    if (!options.TraceFile.empty())
+    {
+        WriteChromeTrace(*profiler, options.TraceFile);
+    }
+}
+
+// Hands the current state to the recorder's writer thread, skipped when its
+// queue is full unless wait is set
+bool record_frame(SimBackend& backend, TrajectoryRecorder& recorder, int ballCount, uint64_t frame, bool wait = false)
 {
-    GLFWwindow* window;
+    cl_float2* slot = AcquireFrameSlot(recorder, wait);
+    if (!slot)
+    {
+        return true;
+    }
 
-    glfwSetErrorCallback(error_callback);
-    if (!glfwInit())
+    if (!backend.ReadPositions(slot) || !backend.ReadVelocities(slot + ballCount))
     {
-        std::cout << "[ERROR][GLFW]: Failed to init GLFW" << std::endl;
-        return -1;
+        return false;
     }
 
-    window = glfwCreateWindow(WinSize, WinSize, "COMP 426 A1", nullptr, nullptr);
-    if (!window)
+    PublishFrameSlot(recorder, frame);
+    return true;
+}
+
+// Prints every frame of a recording made with --record, ball by ball
+int dump_recording(const std::string& fileName)
+{
+    TrajectoryReader reader;
+    if (!OpenTrajectory(reader, fileName))
     {
-        glfwTerminate();
-        std::cout << "[ERROR][GLFW]: Failed to create GLFW window" << std::endl;
         return -1;
     }
 
-    glfwMakeContextCurrent(window);
+    const TrajectoryHeader& header = *reader.Header;
+    std::cout << fileName << ": " << header.BallCount << " balls, " << reader.FrameCount << " frames recorded every " << header.Interval
+              << " frames of " << header.TimeStep << "s, seed " << header.Seed << (header.Flags & TrajectoryDeltaFlag ? ", delta compressed" : "") << std::endl;
 
-    // Host
-    int count = 0;
-    BallState state = initialize_balls(argc, argv, count);
+    std::vector<cl_float2> positions(header.BallCount);
+    std::vector<cl_float2> velocities(header.BallCount);
+    for (uint64_t frame = 0; frame < reader.FrameCount; ++frame)
+    {
+        uint64_t simulationFrame = 0;
+        if (!ReadTrajectoryFrame(reader, frame, positions.data(), velocities.data(), &simulationFrame))
+        {
+            std::cerr << "Frame " << frame << " of " << fileName << " is broken!" << std::endl;
+            CloseTrajectory(reader);
+            return -1;
+        }
+
+        std::cout << "Frame " << simulationFrame << " at " << simulationFrame * header.TimeStep << "s" << std::endl;
+        for (uint32_t i = 0; i < header.BallCount; ++i)
+        {
+            std::cout << "  " << i << ": position " << positions[i].x << " " << positions[i].y
+                      << ", velocity " << velocities[i].x << " " << velocities[i].y << std::endl;
+        }
+    }
 
-    CLBallState clBallState{};
-    CLState clState{};
-    if (InitOpenCL(state, clBallState, clState))
+    CloseTrajectory(reader);
+    return 0;
+}
+
+// A new scene, or the one saved with --checkpoint when restoring. startFrame
+// is the number of frames the scene was already simulated for.
+BallState load_scene(SimOptions& options, uint64_t& startFrame)
+{
+    startFrame = 0;
+    if (options.RestoreFile.empty())
     {
-        std::cout << "INIT OPENCL FAILED!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!" << std::endl;
+        return initialize_balls(options);
+    }
+
+    BallState state;
+    CheckpointHeader header;
+    if (!restore_balls(options.RestoreFile, state, header))
+    {
+        std::exit(-1);
+    }
+
+    check_ball_count(options, state.Count);
+    options.BallCount = state.Count;
+    options.Seed = header.Seed;
+    startFrame = header.Frame;
+
+    // Frame only counts simulated time in the checkpoint's steps
+    if (!options.ExplicitTimeStep)
+    {
+        options.TimeStep = header.TimeStep > 0 ? header.TimeStep : options.TimeStep;
+    }
+    else if (options.TimeStep != header.TimeStep)
+    {
+        std::cout << "Continuing with --dt " << options.TimeStep << " instead of the checkpoint's " << header.TimeStep
+                  << ", frame numbers no longer match the simulated time" << std::endl;
+    }
+    return state;
+}
+
+int run_headless(SimOptions& options, SimBackend& backend, BallState& state, uint64_t startFrame, Profiler* profiler, TrajectoryRecorder* recorder)
+{
+    int ballCount = state.Count;
+
+    float deltaT = options.TimeStep / options.Substeps;
+    if (!backend.SetTimeStep(deltaT))
+    {
+        std::cerr << "Failed to update delaT!!!" << std::endl;
         return -1;
     }
+
+    std::cout << "Running headless on the " << backend.Name() << " backend: ";
+    if (options.Steps > 0)
+    {
+        std::cout << options.Steps << " frames";
+    }
     else
     {
-        std::cout << "INIT OPENCL SUCCESS" << std::endl;
+        std::cout << options.Duration << " seconds";
+    }
+    std::cout << " of " << options.Substeps << " x dt = " << deltaT << "s" << std::endl;
+
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0.0;
+    unsigned long long frames = 0;
+
+    while (options.Steps > 0 ? frames < options.Steps : elapsed < options.Duration)
+    {
+        // The initial state, then every RecordEvery-th frame
+        if (recorder && frames % options.RecordEvery == 0)
+        {
+            ProfileScope recordScope(profiler, "record");
+            if (!record_frame(backend, *recorder, ballCount, startFrame + frames))
+            {
+                std::cerr << "Failed to read the state to record!!" << std::endl;
+                return -1;
+            }
+        }
+
+        {
+            ProfileScope frameScope(profiler, "frame");
+            if (!backend.Step(options.Substeps))
+            {
+                std::cerr << "Failed to run kernels!!" << std::endl;
+                return -1;
+            }
+        }
+
+        if (profiler)
+        {
+            CollectDeviceEvents(*profiler);
+        }
+
+        ++frames;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
     }
 
-    cl_uint winSize = (cl_uint)WinSize;
-    if (!SetBallUpdateKernelParamsInit(clBallState, clState, gravity, winSize))
+    // The loop records before stepping, so the state it ended in is still missing
+    if (recorder && !record_frame(backend, *recorder, ballCount, startFrame + frames, true))
     {
-        std::cerr << "SetBallUpdateKernelParamsInit failed!" << std::endl;
+        std::cerr << "Failed to read the state to record!!" << std::endl;
         return -1;
     }
 
-    if (!SetBallCollisionKernelParamsInit(clBallState, clState, winSize))
+    unsigned long long steps = frames * options.Substeps;
+    double stepsPerSecond = steps / elapsed;
+    std::cout << "Simulated " << steps << " steps (" << frames << " frames) of " << ballCount << " balls in " << elapsed << "s" << std::endl;
+    std::cout << "Steps per second: " << stepsPerSecond << std::endl;
+    std::cout << "Ball updates per second: " << stepsPerSecond * ballCount << std::endl;
+
+    CLBackend* clBackend = dynamic_cast<CLBackend*>(&backend);
+    cl_uint awake = 0;
+    if (clBackend && clBackend->Balls.Sleeping && ReadActiveCount(clBackend->State, clBackend->Balls, awake))
+    {
+        std::cout << "Awake at the end: " << awake << " of " << ballCount << " balls" << std::endl;
+    }
+
+    if (!options.CheckpointFile.empty() && !write_checkpoint(options.CheckpointFile, state, backend, options.TimeStep, options.Seed, startFrame + frames))
     {
-        std::cerr << "SetBallCollisionKernelParamsInit failed!" << std::endl;
         return -1;
     }
 
+    // Where the slab edges ended up after balancing
+    CLMultiDeviceBackend* multiBackend = dynamic_cast<CLMultiDeviceBackend*>(&backend);
+    if (multiBackend)
+    {
+        CLMultiDevice& multi = multiBackend->Multi;
+        for (size_t s = 0; s < multi.Slabs.size(); ++s)
+        {
+            std::cout << "Slab " << s << ": x in [" << multi.Edges[s] << ", " << multi.Edges[s + 1] << "), "
+                      << multi.Slabs[s].Owned.size() << " balls on " << GetDeviceString(multi.Slabs[s].CL.Device, CL_DEVICE_NAME) << std::endl;
+        }
+    }
+
+    return 0;
+}
+
+// Bounds of the balls to draw for view, grown so the balls overlapping it
+// from outside still get drawn
+void cull_bounds(const ViewRect& view, cl_float2& viewMin, cl_float2& viewMax)
+{
+    float margin = (float)MaxBallRadius;
+    viewMin = cl_float2{ view.Min.x - margin, view.Min.y - margin };
+    viewMax = cl_float2{ view.Min.x + view.Size + margin, view.Min.y + view.Size + margin };
+}
+
+// OpenCL gets the zero-copy and pipelined paths, any other backend steps and
+// reads back the positions every frame into positionVBO. Culling needs the
+// shared buffers, the kernels then compact the balls in view into the
+// renderer's draw list and only the count is read back.
+int run_windowed(SimOptions& options, BallState& state, SimBackend& backend, GLFWwindow* window, GLuint positionVBO, Profiler* profiler)
+{
+    CLBackend* clBackend = dynamic_cast<CLBackend*>(&backend);
+
+    CLFramePipeline pipeline{};
+    if (clBackend)
+    {
+        bool packed = clBackend->Packer.Format != ReadbackFormat::Float;
+        InitFramePipeline(pipeline, clBackend->State, clBackend->Balls, packed ? &clBackend->Packer : nullptr);
+    }
+
+    BackgroundRenderer backgroundRenderer{};
+    BallRenderer ballRenderer{};
+    if (!CreateBackgroundRenderer(backgroundRenderer) || !CreateBallRenderer(ballRenderer, state.Radius, state.Color, state.Count))
+    {
+        return -1;
+    }
+
+    bool glShared = clBackend && clBackend->Balls.GLShared;
+    if (glShared)
+    {
+        std::cout << "Drawing straight from the shared OpenCL position buffer" << std::endl;
+    }
+
+    CLCuller* culler = nullptr;
+    if (options.Cull && glShared && InitCuller(clBackend->Culler, clBackend->State, clBackend->Balls, ballRenderer.IdVBO, ballRenderer.ListPositionVBO))
+    {
+        culler = &clBackend->Culler;
+    }
+    else if (options.Cull)
+    {
+        std::cout << "Culling with --single-thread needs the shared OpenCL buffers, drawing every ball" << std::endl;
+    }
 
+    Camera camera;
+    InitCamera(camera, (float)WorldSize);
+    AttachCamera(window, camera);
 
+    int result = 0;
     double lastFrameStartTime = glfwGetTime();
+    double lastReportTime = lastFrameStartTime;
     while(!glfwWindowShouldClose(window))
     {
-        float deltaT = (float)do_frame_rate_limiting(lastFrameStartTime);
-        if (!BallUpdateBufferUpdate(clState, clBallState, deltaT))
+        float deltaT = 0.0f;
         {
-            std::cerr << "Failed to update delaT!!!" << std::endl;
-            return -1;
+            ProfileScope pacingScope(profiler, "frame pacing");
+            deltaT = (float)do_frame_rate_limiting(lastFrameStartTime);
+        }
+
+        ProfileScope frameScope(profiler, "frame");
+        if (options.FixedStep)
+        {
+            deltaT = options.TimeStep;
+        }
+
+        float stepDeltaT = deltaT / options.Substeps;
+        // Positions to upload for drawing, stays nullptr while the vertex
+        // buffer already holds what should be drawn
+        cl_float2* positions = nullptr;
+        {
+            ProfileScope simulateScope(profiler, "simulate");
+            if (!clBackend)
+            {
+                positions = state.Position;
+                if (!backend.SetTimeStep(stepDeltaT) || !backend.Step(options.Substeps) || !backend.ReadDrawPositions(positions))
+                {
+                    std::cerr << "Failed to run the " << backend.Name() << " backend!!" << std::endl;
+                    result = -1;
+                    break;
+                }
+            }
+            else if (glShared)
+            {
+                // Kernels write the vertex buffer that gets drawn, nothing to read back
+                if (culler)
+                {
+                    cull_bounds(CameraView(camera), culler->ViewMin, culler->ViewMax);
+                }
+                if (!RunSharedFrame(clBackend->State, clBackend->Balls, stepDeltaT, options.Substeps, culler))
+                {
+                    std::cerr << "Failed to run kernels!!" << std::endl;
+                    result = -1;
+                    break;
+                }
+            }
+            // Queue this frame's steps and readback, then draw the previous
+            // frame while the device works
+            else if (!EnqueueFrame(clBackend->State, clBackend->Balls, pipeline, stepDeltaT, options.Substeps))
+            {
+                std::cerr << "Failed to run kernels!!" << std::endl;
+                result = -1;
+                break;
+            }
+            else if (pipeline.Frame > 1)
+            {
+                ProfileScope waitScope(profiler, "wait for frame");
+                positions = WaitForFrame(clBackend->State, clBackend->Balls, pipeline, pipeline.Frame - 2);
+                if (!positions)
+                {
+                    std::cerr << "Failed to read buffer data!!!" << std::endl;
+                    result = -1;
+                    break;
+                }
+            }
+        }
+
+        {
+            ProfileScope drawScope(profiler, "draw");
+            glClear(GL_COLOR_BUFFER_BIT);
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+            // The kernels may have swapped which shared buffer holds the latest positions
+            GLuint drawVBO = clBackend ? clBackend->Balls.PositionGLBuf : positionVBO;
+            if (positions)
+            {
+                UploadVertexBuffer(drawVBO, positions, state.Count * sizeof(cl_float2));
+            }
+
+            DrawBackground(backgroundRenderer);
+            if (culler)
+            {
+                GLuint listVBO = ballRenderer.ListPositionVBO;
+                DrawBallList(ballRenderer, listVBO, listVBO, 1.0f, (int)culler->Visible, CameraView(camera));
+            }
+            else
+            {
+                DrawBalls(ballRenderer, drawVBO, drawVBO, 1.0f, state.Count, CameraView(camera));
+            }
+        }
+
+        {
+            ProfileScope swapScope(profiler, "swap buffers");
+            glfwSwapBuffers(window);
+        }
+        glfwPollEvents();
+
+        if (profiler)
+        {
+            CollectDeviceEvents(*profiler);
+            if (lastFrameStartTime - lastReportTime >= ProfileReportSeconds)
+            {
+                PrintProfileSummary(*profiler);
+                lastReportTime = lastFrameStartTime;
+            }
+        }
+    }
+
+    // The culler wraps the renderer's draw list, release it before the GL buffers go
+    if (culler)
+    {
+        ReleaseCuller(*culler);
+    }
+    DestroyBallRenderer(ballRenderer);
+    DestroyBackgroundRenderer(backgroundRenderer);
+    if (clBackend)
+    {
+        ReleaseFramePipeline(clBackend->State, pipeline);
+    }
+    return result;
+}
+
+// Positions after a simulation step and before it, so the render thread can
+// draw the balls anywhere in between. With culling only the balls in view are
+// in it, Ids holds which ones.
+struct StepSnapshot
+{
+    std::vector<cl_float2> Previous;
+    std::vector<cl_float2> Current;
+    std::vector<cl_uint> Ids;
+    std::chrono::steady_clock::time_point Published;
+};
+
+struct SimulationThread
+{
+    std::thread Thread;
+    TripleBuffer<StepSnapshot> Snapshots;
+    TripleBuffer<ViewRect> Views; // With culling, the camera's view from the render thread
+    std::atomic<bool> Running;
+    std::atomic<bool> Failed;
+};
+
+// Reads the balls in the latest view into snapshot. A ball that was also in
+// view after the last step starts from where it was then, one that just came
+// into view from where it is now. Both id lists are sorted.
+bool read_visible_step(SimOptions& options, SimBackend& backend, SimulationThread& sim, const StepSnapshot& last, StepSnapshot& snapshot)
+{
+    AcquireLatest(sim.Views);
+    const ViewRect& view = ReadSlot(sim.Views);
+
+    cl_float2 viewMin;
+    cl_float2 viewMax;
+    cull_bounds(view, viewMin, viewMax);
+    if (!backend.ReadVisiblePositions(options.BallCount, viewMin, viewMax, snapshot.Ids, snapshot.Current))
+    {
+        return false;
+    }
+
+    snapshot.Previous.resize(snapshot.Ids.size());
+    size_t k = 0;
+    for (size_t i = 0; i < snapshot.Ids.size(); ++i)
+    {
+        while (k < last.Ids.size() && last.Ids[k] < snapshot.Ids[i])
+        {
+            ++k;
+        }
+        bool wasVisible = k < last.Ids.size() && last.Ids[k] == snapshot.Ids[i];
+        snapshot.Previous[i] = wasVisible ? last.Current[k] : snapshot.Current[i];
+    }
+
+    return true;
+}
+
+// Steps the backend every TimeStep seconds of wall-clock time and publishes
+// the positions after each step, until Running is cleared
+void simulation_loop(SimOptions& options, SimBackend& backend, SimulationThread& sim, StepSnapshot last, Profiler* profiler, unsigned int track)
+{
+    using Clock = std::chrono::steady_clock;
+    Clock::duration period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.TimeStep));
+    Clock::time_point nextStep = Clock::now() + period;
+
+    while (sim.Running)
+    {
+        std::this_thread::sleep_until(nextStep);
+
+        {
+            ProfileScope stepScope(profiler, "simulate", track);
+            StepSnapshot& snapshot = WriteSlot(sim.Snapshots);
+            bool stepped = backend.Step(options.Substeps);
+            if (stepped && options.Cull)
+            {
+                stepped = read_visible_step(options, backend, sim, last, snapshot);
+            }
+            else if (stepped)
+            {
+                snapshot.Previous = last.Current;
+                stepped = backend.ReadDrawPositions(snapshot.Current.data());
+            }
+
+            if (!stepped)
+            {
+                std::cerr << "Failed to run the " << backend.Name() << " backend!!" << std::endl;
+                sim.Failed = true;
+                break;
+            }
+            last.Current = snapshot.Current;
+            if (options.Cull)
+            {
+                last.Ids = snapshot.Ids;
+            }
+            snapshot.Published = Clock::now();
+            PublishWrite(sim.Snapshots);
+        }
+
+        if (profiler)
+        {
+            CollectDeviceEvents(*profiler);
+        }
+
+        nextStep += period;
+        Clock::time_point now = Clock::now();
+        if (now - nextStep > MaxCatchUpSteps * period)
+        {
+            nextStep = now;
+        }
+    }
+}
+
+// Simulates on a thread of its own at a fixed rate while this thread draws
+// the latest step at the display's rate. The balls are drawn one step behind,
+// blended from the step before towards the latest one by the time since it
+// was published, so motion stays smooth whatever the two rates are. With
+// culling the simulation thread reads back only the balls in the camera's
+// view, which this thread hands it every frame.
+int run_threaded(SimOptions& options, BallState& state, SimBackend& backend, GLFWwindow* window, GLuint positionVBO, GLuint previousVBO, Profiler* profiler)
+{
+    BackgroundRenderer backgroundRenderer{};
+    BallRenderer ballRenderer{};
+    if (!CreateBackgroundRenderer(backgroundRenderer) || !CreateBallRenderer(ballRenderer, state.Radius, state.Color, state.Count))
+    {
+        return -1;
+    }
+
+    if (!backend.SetTimeStep(options.TimeStep / options.Substeps))
+    {
+        std::cerr << "Failed to update delaT!!!" << std::endl;
+        return -1;
+    }
+
+    Camera camera;
+    InitCamera(camera, (float)WorldSize);
+    AttachCamera(window, camera);
+
+    // Every ball to start with, the vertex buffers already hold them
+    using Clock = std::chrono::steady_clock;
+    std::vector<cl_float2> positions(state.Position, state.Position + state.Count);
+    std::vector<cl_uint> ids(state.Count);
+    for (int i = 0; i < state.Count; ++i)
+    {
+        ids[i] = (cl_uint)i;
+    }
+    StepSnapshot initial{ positions, positions, ids, Clock::now() };
+    if (options.Cull)
+    {
+        UploadDrawList(ballRenderer, ids.data(), ids.size());
+    }
+
+    SimulationThread sim;
+    InitTripleBuffer(sim.Snapshots, initial);
+    InitTripleBuffer(sim.Views, CameraView(camera));
+    sim.Running = true;
+    sim.Failed = false;
+
+    unsigned int track = profiler ? AddProfileTrack(*profiler, "Simulation", false) : 0;
+    sim.Thread = std::thread(simulation_loop, std::ref(options), std::ref(backend), std::ref(sim), initial, profiler, track);
+    std::cout << "Simulating on the " << backend.Name() << " backend every " << options.TimeStep << "s on its own thread" << std::endl;
+
+    // Presentation is paced by the display instead of a sleep
+    glfwSwapInterval(1);
+
+    double lastReportTime = glfwGetTime();
+    while (!glfwWindowShouldClose(window) && !sim.Failed)
+    {
+        ProfileScope frameScope(profiler, "frame");
+        ViewRect view = CameraView(camera);
+        if (options.Cull)
+        {
+            WriteSlot(sim.Views) = view;
+            PublishWrite(sim.Views);
         }
 
-        glClear(GL_COLOR_BUFFER_BIT);
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        {
+            ProfileScope drawScope(profiler, "draw");
+            if (AcquireLatest(sim.Snapshots))
+            {
+                const StepSnapshot& latest = ReadSlot(sim.Snapshots);
+                UploadVertexBuffer(previousVBO, latest.Previous.data(), latest.Previous.size() * sizeof(cl_float2));
+                UploadVertexBuffer(positionVBO, latest.Current.data(), latest.Current.size() * sizeof(cl_float2));
+                if (options.Cull)
+                {
+                    UploadDrawList(ballRenderer, latest.Ids.data(), latest.Ids.size());
+                }
+            }
+
+            double sincePublished = std::chrono::duration<double>(Clock::now() - ReadSlot(sim.Snapshots).Published).count();
+            float blend = (float)std::min(1.0, sincePublished / options.TimeStep);
+
+            glClear(GL_COLOR_BUFFER_BIT);
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            DrawBackground(backgroundRenderer);
+            if (options.Cull)
+            {
+                DrawBallList(ballRenderer, previousVBO, positionVBO, blend, (int)ReadSlot(sim.Snapshots).Current.size(), view);
+            }
+            else
+            {
+                DrawBalls(ballRenderer, previousVBO, positionVBO, blend, state.Count, view);
+            }
+        }
 
-        if (!RunKernels(clState, clBallState))
         {
-            std::cerr << "Failed to run kernels!!" << std::endl;
+            ProfileScope swapScope(profiler, "swap buffers");
+            glfwSwapBuffers(window);
+        }
+        glfwPollEvents();
+
+        double now = glfwGetTime();
+        if (profiler && now - lastReportTime >= ProfileReportSeconds)
+        {
+            PrintProfileSummary(*profiler);
+            lastReportTime = now;
+        }
+    }
+
+    sim.Running = false;
+    sim.Thread.join();
+
+    DestroyBallRenderer(ballRenderer);
+    DestroyBackgroundRenderer(backgroundRenderer);
+    return sim.Failed ? -1 : 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    SimOptions options = parse_options(argc, argv);
+    if (!options.DumpFile.empty())
+    {
+        return dump_recording(options.DumpFile);
+    }
+
+    Profiler profile;
+    Profiler* profiler = nullptr;
+    if (options.Profile)
+    {
+        InitProfiler(profile);
+        profiler = &profile;
+    }
+
+    if (options.Headless)
+    {
+        // Host
+        uint64_t startFrame = 0;
+        BallState state = load_scene(options, startFrame);
+
+        std::unique_ptr<SimBackend> backend = create_backend(options, state, profiler);
+        if (!backend)
+        {
+            free_balls(state);
             return -1;
         }
 
-        if(!ReadPositionBuffer(state, clBallState, clState))
+        TrajectoryRecorder recorder;
+        bool recording = !options.RecordFile.empty();
+        if (recording && !StartRecorder(recorder, options.RecordFile, state.Count, options.RecordEvery, options.TimeStep, options.Seed, !options.RecordRaw))
         {
-            std::cerr << "Failed to read buffer data!!!" << std::endl;
+            backend.reset();
+            free_balls(state);
             return -1;
         }
 
-        display_background();
-        display_circles(state);
+        int result = run_headless(options, *backend, state, startFrame, profiler, recording ? &recorder : nullptr);
+        finish_profile(options, profiler);
+        if (recording && !StopRecorder(recorder) && result == 0)
+        {
+            result = -1;
+        }
+
+        // The buffers may wrap the ball arrays, release them first
+        backend.reset();
+        free_balls(state);
+        return result;
+    }
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+    GLFWwindow* window;
+
+    glfwSetErrorCallback(error_callback);
+    if (!glfwInit())
+    {
+        std::cout << "[ERROR][GLFW]: Failed to init GLFW" << std::endl;
+        return -1;
     }
 
-    return 0;
-}
\ No newline at end of file
+    // Instanced drawing and buffer textures need 3.3, compatibility keeps the GLSL 1.20 shaders working
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_COMPAT_PROFILE);
+
+    window = glfwCreateWindow(WinSize, WinSize, "COMP 426 A1", nullptr, nullptr);
+    if (!window)
+    {
+        glfwTerminate();
+        std::cout << "[ERROR][GLFW]: Failed to create GLFW window" << std::endl;
+        return -1;
+    }
+
+    glfwMakeContextCurrent(window);
+
+    glewExperimental = GL_TRUE;
+    GLenum glewError = glewInit();
+    if (glewError != GLEW_OK)
+    {
+        glfwTerminate();
+        std::cout << "[ERROR][GLEW]: " << glewGetErrorString(glewError) << std::endl;
+        return -1;
+    }
+
+    // Host
+    uint64_t startFrame = 0;
+    BallState state = load_scene(options, startFrame);
+
+    // The balls are drawn from these. When shared, OpenCL writes them directly,
+    // otherwise the positions read back each frame are uploaded into them. The
+    // simulation thread's previous step goes to the second one.
+    size_t positionsSize = state.Count * sizeof(cl_float2);
+    GLuint positionVBO = CreateVertexBuffer(state.Position, positionsSize, GL_DYNAMIC_DRAW);
+    GLuint positionOutVBO = CreateVertexBuffer(state.Position, positionsSize, GL_DYNAMIC_DRAW);
+
+    std::unique_ptr<SimBackend> backend = create_backend(options, state, profiler, positionVBO, positionOutVBO);
+    if (!backend)
+    {
+        free_balls(state);
+        return -1;
+    }
+
+    int result = options.SingleThread ? run_windowed(options, state, *backend, window, positionVBO, profiler)
+                                      : run_threaded(options, state, *backend, window, positionVBO, positionOutVBO, profiler);
+    finish_profile(options, profiler);
+
+    backend.reset();
+    free_balls(state);
+    return result;
+}